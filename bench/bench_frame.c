@@ -0,0 +1,312 @@
+// Microbenchmarks of the framing kernels in src/frame.c.
+// Run by the Makefile: make bench
+//
+// Every kernel runs over a MAX_PAYLOAD_SIZE payload of each distribution
+// and reports ns/byte and CPU cycles/byte. Cycles come from
+// perf_event_open(); where it is not allowed (containers, a restrictive
+// perf_event_paranoid) the time stamp counter is used on x86 and the
+// column is left empty elsewhere.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../src/frame.h"
+#include "../src/link_layer.h"
+
+#define PAYLOAD_SIZE MAX_PAYLOAD_SIZE
+#define WIRE_SIZE (2 * PAYLOAD_SIZE + 16)
+#define MIN_NS 200000000L // Time each kernel runs for
+
+typedef enum
+{
+    CyclesNone,
+    CyclesPerf,
+    CyclesTsc,
+} CycleSource;
+
+static CycleSource g_source = CyclesNone;
+static int g_perf_fd = -1;
+
+static unsigned char g_payload[PAYLOAD_SIZE];
+static unsigned char g_ppp[WIRE_SIZE];
+static int g_pppLen;
+static unsigned char g_cobs[WIRE_SIZE];
+static int g_cobsLen;
+static unsigned char g_framePpp[WIRE_SIZE];
+static int g_framePppLen;
+static unsigned char g_frameCobs[WIRE_SIZE];
+static int g_frameCobsLen;
+static unsigned char g_out[WIRE_SIZE];
+static unsigned char g_rx[DEFRAMER_BUF_SIZE(PAYLOAD_SIZE + 1)];
+
+// Results are folded in here so the kernels are not optimised away
+static volatile unsigned g_sink;
+
+////////////////////////////////////////////////
+// Cycle counter
+////////////////////////////////////////////////
+static void cycles_open(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    g_perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (g_perf_fd >= 0)
+    {
+        g_source = CyclesPerf;
+        return;
+    }
+    int err = errno;
+#if defined(__x86_64__) || defined(__i386__)
+    g_source = CyclesTsc;
+    printf("perf_event_open: %s, counting TSC reference cycles\n", strerror(err));
+#else
+    printf("perf_event_open: %s, no cycle counts\n", strerror(err));
+#endif
+}
+
+static void cycles_start(void)
+{
+    if (g_source == CyclesPerf)
+    {
+        ioctl(g_perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(g_perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+// Cycles since cycles_start(), given the TSC value read then.
+static uint64_t cycles_stop(uint64_t tscStart)
+{
+    if (g_source == CyclesPerf)
+    {
+        uint64_t count = 0;
+        ioctl(g_perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(g_perf_fd, &count, sizeof(count)) != sizeof(count))
+            return 0;
+        return count;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (g_source == CyclesTsc)
+        return __rdtsc() - tscStart;
+#endif
+    (void)tscStart;
+    return 0;
+}
+
+static uint64_t tsc_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (g_source == CyclesTsc)
+        return __rdtsc();
+#endif
+    return 0;
+}
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////
+// Payload distributions
+////////////////////////////////////////////////
+static uint32_t g_rand = 0x12345678;
+
+static uint32_t next_rand(void)
+{
+    // xorshift32, the same sequence on every run
+    g_rand ^= g_rand << 13;
+    g_rand ^= g_rand >> 17;
+    g_rand ^= g_rand << 5;
+    return g_rand;
+}
+
+static void fill_random(unsigned char *p, int n)
+{
+    for (int i = 0; i < n; i++)
+        p[i] = (unsigned char)next_rand();
+}
+
+static void fill_flags(unsigned char *p, int n)
+{
+    memset(p, FLAG, n);
+}
+
+static void fill_text(unsigned char *p, int n)
+{
+    static const char text[] =
+        "The quick brown fox jumps over the lazy dog. 0123456789 {} ~ } ~\n";
+    for (int i = 0; i < n; i++)
+        p[i] = (unsigned char)text[i % (sizeof(text) - 1)];
+}
+
+static void fill_zeros(unsigned char *p, int n)
+{
+    memset(p, 0, n);
+}
+
+typedef struct
+{
+    const char *name;
+    void (*fill)(unsigned char *p, int n);
+} Distribution;
+
+static const Distribution distributions[] = {
+    {"random", fill_random},
+    {"all-FLAG", fill_flags},
+    {"text", fill_text},
+    {"zeros", fill_zeros},
+};
+
+////////////////////////////////////////////////
+// Kernels
+////////////////////////////////////////////////
+static void k_bcc2(void)
+{
+    g_sink += compute_bcc2(g_payload, PAYLOAD_SIZE);
+}
+
+static void k_stuff_ppp(void)
+{
+    g_sink += stuff_ppp(g_payload, PAYLOAD_SIZE, g_out, sizeof(g_out));
+}
+
+static void k_destuff_ppp(void)
+{
+    g_sink += destuff_ppp(g_ppp, g_pppLen, g_out, sizeof(g_out));
+}
+
+static void k_stuff_cobs(void)
+{
+    g_sink += stuff_cobs(g_payload, PAYLOAD_SIZE, g_out, sizeof(g_out));
+}
+
+static void k_destuff_cobs(void)
+{
+    g_sink += destuff_cobs(g_cobs, g_cobsLen, g_out, sizeof(g_out));
+}
+
+static void k_build_ppp(void)
+{
+    g_sink += build_i_frame(g_out, sizeof(g_out), g_payload, PAYLOAD_SIZE, C_IW(1) | C_LEN, FramingPpp);
+}
+
+static void k_build_cobs(void)
+{
+    g_sink += build_i_frame(g_out, sizeof(g_out), g_payload, PAYLOAD_SIZE, C_IW(1) | C_LEN, FramingCobs);
+}
+
+static void deframe(Framing framing, const unsigned char *frame, int len)
+{
+    Deframer d;
+    Frame f;
+    int used;
+    deframer_init(&d, g_rx, PAYLOAD_SIZE + 1);
+    deframer_set_framing(&d, framing);
+    if (deframer_feed(&d, frame, len, &used, &f))
+        g_sink += f.status + f.payloadLen;
+}
+
+static void k_deframe_ppp(void)
+{
+    deframe(FramingPpp, g_framePpp, g_framePppLen);
+}
+
+static void k_deframe_cobs(void)
+{
+    deframe(FramingCobs, g_frameCobs, g_frameCobsLen);
+}
+
+typedef struct
+{
+    const char *name;
+    void (*run)(void);
+} Kernel;
+
+static const Kernel kernels[] = {
+    {"compute_bcc2", k_bcc2},
+    {"stuff_ppp", k_stuff_ppp},
+    {"destuff_ppp", k_destuff_ppp},
+    {"stuff_cobs", k_stuff_cobs},
+    {"destuff_cobs", k_destuff_cobs},
+    {"build_i_frame ppp", k_build_ppp},
+    {"build_i_frame cobs", k_build_cobs},
+    {"deframer_feed ppp", k_deframe_ppp},
+    {"deframer_feed cobs", k_deframe_cobs},
+};
+
+// Run kernel in growing batches until it took MIN_NS.
+static void measure(const Kernel *kernel, const char *distribution)
+{
+    long iterations = 1;
+    long ns;
+    uint64_t cycles;
+    while (1)
+    {
+        uint64_t tsc = tsc_now();
+        long start = now_ns();
+        cycles_start();
+        for (long i = 0; i < iterations; i++)
+            kernel->run();
+        cycles = cycles_stop(tsc);
+        ns = now_ns() - start;
+        if (ns >= MIN_NS)
+            break;
+        iterations *= (ns < MIN_NS / 16) ? 16 : 2;
+    }
+    double bytes = (double)iterations * PAYLOAD_SIZE;
+    printf("%-20s %-9s %8.3f", kernel->name, distribution, ns / bytes);
+    if (g_source != CyclesNone)
+        printf(" %10.3f", cycles / bytes);
+    else
+        printf(" %10s", "-");
+    printf(" %9.1f\n", bytes / ns * 1000.0);
+}
+
+int main(void)
+{
+    cycles_open();
+    printf("%d-byte payloads\n", PAYLOAD_SIZE);
+    printf("%-20s %-9s %8s %10s %9s\n", "kernel", "payload", "ns/B",
+           g_source == CyclesTsc ? "tsc/B" : "cycles/B", "MB/s");
+
+    for (unsigned d = 0; d < sizeof(distributions) / sizeof(distributions[0]); d++)
+    {
+        distributions[d].fill(g_payload, PAYLOAD_SIZE);
+        g_pppLen = stuff_ppp(g_payload, PAYLOAD_SIZE, g_ppp, sizeof(g_ppp));
+        g_cobsLen = stuff_cobs(g_payload, PAYLOAD_SIZE, g_cobs, sizeof(g_cobs));
+        g_framePppLen = build_i_frame(g_framePpp, sizeof(g_framePpp), g_payload, PAYLOAD_SIZE,
+                                      C_IW(1) | C_LEN, FramingPpp);
+        g_frameCobsLen = build_i_frame(g_frameCobs, sizeof(g_frameCobs), g_payload, PAYLOAD_SIZE,
+                                       C_IW(1) | C_LEN, FramingCobs);
+        if (g_pppLen < 0 || g_cobsLen < 0 || g_framePppLen < 0 || g_frameCobsLen < 0)
+        {
+            fprintf(stderr, "bench_frame: encoding failed\n");
+            return 1;
+        }
+        for (unsigned k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+            measure(&kernels[k], distributions[d].name);
+    }
+    if (g_perf_fd >= 0)
+        close(g_perf_fd);
+    return 0;
+}
@@ -0,0 +1,244 @@
+// Fuzz harness of the framing kernels in src/frame.c and the capability
+// block parser in src/capability.c.
+//
+// LLVMFuzzerTestOneInput() is the libFuzzer entry point:
+//   clang -g -O1 -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER
+//         -o fuzz_frame bench/fuzz_frame.c src/frame.c src/capability.c
+// Without FUZZ_LIBFUZZER a main() is added that runs the files given on
+// the command line (AFL style, e.g. afl-fuzz ... -- ./fuzz_frame @@) or,
+// given a number, that many generated inputs. make fuzz does the latter
+// under AddressSanitizer and UBSan.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/capability.h"
+#include "../src/frame.h"
+
+#define LIMIT 1001 // Information field accepted by the deframer: payload and BCC2
+#define WIRE_SIZE (2 * LIMIT + 16)
+
+#define CHECK(cond)                                                              \
+    do                                                                           \
+    {                                                                            \
+        if (!(cond))                                                             \
+        {                                                                        \
+            fprintf(stderr, "fuzz_frame: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            abort();                                                             \
+        }                                                                        \
+    } while (0)
+
+// Split feeding into chunks of 1 to 64 bytes, as reads from a port do.
+static int next_chunk(uint32_t *seed, int remaining)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    int n = 1 + (int)((*seed >> 16) % 64);
+    return n < remaining ? n : remaining;
+}
+
+// Stuffing round trips: nothing stuffed may contain a FLAG.
+static void check_stuffing(const unsigned char *data, int size)
+{
+    static unsigned char enc[2 * 65536 + 16];
+    static unsigned char dec[2 * 65536 + 16];
+
+    int e = stuff_ppp(data, size, enc, sizeof(enc));
+    CHECK(e >= size && e <= 2 * size);
+    CHECK(memchr(enc, FLAG, e) == NULL);
+    CHECK(destuff_ppp(enc, e, dec, sizeof(dec)) == size);
+    CHECK(memcmp(dec, data, size) == 0);
+
+    e = stuff_cobs(data, size, enc, sizeof(enc));
+    CHECK(e > 0 && e <= COBS_MAX_ENCODED(size));
+    CHECK(memchr(enc, FLAG, e) == NULL);
+    CHECK(destuff_cobs(enc, e, enc, sizeof(enc)) == size);
+    CHECK(memcmp(enc, data, size) == 0);
+
+    // The decoders take anything without writing past outMax
+    int n = destuff_ppp(data, size, dec, size);
+    CHECK(n >= -1 && n <= size);
+    n = destuff_cobs(data, size, dec, size);
+    CHECK(n >= -1 && n <= size);
+}
+
+// An I-frame built from data comes out of the deframer intact, whatever
+// the chunking.
+static void check_i_frame(const unsigned char *data, int size, unsigned char mode)
+{
+    static unsigned char frame[2 * WIRE_SIZE];
+    static unsigned char rx[DEFRAMER_BUF_SIZE(LIMIT)];
+    if (size > LIMIT - 1)
+        size = LIMIT - 1;
+
+    Framing framing = (mode & 0x01) ? FramingCobs : FramingPpp;
+    unsigned char C = (mode & 0x02) ? C_IW(mode >> 5) : C_I((mode >> 5) & 0x01);
+    if (mode & 0x04)
+        C |= C_LEN;
+    int len = build_i_frame(frame, sizeof(frame), data, size, C, framing);
+    CHECK(len > 0);
+    CHECK(memchr(frame + 1, FLAG, len - 2) == NULL);
+
+    Deframer d;
+    deframer_init(&d, rx, LIMIT);
+    deframer_set_framing(&d, framing);
+    uint32_t seed = mode;
+    int pos = 0;
+    int frames = 0;
+    while (pos < len)
+    {
+        Frame f;
+        int used;
+        int chunk = next_chunk(&seed, len - pos);
+        if (deframer_feed(&d, frame + pos, chunk, &used, &f))
+        {
+            frames++;
+            CHECK(f.status == FrameOk && f.type == FrameI && f.C == C);
+            CHECK(f.payloadLen == size && memcmp(f.payload, data, size) == 0);
+        }
+        else
+            CHECK(used == chunk);
+        pos += used;
+    }
+    CHECK(frames == 1);
+}
+
+// Arbitrary bytes never crash the deframer nor produce a frame larger
+// than its limit, and every byte is eventually consumed.
+static void check_parser(const unsigned char *data, int size, unsigned char mode)
+{
+    static unsigned char rx[DEFRAMER_BUF_SIZE(LIMIT)];
+    Deframer d;
+    deframer_init(&d, rx, LIMIT);
+    deframer_set_framing(&d, (mode & 0x01) ? FramingCobs : FramingPpp);
+    uint32_t seed = mode;
+    int pos = 0;
+    while (pos < size)
+    {
+        Frame f;
+        int used;
+        int chunk = next_chunk(&seed, size - pos);
+        int got = deframer_feed(&d, data + pos, chunk, &used, &f);
+        CHECK(used >= 0 && used <= chunk);
+        if (got)
+        {
+            CHECK(used > 0);
+            CHECK(f.type <= FrameUnknown);
+            if (f.payload != NULL)
+            {
+                CHECK(f.status == FrameOk);
+                CHECK(f.payload >= rx && f.payloadLen >= 0 && f.payloadLen <= LIMIT - 1);
+            }
+        }
+        else
+            CHECK(used == chunk);
+        pos += used;
+    }
+}
+
+// Capability blocks: arbitrary input decodes or is refused, and what is
+// encoded decodes to the same values.
+static void check_capabilities(const unsigned char *data, int size)
+{
+    Capabilities caps;
+    if (cap_decode(data, size, 1000, &caps) == 0)
+    {
+        Capabilities back;
+        Capabilities both;
+        unsigned char block[CAP_BLOCK_SIZE];
+        caps.maxPayload &= 0xFFFF;
+        caps.window &= 0xFF;
+        caps.timerMs &= 0xFFFF;
+        if (caps.maxPayload == 0 || caps.window == 0 || caps.timerMs == 0)
+            return;
+        int n = cap_encode(&caps, block, sizeof(block));
+        CHECK(n > 0 && n <= CAP_BLOCK_SIZE);
+        CHECK(cap_decode(block, n, 1000, &back) == 0);
+        CHECK(memcmp(&caps, &back, sizeof(caps)) == 0);
+        cap_intersect(&caps, &back, &both);
+        CHECK(both.framing & FRAMING_PPP);
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size < 1 || size > 65536)
+        return 0;
+    unsigned char mode = data[0];
+    const unsigned char *rest = data + 1;
+    int len = (int)size - 1;
+
+    check_stuffing(rest, len);
+    check_i_frame(rest, len, mode);
+    check_parser(rest, len, mode);
+    check_capabilities(rest, len);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static uint32_t g_rand = 0x9E3779B9;
+
+static uint32_t next_rand(void)
+{
+    g_rand ^= g_rand << 13;
+    g_rand ^= g_rand >> 17;
+    g_rand ^= g_rand << 5;
+    return g_rand;
+}
+
+// An input that reaches the deeper parser states: a valid frame with a
+// few damaged bytes, or runs of the special bytes.
+static int generate(unsigned char *buf, int max)
+{
+    static unsigned char payload[LIMIT];
+    int kind = next_rand() % 4;
+    buf[0] = (unsigned char)next_rand();
+    int len = 1 + (int)(next_rand() % (LIMIT - 1));
+    for (int i = 0; i < len; i++)
+    {
+        uint32_t r = next_rand();
+        payload[i] = (kind == 1) ? (unsigned char)(r & 1 ? FLAG : ESC)
+                   : (kind == 2) ? (unsigned char)(r % 3 == 0 ? 0 : r)
+                                 : (unsigned char)r;
+    }
+    if (kind == 3)
+    {
+        len = build_i_frame(buf + 1, max - 1, payload, len, (unsigned char)(next_rand() & 0x4F),
+                            (next_rand() & 1) ? FramingCobs : FramingPpp);
+        if (len < 0)
+            return 1;
+        for (int flips = next_rand() % 4; flips > 0; flips--)
+            buf[1 + next_rand() % len] ^= (unsigned char)(1 << (next_rand() % 8));
+    }
+    else
+        memcpy(buf + 1, payload, len);
+    return len + 1;
+}
+
+int main(int argc, char **argv)
+{
+    static unsigned char buf[65537];
+    if (argc == 2 && strspn(argv[1], "0123456789") == strlen(argv[1]))
+    {
+        long runs = atol(argv[1]);
+        for (long i = 0; i < runs; i++)
+            LLVMFuzzerTestOneInput(buf, generate(buf, sizeof(buf)));
+        printf("fuzz_frame: %ld generated inputs ok\n", runs);
+        return 0;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+        size_t n = fread(buf, 1, sizeof(buf), file);
+        fclose(file);
+        LLVMFuzzerTestOneInput(buf, n);
+    }
+    return 0;
+}
+#endif
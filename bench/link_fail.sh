@@ -0,0 +1,60 @@
+#!/bin/sh
+# Unplug the cable partway through a transfer and check that both ends
+# give up instead of hanging: a single file, then a directory.
+# Usage: bench/link_fail.sh (from the repository root, after make all)
+
+BIN=./bin
+WORK=$(mktemp -d)
+LIMIT=60
+STATUS=0
+
+cleanup()
+{
+    [ -n "$CABLE" ] && kill "$CABLE" 2>/dev/null && wait "$CABLE" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# $1: name, $2: what to send, $3: where to receive it
+run_case()
+{
+    printf '0 baud 9600\n2 off\n' > "$WORK/scenario"
+    $BIN/cable -s "$WORK/scenario" < /dev/null > "$WORK/cable.log" 2>&1 &
+    CABLE=$!
+    sleep 0.2
+
+    timeout $LIMIT $BIN/main /tmp/ttyS11 9600 rx "$3" > "$WORK/rx.log" 2>&1 &
+    RX=$!
+    sleep 0.2
+    timeout $LIMIT $BIN/main /tmp/ttyS10 9600 tx "$2" > "$WORK/tx.log" 2>&1
+    TX_EXIT=$?
+    wait $RX
+    RX_EXIT=$?
+
+    kill $CABLE 2>/dev/null
+    wait $CABLE 2>/dev/null
+    CABLE=
+
+    if [ $TX_EXIT -eq 124 ] || [ $RX_EXIT -eq 124 ]; then
+        echo "FAIL $1: hung after the link went down (tx $TX_EXIT, rx $RX_EXIT)"
+        tail -n 5 "$WORK/tx.log"
+        STATUS=1
+    elif ! grep -q "Transfer failed" "$WORK/tx.log"; then
+        echo "FAIL $1: the transmitter did not report the failure"
+        tail -n 5 "$WORK/tx.log"
+        STATUS=1
+    else
+        echo "OK   $1"
+    fi
+}
+
+# Larger than the pipeline rings hold, so their producers are still busy
+head -c 200000 /dev/urandom > "$WORK/file.bin"
+run_case "file" "$WORK/file.bin" "$WORK/received.bin"
+
+mkdir "$WORK/dir"
+cp "$WORK/file.bin" "$WORK/dir/a.bin"
+cp penguin.gif "$WORK/dir/b.gif"
+run_case "batch" "$WORK/dir" "$WORK/received"
+
+exit $STATUS
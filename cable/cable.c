@@ -1,11 +1,13 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates pairs of virtual Tx / Rx serial ports out of pseudo-terminals.
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
 // Portability fixes and macOS compatibility added.
 
+#define _XOPEN_SOURCE 600 // posix_openpt(), grantpt(), unlockpt(), ptsname()
+
 #include <fcntl.h>
 #include <math.h>
 #include <sched.h>
@@ -19,13 +21,19 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <pthread.h>
 #include <sys/resource.h>
+#include <signal.h>
+#include <stdint.h>
 
-#define TXDEV "/tmp/ttyS10"
-#define RXDEV "/tmp/ttyS11"
-#define TX_EMULATOR "/tmp/emulatorTx"
-#define RX_EMULATOR "/tmp/emulatorRx"
+// Cable i joins /tmp/ttyS<10+2i> (Tx) and /tmp/ttyS<11+2i> (Rx), so the
+// first one is the classic /tmp/ttyS10 <-> /tmp/ttyS11
+#define DEV_FORMAT "/tmp/ttyS%d"
+#define FIRST_DEV 10
+#define MAX_CABLES 16
+#define MAX_EVENTS 1024
+#define NAME_SIZE 64
 
 // Baudrate settings are defined in <asm/termbits.h>, which is
 // included by <termios.h>
@@ -36,131 +44,169 @@
 #define TRUE 1
 
 #define BUF_SIZE 2048
+#define MIN_SLEEP_NS 500000    // Shortest sleep between passes, in nanoseconds
+
+#define TX2RX 0
+#define RX2TX 1
+#define LINE_SIZE 4096  // Initial room for bytes on the wire, grows as needed
+
+enum Jitter { JITTER_OFF, JITTER_UNIFORM, JITTER_NORMAL, JITTER_EXP };
+
+// Frame capture in pcapng format
+#define FLAG 0x7E
+#define ESC 0x7D
+#define ESC_XOR 0x20
+#define PCAP_SNAPLEN 131072        // Largest frame kept whole, after unstuffing
+#define LINKTYPE_PPP_HDLC 50
+#define LINKTYPE_USER0 147         // COBS captures: the fields stay encoded
+#define PCAP_INBOUND 1             // epb_flags direction, as seen by the transmitter
+#define PCAP_OUTBOUND 2
+#define PCAP_CRC_ERROR (1u << 24)  // epb_flags link-layer error bit
+#define FRAME_CORRUPTED 0x01       // Cable flipped a bit of the frame
+#define FRAME_LOST 0x02            // Cable dropped bytes of it while off
+
+// One direction of a cable: its own rate, delay and error model, and the
+// bytes on the wire, each with the time it reaches the other end
+struct Direction {
+    struct timespec nextTxTime;  // Start of the next byte slot
+    struct timespec byteDelay;
+    unsigned long propDelay;     // Propagation delay in usec
+    int jitter;                  // Distribution of the delay added to it
+    double jitterUsec;           // Its scale
+    double byteER;               // Byte error rate
+    double burstStart;           // Chance per byte of a burst of errors
+    double burstEnd;             // starting and ending, 0 if off
+    int inBurst;
+    unsigned char *line;         // Bytes on the wire, oldest first
+    struct timespec *arrival;
+    int lineSize;
+    int lineHead;
+    int lineCount;
+    unsigned char *hit;          // TRUE for bytes the cable corrupted
+    struct timespec lastArrival; // Bytes never overtake each other
+    int idle;                    // For logging
+    unsigned char *frame;        // Frame being delivered, for the capture
+    int frameLen;
+    int frameEsc;                // Last byte delivered was an ESC
+    int frameDamage;             // FRAME_CORRUPTED and FRAME_LOST
+    unsigned char in[BUF_SIZE];  // Bytes read for the slots already due
+    int inPos;
+    int inLen;
+    unsigned char out[BUF_SIZE]; // Bytes delivered, written once per pass
+    int outLen;
+};
 
-// Current running parameters
-struct Parameters {
+// One emulated cable: its ports and current running parameters
+struct Cable {
+    int id;
+    char txDev[NAME_SIZE];       // Opened by the transmitter
+    char rxDev[NAME_SIZE];       // Opened by the receiver
+    int fdTx;         // Master ends of the ptys, served here
+    int fdRx;
+    int slaveTx;      // Slave ends, held open so that the masters never see
+    int slaveRx;      // a hangup while the programs reopen the ports
+    int linkedTx;     // TRUE once txDev was created here
+    int linkedRx;
+    struct Direction dir[2];     // TX2RX and RX2TX
+    int unreliableRate;          // TRUE once it could not keep up
+    int cableIdle;               // For logging
     int cableOn;
-    double byteER;   // Byte error rate
-    struct timespec byteDelay;
-    unsigned long propDelay;   // Desired propagation delay in usec
-    int bufSize;  // Dimensioned to enforce the propagation delay
-    char *tx2rx;
-    char *tx2rxValid;  // TRUE if corresponding entry holds a byte
-    long tx2rxIdx;     // Input index for the tx2rx buffer
-    char *rx2tx;
-    char *rx2txValid;  // TRUE if corresponding entry holds a byte
-    long rx2txIdx;     // Input index for the tx2rx buffer
     FILE *logfile;
+    FILE *pcapfile;
+    int pcapCobs;     // Frames captured as sent, not unstuffed
 };
 
-struct Parameters par = {
-    .cableOn = TRUE,
-    .byteER = 0.0,
-    .propDelay = 0,
-    .tx2rx = NULL,
-    .tx2rxValid = NULL,
-    .rx2tx = NULL,
-    .rx2txValid = NULL,
-    .logfile = NULL};
-
-
-// Returns: serial port file descriptor (fd).
-int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
-{
-    int fd = open(serialPort, O_RDWR | O_NONBLOCK | O_NOCTTY);
-
-    if (fd < 0)
-        return -1;
+struct Cable cables[MAX_CABLES];
+int numCables = 1;
+int selected = -1;  // Cable the console commands apply to, -1 for all
 
-    // Save current port settings
-    if (tcgetattr(fd, oldtio) == -1)
-        return -1;
+// Scenario command, run at a time relative to the start
+struct Event {
+    struct timespec at;
+    int cable;  // -1 for all
+    char command[128];
+};
 
-    memset(newtio, 0, sizeof(*newtio));
-    newtio->c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio->c_iflag = IGNPAR;
-    newtio->c_oflag = 0;
-    newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 0; // Inter-character timer unused (polling mode)
-    newtio->c_cc[VMIN] = 0;  // Read without blocking
-    tcflush(fd, TCIOFLUSH);
+struct Event *events = NULL;
+int numEvents = 0;
+int nextEvent = 0;
+struct timespec scenarioStart;  // Time 0 of the scenario, moved by "repeat"
 
-    if (tcsetattr(fd, TCSANOW, newtio) == -1)
-        return -1;
+volatile sig_atomic_t interrupted = FALSE;
 
-    return fd;
-}
+// CLOCK_REALTIME - CLOCK_MONOTONIC, for the capture timestamps
+struct timespec wallClockOffset;
 
 
-// Add noise to a buffer, by flipping the byte in the "errorIndex" position.
-void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
+// Print a message about cable c, naming it when there are several.
+void say(const struct Cable *c, const char *format, ...)
 {
-    buf[errorIndex] ^= 0xFF;
+    va_list args;
+    if (numCables > 1)
+        printf("CABLE %d: ", c->id);
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
 }
 
 
-// Initialize the ring buffers that implement the propagation delay
-// Returns 0 on success, -1 on failure
-int init_ring_buffers(void)
+// Open a pseudo-terminal in raw mode and make link point to its slave end.
+// A link left behind by a cable that died is replaced, a live one is not.
+// Returns: master file descriptor (fd), or -1 on failure
+int openPty(const char *link, int *slave, int *linked)
 {
-    // Protect against zero byteDelay
-    if (par.byteDelay.tv_nsec == 0 && par.byteDelay.tv_sec == 0) {
-        // nothing to do, set minimal buffer
-        par.bufSize = 1;
-        par.tx2rx = realloc(par.tx2rx, (size_t)par.bufSize);
-        par.tx2rxValid = realloc(par.tx2rxValid, (size_t)par.bufSize);
-        par.rx2tx = realloc(par.rx2tx, (size_t)par.bufSize);
-        par.rx2txValid = realloc(par.rx2txValid, (size_t)par.bufSize);
-        if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
-            return -1;
-        memset(par.tx2rxValid, 0, (size_t)par.bufSize);
-        memset(par.rx2txValid, 0, (size_t)par.bufSize);
-        par.tx2rxIdx = 0;
-        par.rx2txIdx = 0;
-        return 0;
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0 || ptsname(fd) == NULL)
+    {
+        perror("posix_openpt");
+        if (fd >= 0)
+            close(fd);
+        return -1;
     }
+    char name[NAME_SIZE];
+    snprintf(name, sizeof(name), "%s", ptsname(fd));
 
-    long nsecPropDelay = 1000L * (long)par.propDelay; // desired prop in nsec
-    long byteDelayNsec = par.byteDelay.tv_nsec + par.byteDelay.tv_sec * 1000000000L;
-    if (byteDelayNsec <= 0) byteDelayNsec = 1; // avoid division by zero
-
-    long bytesInFlight = nsecPropDelay / byteDelayNsec;
-    // Round instead of truncating
-    if (nsecPropDelay % byteDelayNsec > byteDelayNsec / 2)
+    *slave = open(name, O_RDWR | O_NOCTTY);
+    if (*slave < 0)
     {
-        ++bytesInFlight;
+        perror(name);
+        close(fd);
+        return -1;
     }
-    long actualPropDelay = bytesInFlight * byteDelayNsec / 1000L; // usec
-    par.bufSize = (int)(bytesInFlight + 1);
-    if (par.bufSize < 1) par.bufSize = 1;
-
-    // allocate bytes (use sizeof(char)==1)
-    par.tx2rx = realloc(par.tx2rx, (size_t)par.bufSize * sizeof(char));
-    par.tx2rxValid = realloc(par.tx2rxValid, (size_t)par.bufSize * sizeof(char));
-    par.rx2tx = realloc(par.rx2tx, (size_t)par.bufSize * sizeof(char));
-    par.rx2txValid = realloc(par.rx2txValid, (size_t)par.bufSize * sizeof(char));
-    if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
+    fchmod(*slave, 0666);
+
+    struct termios newtio;
+    memset(&newtio, 0, sizeof(newtio));
+    newtio.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
+    newtio.c_iflag = IGNPAR;
+    newtio.c_oflag = 0;
+    newtio.c_lflag = 0;
+    newtio.c_cc[VTIME] = 0; // Inter-character timer unused (polling mode)
+    newtio.c_cc[VMIN] = 0;  // Read without blocking
+    tcsetattr(*slave, TCSANOW, &newtio);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    struct stat st;
+    if (lstat(link, &st) == 0)
     {
+        if (!S_ISLNK(st.st_mode) || stat(link, &st) == 0)
+        {
+            fprintf(stderr, "%s ALREADY EXISTS, IS ANOTHER CABLE RUNNING?\n", link);
+            close(*slave);
+            close(fd);
+            return -1;
+        }
+        unlink(link);
+    }
+    if (symlink(name, link) < 0)
+    {
+        perror(link);
+        close(*slave);
+        close(fd);
         return -1;
     }
-    memset(par.tx2rxValid, 0, (size_t)par.bufSize);
-    memset(par.rx2txValid, 0, (size_t)par.bufSize);
-    par.tx2rxIdx = 0;
-    par.rx2txIdx = 0;
-    printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
-    return 0;
-}
-
-
-// Set the byte delay corresponding to the selected baud rate
-void set_baud_rate(unsigned long baud)
-{
-    // 10 bit times per byte; delay in nanoseconds
-    double delay = 1.0e10 / (double)baud;
-    par.byteDelay.tv_sec = 0;
-    par.byteDelay.tv_nsec = (long) delay;
-    printf("BAUD RATE: %lu\n", baud);
-    init_ring_buffers();
+    *linked = TRUE;
+    return fd;
 }
 
 
@@ -259,364 +305,1099 @@ int timespec_is_negative(const struct timespec *t)
 }
 
 
-void endlog(void)
+// Set the byte delay of direction d for the given baud rate
+void set_baud_rate(struct Direction *d, unsigned long baud)
 {
-    if (par.logfile != NULL)
+    // 10 bit times per byte; delay in nanoseconds
+    double delay = 1.0e10 / (double)baud;
+    d->byteDelay.tv_sec = 0;
+    d->byteDelay.tv_nsec = (long) delay;
+}
+
+
+// Draw the delay added to the propagation delay of one byte, in usec
+double jitter_sample(const struct Direction *d)
+{
+    // Uniform in (0, 1], never 0 so that log() is finite. drand48() rather
+    // than rand(): taking a fixed number of rand() values per byte samples
+    // its lagged Fibonacci sequence with a stride, and the errors of
+    // successive frames come out correlated.
+    double u = 1.0 - drand48();
+    double v = drand48();
+
+    switch (d->jitter) {
+        case JITTER_UNIFORM:
+            return u * d->jitterUsec;
+        case JITTER_NORMAL:
+            // Box-Muller, around the propagation delay
+            return d->jitterUsec * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+        case JITTER_EXP:
+            return -d->jitterUsec * log(u);
+        default:
+            return 0.0;
+    }
+}
+
+
+// Flip a bit of the byte if the error model of direction d says so.
+// Returns TRUE if it did.
+int add_errors(struct Direction *d, unsigned char *byte)
+{
+    double byteER = d->byteER;
+    if (d->burstStart > 0.0)
     {
-        fclose(par.logfile);
-        par.logfile = NULL;
+        double r = drand48();
+        if (d->inBurst && r < d->burstEnd)
+        {
+            d->inBurst = FALSE;
+        }
+        else if (!d->inBurst && r < d->burstStart)
+        {
+            d->inBurst = TRUE;
+        }
+        if (d->inBurst)
+        {
+            byteER = 0.5;
+        }
+    }
+    if (byteER != 0.0 && drand48() < byteER)
+    {
+        // At most one wrong bit per byte, good enough if ber < 0.02
+        *byte ^= (unsigned char) (1 << (int) (drand48() * 8));
+        return TRUE;
     }
+    return FALSE;
+}
+
+
+// Put a byte on the wire of direction d, to reach the other end at "arrival".
+// Returns 0 on success, -1 on failure
+int line_push(struct Direction *d, unsigned char byte, int corrupted, const struct timespec *arrival)
+{
+    if (d->lineCount == d->lineSize)
+    {
+        int size = d->lineSize > 0 ? 2 * d->lineSize : LINE_SIZE;
+        unsigned char *line = malloc((size_t)size);
+        struct timespec *times = malloc((size_t)size * sizeof(*times));
+        unsigned char *hit = malloc((size_t)size);
+        if (line == NULL || times == NULL || hit == NULL)
+        {
+            free(line);
+            free(times);
+            free(hit);
+            return -1;
+        }
+        for (int i = 0; i < d->lineCount; i++)
+        {
+            int j = (d->lineHead + i) % d->lineSize;
+            line[i] = d->line[j];
+            times[i] = d->arrival[j];
+            hit[i] = d->hit[j];
+        }
+        free(d->line);
+        free(d->arrival);
+        free(d->hit);
+        d->line = line;
+        d->arrival = times;
+        d->hit = hit;
+        d->lineSize = size;
+        d->lineHead = 0;
+    }
+    int tail = (d->lineHead + d->lineCount) % d->lineSize;
+    d->line[tail] = byte;
+    d->arrival[tail] = *arrival;
+    d->hit[tail] = (unsigned char) corrupted;
+    d->lineCount++;
+    return 0;
 }
 
 
-void startlog(const char *filename)
+void endlog(struct Cable *c)
 {
-    endlog();
-    par.logfile = fopen(filename, "w");
-    if (par.logfile != NULL)
+    if (c->logfile != NULL)
     {
-        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
-        printf("LOGGING TO FILE %s\n", filename);
+        fclose(c->logfile);
+        c->logfile = NULL;
+    }
+}
+
+
+void startlog(struct Cable *c, const char *filename)
+{
+    endlog(c);
+    c->logfile = fopen(filename, "w");
+    if (c->logfile != NULL)
+    {
+        fprintf(c->logfile, "Tx->Rx | Rx->Tx\n");
+        say(c, "LOGGING TO FILE %s\n", filename);
     }
     else
     {
-        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
+        say(c, "ERROR OPENING FILE %s, NOT LOGGING\n", filename);
+    }
+}
+
+
+// Append a pcapng option to buf, padded to 32 bits
+void pcap_option(unsigned char *buf, uint32_t *len, uint16_t code, const void *value, uint16_t size)
+{
+    memcpy(buf + *len, &code, 2);
+    memcpy(buf + *len + 2, &size, 2);
+    memcpy(buf + *len + 4, value, size);
+    memset(buf + *len + 4 + size, 0, (4 - size % 4) % 4);
+    *len += 4 + size + (4 - size % 4) % 4;
+}
+
+
+// Write a pcapng block of the given type around a body of len bytes,
+// a multiple of 4
+void pcap_block(FILE *file, uint32_t type, const unsigned char *body, uint32_t len)
+{
+    uint32_t total = len + 12;
+    fwrite(&type, 4, 1, file);
+    fwrite(&total, 4, 1, file);
+    fwrite(body, 1, len, file);
+    fwrite(&total, 4, 1, file);
+}
+
+
+void endpcap(struct Cable *c)
+{
+    if (c->pcapfile != NULL)
+    {
+        fclose(c->pcapfile);
+        c->pcapfile = NULL;
+    }
+    for (int dir = TX2RX; dir <= RX2TX; dir++)
+    {
+        free(c->dir[dir].frame);
+        c->dir[dir].frame = NULL;
+    }
+}
+
+
+// Capture the frames delivered on cable c, one interface per file. COBS
+// frames are kept as sent, the PPP ones unstuffed.
+void startpcap(struct Cable *c, const char *filename, int cobs)
+{
+    endpcap(c);
+    c->pcapfile = fopen(filename, "wb");
+    c->pcapCobs = cobs;
+    for (int dir = TX2RX; dir <= RX2TX; dir++)
+    {
+        struct Direction *d = &c->dir[dir];
+        d->frame = malloc(PCAP_SNAPLEN);
+        d->frameLen = 0;
+        d->frameEsc = FALSE;
+        d->frameDamage = 0;
+    }
+    if (c->pcapfile == NULL || c->dir[TX2RX].frame == NULL || c->dir[RX2TX].frame == NULL)
+    {
+        endpcap(c);
+        say(c, "ERROR OPENING FILE %s, NOT CAPTURING\n", filename);
+        return;
+    }
+
+    // Section header: byte order magic, version 1.0, unknown length
+    unsigned char body[256];
+    uint32_t len = 0;
+    uint32_t magic = 0x1A2B3C4D;
+    uint16_t version[2] = {1, 0};
+    int64_t sectionLength = -1;
+    memcpy(body, &magic, 4);
+    memcpy(body + 4, version, 4);
+    memcpy(body + 8, &sectionLength, 8);
+    len = 16;
+    pcap_block(c->pcapfile, 0x0A0D0D0A, body, len);
+
+    // Interface description: the cable, nanosecond timestamps
+    uint16_t linkType[2] = {cobs ? LINKTYPE_USER0 : LINKTYPE_PPP_HDLC, 0};
+    uint32_t snapLen = PCAP_SNAPLEN;
+    memcpy(body, linkType, 4);
+    memcpy(body + 4, &snapLen, 4);
+    len = 8;
+    char name[2 * NAME_SIZE + 8];
+    snprintf(name, sizeof(name), "%s <-> %s", c->txDev, c->rxDev);
+    pcap_option(body, &len, 2, name, (uint16_t) strlen(name));  // if_name
+    unsigned char tsresol = 9;
+    pcap_option(body, &len, 9, &tsresol, 1);                    // if_tsresol
+    pcap_option(body, &len, 0, "", 0);                          // opt_endofopt
+    pcap_block(c->pcapfile, 0x00000001, body, len);
+    say(c, "CAPTURING %s FRAMES TO FILE %s\n", cobs ? "COBS" : "PPP", filename);
+}
+
+
+// Write the frame reassembled in direction dir of cable c, delivered at "at"
+void pcap_frame(struct Cable *c, int dir, const struct timespec *at)
+{
+    struct Direction *d = &c->dir[dir];
+    int capLen = d->frameLen < PCAP_SNAPLEN ? d->frameLen : PCAP_SNAPLEN;
+    uint32_t padded = (uint32_t) (capLen + 3) & ~3u;
+    unsigned char header[20];
+    unsigned char options[128];
+    uint32_t optLen = 0;
+
+    struct timespec wall = timespec_sum(at, &wallClockOffset);
+    uint64_t ns = (uint64_t) wall.tv_sec * 1000000000ULL + (uint64_t) wall.tv_nsec;
+    uint32_t fields[5] = { 0, (uint32_t) (ns >> 32), (uint32_t) ns, (uint32_t) capLen, (uint32_t) d->frameLen };
+    memcpy(header, fields, sizeof(fields));
+
+    uint32_t flags = dir == TX2RX ? PCAP_OUTBOUND : PCAP_INBOUND;
+    if (d->frameDamage & FRAME_CORRUPTED)
+    {
+        flags |= PCAP_CRC_ERROR;
+    }
+    if (d->frameDamage != 0)
+    {
+        const char *comment = d->frameDamage == FRAME_CORRUPTED ? "corrupted by the cable"
+                            : d->frameDamage == FRAME_LOST ? "bytes lost while the cable was off"
+                            : "corrupted by the cable, bytes lost while the cable was off";
+        pcap_option(options, &optLen, 1, comment, (uint16_t) strlen(comment));  // opt_comment
     }
+    pcap_option(options, &optLen, 2, &flags, 4);  // epb_flags
+    pcap_option(options, &optLen, 0, "", 0);
+
+    uint32_t type = 0x00000006;
+    uint32_t total = 12 + sizeof(header) + padded + optLen;
+    static const unsigned char zeros[4];
+    fwrite(&type, 4, 1, c->pcapfile);
+    fwrite(&total, 4, 1, c->pcapfile);
+    fwrite(header, 1, sizeof(header), c->pcapfile);
+    fwrite(d->frame, 1, (size_t) capLen, c->pcapfile);
+    fwrite(zeros, 1, padded - (uint32_t) capLen, c->pcapfile);
+    fwrite(options, 1, optLen, c->pcapfile);
+    fwrite(&total, 4, 1, c->pcapfile);
+}
+
+
+// Feed a byte delivered in direction dir of cable c to the capture. FLAGs
+// delimit the frames, which are stored without them and, unless the
+// capture is of COBS frames, unstuffed.
+void pcap_byte(struct Cable *c, int dir, unsigned char byte, int corrupted, const struct timespec *at)
+{
+    struct Direction *d = &c->dir[dir];
+    if (corrupted)
+    {
+        d->frameDamage |= FRAME_CORRUPTED;
+    }
+    if (byte == FLAG)
+    {
+        if (d->frameLen > 0)
+        {
+            pcap_frame(c, dir, at);
+        }
+        // A FLAG made by the cable also cuts the frame that follows it
+        d->frameLen = 0;
+        d->frameEsc = FALSE;
+        d->frameDamage = corrupted ? FRAME_CORRUPTED : 0;
+        return;
+    }
+    if (byte == ESC && !d->frameEsc && !c->pcapCobs)
+    {
+        d->frameEsc = TRUE;
+        return;
+    }
+    if (d->frameEsc)
+    {
+        byte ^= ESC_XOR;
+        d->frameEsc = FALSE;
+    }
+    if (d->frameLen < PCAP_SNAPLEN)
+    {
+        d->frame[d->frameLen] = byte;
+    }
+    d->frameLen++;
 }
 
 
 // Show help
 void help()
 {
-    printf("\n\n"
-           "Transmitter must open " TXDEV "\n"
-           "Receiver must open " RXDEV "\n"
-           "\n"
+    printf("\n\n");
+    for (int i = 0; i < numCables; i++)
+    {
+        if (numCables > 1)
+            printf("Cable %d: ", i);
+        printf("Transmitter must open %s, receiver must open %s\n", cables[i].txDev, cables[i].rxDev);
+    }
+    printf("\n"
            "The cable program is sensible to the following interactive commands:\n"
            "--- help         : show this help\n"
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
            "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
-           "--- baud <rate>  : set baud rate, between 1200 and 115200 (default=9600)\n"
+           "--- baud <rate>  : set baud rate, between 1200 and 921600 (default=9600)\n"
            "                   note that 10 bits are sent per byte (8-N-1)\n"
            "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
-           "                   will be approximated to an integer multiple of the byte\n"
-           "                   delay (10 / baud_rate)\n"
+           "                   will be rounded up to a multiple of the byte delay\n"
+           "                   (10 / baud_rate)\n"
+           "--- jitter <uniform|normal|exp> <usec> | jitter off\n"
+           "                 : add to the propagation delay of every byte a delay\n"
+           "                   drawn from 0 to usec, with standard deviation usec or\n"
+           "                   with mean usec; bytes are never reordered\n"
+           "--- burst <length> <gap> | burst off\n"
+           "                 : add bursts of errors, averaging length bytes every gap\n"
+           "                   bytes, on top of the BER\n"
+           "--- tx2rx <cmd>  : apply ber, baud, prop, jitter or burst to the direction\n"
+           "--- rx2tx <cmd>    from the transmitter or from the receiver only\n"
            "--- log <file>   : log transmitted data to file\n"
            "--- endlog       : stop logging transmitted data\n"
+           "--- pcap [ppp|cobs] <file>\n"
+           "                 : capture the frames delivered to a pcapng file, unstuffed\n"
+           "                   (ppp, default) or as sent (cobs)\n"
+           "--- endpcap      : stop capturing frames\n"
+           "--- cable <n|all>: apply the following commands to cable n only, or to all\n"
+           "                   the cables (default)\n"
+           "--- <n> <cmd>    : apply a single command to cable n, e.g. \"1 off\"\n"
            "--- quit         : terminate the program\n"
-           "\n"
-           "IMPORTANT: Changing the baud rate or propagation delay while a transmission is\n"
-           "           ongoing will result in losses.\n"
            "\n");
 }
 
-int main(int argc, char *argv[])
-{
-    printf("\n");
 
-    system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=" TX_EMULATOR ",mode=777,raw,echo=0 &");
-    sleep(1);
-    printf("\n");
+// Show usage
+void usage(const char *program)
+{
+    printf("Usage: %s [-n cables] [-s scenario]\n"
+           "  -n cables   : number of independent cables to emulate (1-%d, default=1)\n"
+           "  -s scenario : file of \"<seconds> [<cable>] <command>\" lines, each\n"
+           "                command run that many seconds after the start, on the\n"
+           "                given cable or on all of them; \"<seconds> repeat\"\n"
+           "                starts it over\n",
+           program, MAX_CABLES);
+}
 
-    system("socat -dd PTY,link=" RXDEV ",mode=777,raw,echo=0 PTY,link=" RX_EMULATOR ",mode=777,raw,echo=0 &");
-    sleep(1);
 
-    help();
+// Create the pty pairs of every cable.
+// Returns 0 on success, -1 on failure
+int open_cables(void)
+{
+    for (int i = 0; i < numCables; i++)
+    {
+        struct Cable *c = &cables[i];
 
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
+        c->fdTx = openPty(c->txDev, &c->slaveTx, &c->linkedTx);
+        if (c->fdTx < 0)
+            return -1;
+        c->fdRx = openPty(c->rxDev, &c->slaveRx, &c->linkedRx);
+        if (c->fdRx < 0)
+            return -1;
+    }
+    return 0;
+}
 
-    int fdTx = openSerialPort(TX_EMULATOR, &oldtioTx, &newtioTx);
 
-    if (fdTx < 0)
+// Close the ptys of every cable and remove the links created for them.
+void close_cables(void)
+{
+    for (int i = 0; i < numCables; i++)
     {
-        perror("Opening Tx emulator serial port");
-        exit(-1);
+        struct Cable *c = &cables[i];
+        int fds[] = {c->fdTx, c->fdRx, c->slaveTx, c->slaveRx};
+        for (int j = 0; j < 4; j++)
+        {
+            if (fds[j] >= 0)
+                close(fds[j]);
+        }
+        if (c->linkedTx)
+            unlink(c->txDev);
+        if (c->linkedRx)
+            unlink(c->rxDev);
     }
+}
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
-
-    int fdRx = openSerialPort(RX_EMULATOR, &oldtioRx, &newtioRx);
 
-    if (fdRx < 0)
-    {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
-    }
+void on_signal(int sig)
+{
+    (void)sig;
+    interrupted = TRUE;
+}
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
 
-    char rxStdin[BUF_SIZE] = {0};
+// Give cable c its ports and the default parameters.
+void init_cable(struct Cable *c, int id)
+{
+    memset(c, 0, sizeof(*c));
+    c->id = id;
+    c->cableOn = TRUE;
+    c->fdTx = -1;
+    c->fdRx = -1;
+    c->slaveTx = -1;
+    c->slaveRx = -1;
+    set_baud_rate(&c->dir[TX2RX], DEFAULT_BAUDRATE);
+    set_baud_rate(&c->dir[RX2TX], DEFAULT_BAUDRATE);
+    snprintf(c->txDev, NAME_SIZE, DEV_FORMAT, FIRST_DEV + 2 * id);
+    snprintf(c->rxDev, NAME_SIZE, DEV_FORMAT, FIRST_DEV + 2 * id + 1);
+}
 
-    int STOP = FALSE;
 
-    set_baud_rate(DEFAULT_BAUDRATE);
+// Load a scenario file. Lines are "<seconds> [<cable>] <command>"; blank
+// lines and lines starting with '#' are skipped. "<seconds> repeat" runs
+// the scenario again from the start at that time, so that a profile of
+// rate or delay steps can go on for as long as a benchmark does.
+// Returns 0 on success, -1 on failure
+int load_scenario(const char *filename, const struct timespec *start)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+    scenarioStart = *start;
 
-    set_rt_priority();
+    char line[BUF_SIZE];
+    int lineNo = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNo++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        double seconds;
+        int used = 0;
+        if (sscanf(p, "%lf %n", &seconds, &used) < 1 || seconds < 0 || used == 0)
+        {
+            fprintf(stderr, "%s:%d: expected \"<seconds> [<cable>] <command>\"\n", filename, lineNo);
+            fclose(file);
+            return -1;
+        }
+        p += used;
+        if (strcmp(p, "repeat") == 0 && seconds == 0)
+        {
+            fprintf(stderr, "%s:%d: repeat needs a time after the start\n", filename, lineNo);
+            fclose(file);
+            return -1;
+        }
 
-    // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
-    int cableIdle = FALSE;
+        int cable = -1;
+        if (*p >= '0' && *p <= '9')
+        {
+            cable = (int)strtol(p, &p, 10);
+            p += strspn(p, " \t");
+            if (cable >= numCables)
+            {
+                fprintf(stderr, "%s:%d: no cable %d\n", filename, lineNo, cable);
+                fclose(file);
+                return -1;
+            }
+        }
 
-    printf("\nCable ready\n\n");
+        if (numEvents % 64 == 0)
+        {
+            struct Event *grown = realloc(events, (numEvents + 64) * sizeof(*events));
+            if (grown == NULL)
+            {
+                fclose(file);
+                return -1;
+            }
+            events = grown;
+        }
+        struct Event *e = &events[numEvents++];
+        struct timespec offset = { .tv_sec = (time_t)seconds,
+                                   .tv_nsec = (long)((seconds - (time_t)seconds) * 1e9) };
+        e->at = timespec_sum(start, &offset);
+        e->cable = cable;
+        snprintf(e->command, sizeof(e->command), "%s", p);
+
+        // Keep the events in time order, the file need not be
+        for (int i = numEvents - 1; i > 0 && timespec_comp(&events[i].at, &events[i - 1].at) < 0; i--)
+        {
+            struct Event tmp = events[i];
+            events[i] = events[i - 1];
+            events[i - 1] = tmp;
+        }
+    }
+    fclose(file);
+    printf("SCENARIO %s: %d COMMANDS\n", filename, numEvents);
+    return 0;
+}
 
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
-    int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
 
-    srand((unsigned) time(NULL));
+// Run a command that applies to a single cable.
+void cable_command(struct Cable *c, const char *command, int manyCables)
+{
+    // "tx2rx" or "rx2tx" first sets the link parameters of one direction
+    int first = TX2RX;
+    int last = RX2TX;
+    const char *which = "";
+    if (strncmp(command, "tx2rx ", 6) == 0 || strncmp(command, "rx2tx ", 6) == 0)
+    {
+        first = last = command[0] == 't' ? TX2RX : RX2TX;
+        which = first == TX2RX ? "TX->RX " : "RX->TX ";
+        command += 6;
+    }
 
-    while (STOP == FALSE)
+    if (strncmp(command, "ber ", 4) == 0)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
-        if (timeDiff.tv_sec >= 1)
+        double ber;
+        sscanf(command + 4, "%lf", &ber);
+        // A byte goes through when none of its 8 bits flips
+        double acc = pow(1 - ber, 8);
+        if (ber >= 0.0 && ber < 1.0)
         {
-            if (unreliableRate == FALSE)
+            for (int i = first; i <= last; i++)
             {
-                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
-                       "No further warnings will be issued\n");
-                unreliableRate = TRUE;
+                c->dir[i].byteER = 1.0 - acc;
             }
+            say(c, "%sBER SET TO %lf\n", which, ber);
+            if (ber > 0.01)
+            {
+                printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
+            }
+        }
+        else
+        {
+            say(c, "BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
+        }
+    }
+    else if (strncmp(command, "baud ", 5) == 0)
+    {
+        unsigned long baud = 0;
+        sscanf(command + 5, "%lu", &baud);
+        switch (baud) {
+            case 1200:
+            case 1800:
+            case 2400:
+            case 4800:
+            case 9600:
+            case 19200:
+            case 38400:
+            case 57600:
+            case 115200:
+            case 230400:
+            case 460800:
+            case 921600:
+                for (int i = first; i <= last; i++)
+                {
+                    set_baud_rate(&c->dir[i], baud);
+                }
+                say(c, "%sBAUD RATE: %lu\n", which, baud);
+                break;
+            default:
+                printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800 or 921600\n");
         }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
+    }
+    else if (strncmp(command, "prop ", 5) == 0)
+    {
+        unsigned long propDelay;
+        if (sscanf(command + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
         {
-            skipWait = TRUE;
+            printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
         }
         else
         {
-            skipWait = FALSE;
+            for (int i = first; i <= last; i++)
+            {
+                c->dir[i].propDelay = propDelay;
+            }
+            say(c, "%sPROPAGATION DELAY SET TO %lu usec\n", which, propDelay);
         }
-
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
-
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
-
-        if (!par.cableOn)
+    }
+    else if (strncmp(command, "jitter ", 7) == 0)
+    {
+        char kind[16] = "";
+        double usec = 0.0;
+        int n = sscanf(command + 7, "%15s %lf", kind, &usec);
+        int jitter = strcmp(kind, "off") == 0 ? JITTER_OFF
+                   : strcmp(kind, "uniform") == 0 ? JITTER_UNIFORM
+                   : strcmp(kind, "normal") == 0 ? JITTER_NORMAL
+                   : strcmp(kind, "exp") == 0 ? JITTER_EXP : -1;
+        if (jitter < 0 || (jitter != JITTER_OFF && (n < 2 || usec < 0.0 || usec > 1000000.0)))
         {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
+            printf("BAD JITTER: must be off, or uniform, normal or exp and a delay in usec (0-1000000)\n");
         }
-
-        if (par.logfile != NULL)  // Currently logging
+        else
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
+            for (int i = first; i <= last; i++)
+            {
+                c->dir[i].jitter = jitter;
+                c->dir[i].jitterUsec = usec;
+            }
+            if (jitter == JITTER_OFF)
             {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
+                say(c, "%sJITTER OFF\n", which);
             }
             else
             {
-                memcpy(tx2rxTx, "  ", 3);
+                say(c, "%sJITTER %s %.0lf usec\n", which, kind, usec);
             }
-            if (par.rx2txValid[par.rx2txIdx])
+        }
+    }
+    else if (strncmp(command, "burst ", 6) == 0)
+    {
+        double length = 0.0, gap = 0.0;
+        int off = strcmp(command + 6, "off") == 0;
+        if (!off && (sscanf(command + 6, "%lf %lf", &length, &gap) < 2 || length < 1.0 || gap < 1.0))
+        {
+            printf("BAD BURST: must be off, or the mean burst and gap lengths in bytes (at least 1)\n");
+        }
+        else
+        {
+            for (int i = first; i <= last; i++)
             {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                c->dir[i].burstStart = off ? 0.0 : 1.0 / gap;
+                c->dir[i].burstEnd = off ? 0.0 : 1.0 / length;
+                c->dir[i].inBurst = FALSE;
+            }
+            if (off)
+            {
+                say(c, "%sBURSTS OFF\n", which);
             }
             else
             {
-                memcpy(rx2txTx, "  ", 3);
+                say(c, "%sBURSTS OF %.0lf BYTES EVERY %.0lf BYTES\n", which, length, gap);
             }
         }
+    }
+    else if (first == last)
+    {
+        printf("ONLY ber, baud, prop, jitter AND burst APPLY TO ONE DIRECTION\n");
+    }
+    else if (strcmp(command, "off") == 0)
+    {
+        say(c, "CONNECTION OFF\n");
+        if (c->cableOn && c->logfile != NULL)
+        {
+            fputs("CABLE OFF\n", c->logfile);
+        }
+        c->cableOn = FALSE;
+    }
+    else if (strcmp(command, "on") == 0)
+    {
+        say(c, "CONNECTION ON\n");
+        c->cableOn = TRUE;
+    }
+    else if (strncmp(command, "log ", 4) == 0)
+    {
+        if (manyCables)
+        {
+            // One file per cable
+            char filename[BUF_SIZE + 16];
+            snprintf(filename, sizeof(filename), "%s.%d", command + 4, c->id);
+            startlog(c, filename);
+        }
+        else
+        {
+            startlog(c, command + 4);
+        }
+    }
+    else if (strcmp(command, "endlog") == 0)
+    {
+        endlog(c);
+        say(c, "NOT LOGGING\n");
+    }
+    else if (strncmp(command, "pcap ", 5) == 0)
+    {
+        const char *file = command + 5;
+        int cobs = FALSE;
+        if (strncmp(file, "cobs ", 5) == 0 || strncmp(file, "ppp ", 4) == 0)
+        {
+            cobs = file[0] == 'c';
+            file += cobs ? 5 : 4;
+        }
+        if (manyCables)
+        {
+            // One file per cable
+            char filename[BUF_SIZE + 16];
+            snprintf(filename, sizeof(filename), "%s.%d", file, c->id);
+            startpcap(c, filename, cobs);
+        }
+        else
+        {
+            startpcap(c, file, cobs);
+        }
+    }
+    else if (strcmp(command, "endpcap") == 0)
+    {
+        endpcap(c);
+        say(c, "NOT CAPTURING\n");
+    }
+    else {
+        printf("BAD COMMAND OR MISSING PARAMETERS\n");
+    }
+}
 
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
 
-        if (par.cableOn)
+// Run a console or scenario command on cable "cable" (-1 for the selected
+// ones). Returns TRUE if the program must stop.
+int run_command(const char *command, int cable)
+{
+    // A leading number picks the cable for this command only
+    if (*command >= '0' && *command <= '9')
+    {
+        char *rest;
+        cable = (int)strtol(command, &rest, 10);
+        command = rest + strspn(rest, " \t");
+        if (cable >= numCables)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) (1 << (rand() % 8));
-                }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
-            }
+            printf("NO CABLE %d (THERE ARE %d)\n", cable, numCables);
+            return FALSE;
+        }
+    }
+    else if (cable < 0)
+    {
+        cable = selected;
+    }
 
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) (1 << (rand() % 8));
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
-            }
+    if (strcmp(command, "quit") == 0)
+    {
+        printf("END OF THE PROGRAM\n");
+        return TRUE;
+    }
+    else if (strcmp(command, "help") == 0) {
+        help();
+    }
+    else if (strncmp(command, "cable ", 6) == 0)
+    {
+        int n;
+        if (strcmp(command + 6, "all") == 0)
+        {
+            selected = -1;
+            printf("COMMANDS APPLY TO ALL CABLES\n");
+        }
+        else if (sscanf(command + 6, "%d", &n) == 1 && n >= 0 && n < numCables)
+        {
+            selected = n;
+            printf("COMMANDS APPLY TO CABLE %d\n", n);
+        }
+        else
+        {
+            printf("BAD CABLE: must be all or between 0 and %d\n", numCables - 1);
         }
+    }
+    else if (cable >= 0)
+    {
+        cable_command(&cables[cable], command, FALSE);
+    }
+    else
+    {
+        for (int i = 0; i < numCables; i++)
+        {
+            cable_command(&cables[i], command, numCables > 1);
+        }
+    }
+    return FALSE;
+}
 
-        if (par.logfile != NULL)  // Currently logging
+
+// Write the bytes direction dir of cable c delivered. What the port does
+// not take yet stays for the next pass.
+void flush_delivered(struct Cable *c, int dir)
+{
+    struct Direction *d = &c->dir[dir];
+    int to = dir == TX2RX ? c->fdRx : c->fdTx;
+    if (d->outLen == 0)
+    {
+        return;
+    }
+    int n = write(to, d->out, d->outLen);
+    if (n > 0)
+    {
+        memmove(d->out, d->out + n, d->outLen - n);
+        d->outLen -= n;
+    }
+}
+
+// Move one byte slot of direction dir of cable c, which started at "slot":
+// put the byte read from one end on the wire and deliver the oldest one to
+// the other end once it has crossed it. At most one byte goes each way per
+// slot, as on a real line. due is the number of slots already due, this
+// one included: up to that many bytes are read at once, so that fast rates
+// do not cost a system call per byte.
+void cable_tick(struct Cable *c, int dir, const struct timespec *slot, int due)
+{
+    struct Direction *d = &c->dir[dir];
+    int from = dir == TX2RX ? c->fdTx : c->fdRx;
+
+    // For logging
+    char in[3] = "  ", out[3] = "  ";
+
+    unsigned char byte;
+    if (d->inPos == d->inLen)
+    {
+        int n = read(from, d->in, due < BUF_SIZE ? due : BUF_SIZE);
+        d->inPos = 0;
+        d->inLen = n > 0 ? n : 0;
+    }
+    int bytesRead = 0;
+    if (d->inPos < d->inLen)
+    {
+        byte = d->in[d->inPos++];
+        bytesRead = 1;
+    }
+    if (bytesRead > 0 && !c->cableOn)  // Ignored if off
+    {
+        d->frameDamage |= FRAME_LOST;
+    }
+    else if (bytesRead > 0)
+    {
+        sprintf(in, "%02hhX", byte);
+        int corrupted = add_errors(d, &byte);
+
+        // Never before the byte sent last, bytes do not overtake each other
+        long long delay = (long long) (1000.0 * ((double) d->propDelay + jitter_sample(d)));
+        struct timespec arrival = *slot;
+        if (delay > 0)
+        {
+            struct timespec extra = { .tv_sec = (time_t) (delay / 1000000000LL),
+                                      .tv_nsec = (long) (delay % 1000000000LL) };
+            arrival = timespec_sum(slot, &extra);
+        }
+        if (timespec_comp(&arrival, &d->lastArrival) < 0)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
+            arrival = d->lastArrival;
+        }
+        d->lastArrival = arrival;
+        if (line_push(d, byte, corrupted, &arrival) < 0)
+        {
+            say(c, "OUT OF MEMORY, BYTE DROPPED\n");
+        }
+    }
+
+    if (d->lineCount > 0 && timespec_comp(&d->arrival[d->lineHead], slot) <= 0)
+    {
+        byte = d->line[d->lineHead];
+        int corrupted = d->hit[d->lineHead];
+        d->lineHead = (d->lineHead + 1) % d->lineSize;
+        d->lineCount--;
+        // A disconnected cable loses what was on the wire
+        if (c->cableOn)
+        {
+            if (d->outLen == BUF_SIZE)
             {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
+                flush_delivered(c, dir);
             }
-            else
+            // Lost like on a real line if the other end does not read
+            if (d->outLen < BUF_SIZE)
             {
-                memcpy(tx2rxRx, "  ", 3);
+                d->out[d->outLen++] = byte;
             }
-            if (par.rx2txValid[par.rx2txIdx])
+            sprintf(out, "%02hhX", byte);
+            if (c->pcapfile != NULL)
             {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                pcap_byte(c, dir, byte, corrupted, slot);
             }
-            else
+        }
+        else
+        {
+            d->frameDamage |= FRAME_LOST;
+        }
+    }
+
+    if (c->logfile != NULL)  // Currently logging
+    {
+        d->idle = *in == ' ' && *out == ' ';
+        if (d->idle && c->dir[1 - dir].idle)
+        {
+            if (c->cableIdle == FALSE)
             {
-                memcpy(rx2txRx, "  ", 3);
+                fputs("---------------\n", c->logfile);
+                c->cableIdle = TRUE;
             }
-
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
+        }
+        else if (!d->idle)
+        {
+            if (dir == TX2RX)
             {
-                if (cableIdle == FALSE)
-                {
-                    fputs("---------------\n", par.logfile);
-                    cableIdle = TRUE;
-                }
+                fprintf(c->logfile, "%s  %s |        \n", in, out);
             }
             else
             {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
-                cableIdle = FALSE;
+                fprintf(c->logfile, "        | %s  %s\n", in, out);
             }
+            c->cableIdle = FALSE;
         }
+    }
+}
 
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
+int main(int argc, char *argv[])
+{
+    const char *scenario = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:h")) != -1)
+    {
+        switch (opt)
         {
-            rxStdin[fromStdin - 1] = '\0';
-
-            if (strcmp(rxStdin, "off") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
-                {
-                    fputs("CABLE OFF\n", par.logfile);
-                }
-                par.cableOn = FALSE;
-            }
-            else if (strcmp(rxStdin, "on") == 0)
+        case 'n':
+            numCables = atoi(optarg);
+            if (numCables < 1 || numCables > MAX_CABLES)
             {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
+                usage(argv[0]);
+                exit(-1);
             }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
+            break;
+        case 's':
+            scenario = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? 0 : -1);
+        }
+    }
+
+    printf("\n");
+
+    for (int i = 0; i < numCables; i++)
+    {
+        init_cable(&cables[i], i);
+    }
+
+    // Remove the links on Ctrl+C or kill as well
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    struct timespec wall, mono;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    wallClockOffset = timespec_diff(&wall, &mono);
+
+    if (open_cables() < 0)
+    {
+        close_cables();
+        exit(-1);
+    }
+
+    help();
+
+    // Configure stdin to receive commands to this program
+    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+
+    char rxStdin[BUF_SIZE] = {0};
+
+    int STOP = FALSE;
+
+    for (int i = 0; i < numCables; i++)
+    {
+        say(&cables[i], "BAUD RATE: %d\n", DEFAULT_BAUDRATE);
+    }
+
+    // A single real-time process serves every cable
+    set_rt_priority();
+
+    // To compensate for deviations in byte transmission time, each
+    // direction of each cable keeps its own schedule of byte slots
+    struct timespec currentTime, timeDiff, nextWait;
+    clock_gettime(CLOCK_MONOTONIC, &currentTime);
+    for (int i = 0; i < numCables; i++)
+    {
+        cables[i].dir[TX2RX].nextTxTime = currentTime;
+        cables[i].dir[RX2TX].nextTxTime = currentTime;
+    }
+
+    if (scenario != NULL && load_scenario(scenario, &currentTime) < 0)
+    {
+        close_cables();
+        exit(-1);
+    }
+
+    printf("\nCable ready\n\n");
+
+    srand48((long) time(NULL));
+
+    while (STOP == FALSE && !interrupted)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &currentTime);
+
+        // Serve the directions whose byte slot has come
+        for (int i = 0; i < numCables; i++)
+        {
+            struct Cable *c = &cables[i];
+            for (int dir = TX2RX; dir <= RX2TX; dir++)
             {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eighth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
+                struct Direction *d = &c->dir[dir];
+                // Every slot that is due, several at fast rates, but few
+                // enough that commands still run when it cannot keep up
+                for (int n = 0; n < BUF_SIZE && timespec_comp(&d->nextTxTime, &currentTime) <= 0; n++)
                 {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
+                    struct timespec slot = d->nextTxTime;
+                    timeDiff = timespec_diff(&currentTime, &d->nextTxTime);
+                    d->nextTxTime = timespec_sum(&d->nextTxTime, &d->byteDelay);
+                    if (timeDiff.tv_sec >= 1)
                     {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
+                        if (c->unreliableRate == FALSE)
+                        {
+                            say(c, "UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
+                                   "No further warnings will be issued\n");
+                            c->unreliableRate = TRUE;
+                        }
                     }
+                    long long late = (long long) timeDiff.tv_sec * 1000000000LL + timeDiff.tv_nsec;
+                    cable_tick(c, dir, &slot, (int) (late / d->byteDelay.tv_nsec) + 1);
                 }
-                else
-                {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
-                }
-            }
-            else if (strncmp(rxStdin, "baud ", 5) == 0)
-            {
-                unsigned long baud = 0;
-                sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
-                }
+                flush_delivered(c, dir);
             }
-            else if (strncmp(rxStdin, "prop ", 5) == 0)
+        }
+
+        // Scenario commands that are due
+        while (STOP == FALSE && nextEvent < numEvents &&
+               timespec_comp(&events[nextEvent].at, &currentTime) <= 0)
+        {
+            struct Event *e = &events[nextEvent];
+            if (strcmp(e->command, "repeat") == 0)
             {
-                unsigned long propDelay;
-                if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
+                // Start over, as if the scenario had been loaded now
+                struct timespec period = timespec_diff(&e->at, &scenarioStart);
+                scenarioStart = e->at;
+                for (int i = 0; i < numEvents; i++)
                 {
-                    printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
-                }
-                else
-                {
-                    par.propDelay = propDelay;
-                    init_ring_buffers();
+                    events[i].at = timespec_sum(&events[i].at, &period);
                 }
+                nextEvent = 0;
+                continue;
             }
-            else if (strncmp(rxStdin, "log ", 4) == 0)
-            {
-                startlog(rxStdin + 4);
-            }
-            else if (strcmp(rxStdin, "endlog") == 0)
-            {
-                endlog();
-                printf("NOT LOGGING\n");
-            }
-            else if (strcmp(rxStdin, "quit") == 0)
+            STOP = run_command(e->command, e->cable);
+            nextEvent++;
+        }
+
+        // Read commands from STDIN to control the cable mode
+        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
+        if (fromStdin > 0)
+        {
+            rxStdin[fromStdin - 1] = '\0';
+            if (run_command(rxStdin, -1))
             {
-                printf("END OF THE PROGRAM\n");
                 STOP = TRUE;
             }
-            else if (strcmp(rxStdin, "help") == 0) {
-                help();
-            }
-            else {
-                printf("BAD COMMAND OR MISSING PARAMETERS\n");
-            }
         }
 
-        if (skipWait == FALSE) {
+        // Sleep until the earliest byte slot
+        struct timespec *earliest = &cables[0].dir[TX2RX].nextTxTime;
+        for (int i = 0; i < numCables; i++)
+        {
+            for (int dir = TX2RX; dir <= RX2TX; dir++)
+            {
+                if (timespec_comp(&cables[i].dir[dir].nextTxTime, earliest) < 0)
+                {
+                    earliest = &cables[i].dir[dir].nextTxTime;
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &currentTime);
+        nextWait = timespec_diff(earliest, &currentTime);
+        if (STOP == FALSE && !timespec_is_negative(&nextWait)) {
+            // Fast rates have slots shorter than a wakeup: sleep longer and
+            // serve the slots due meanwhile together, rather than spin
+            if (nextWait.tv_sec == 0 && nextWait.tv_nsec < MIN_SLEEP_NS) {
+                nextWait.tv_nsec = MIN_SLEEP_NS;
+            }
             nanosleep(&nextWait, NULL);
         }
     }
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
+    for (int i = 0; i < numCables; i++)
     {
-        perror("tcsetattr");
-        exit(-1);
-    }
-
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
-    {
-        perror("tcsetattr");
-        exit(-1);
+        endlog(&cables[i]);
+        endpcap(&cables[i]);
     }
 
-    close(fdTx);
-    close(fdRx);
-
-    system("killall socat");
+    close_cables();
 
     return 0;
 }
@@ -0,0 +1,80 @@
+// Application packet format
+
+#include "app_packet.h"
+
+#include <string.h>
+
+static int put_tlv_number(unsigned char *packet, int k, unsigned char T, uint64_t value)
+{
+    packet[k++] = T;
+    packet[k++] = sizeof(uint64_t);
+    for (int i = sizeof(uint64_t) - 1; i >= 0; --i)
+        packet[k++] = (unsigned char)(value >> (8 * i));
+    return k;
+}
+
+int build_control_packet(unsigned char *packet, unsigned char C, const ControlInfo *info)
+{
+    int k = 0;
+    packet[k++] = C;
+    k = put_tlv_number(packet, k, T_SIZE, info->fileSize);
+    if (info->resumeOffset > 0)
+    {
+        k = put_tlv_number(packet, k, T_RESUME, info->resumeOffset);
+        k = put_tlv_number(packet, k, T_HASH, info->resumeHash);
+    }
+    if (info->fileCount > 0)
+        k = put_tlv_number(packet, k, T_COUNT, info->fileCount);
+    if (info->mtime > 0)
+        k = put_tlv_number(packet, k, T_MTIME, info->mtime);
+    if (info->hasFileHash)
+        k = put_tlv_number(packet, k, T_FILE_HASH, info->fileHash);
+
+    int nameLen = strlen(info->name);
+    if (nameLen > 255 || k + 2 + nameLen > MAX_PAYLOAD_SIZE)
+        nameLen = 0;
+    packet[k++] = T_NAME;
+    packet[k++] = (unsigned char)nameLen;
+    memcpy(&packet[k], info->name, nameLen);
+    k += nameLen;
+    return k;
+}
+
+int parse_control_packet(const unsigned char *packet, int len, ControlInfo *info)
+{
+    memset(info, 0, sizeof(*info));
+    int k = 1;
+    while (k + 2 <= len)
+    {
+        unsigned char T = packet[k];
+        unsigned char L = packet[k + 1];
+        const unsigned char *V = &packet[k + 2];
+        if (k + 2 + L > len)
+            return -1;
+        uint64_t value = 0;
+        for (int i = 0; i < L && i < (int)sizeof(value); ++i)
+            value = (value << 8) | V[i];
+        if (T == T_SIZE)
+            info->fileSize = (long)value;
+        else if (T == T_RESUME)
+            info->resumeOffset = (long)value;
+        else if (T == T_HASH)
+            info->resumeHash = value;
+        else if (T == T_COUNT)
+            info->fileCount = (long)value;
+        else if (T == T_MTIME)
+            info->mtime = (long)value;
+        else if (T == T_FILE_HASH)
+        {
+            info->fileHash = value;
+            info->hasFileHash = TRUE;
+        }
+        else if (T == T_NAME)
+        {
+            memcpy(info->name, V, L);
+            info->name[L] = '\0';
+        }
+        k += 2 + L;
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+// Application packet format header.
+
+#ifndef _APP_PACKET_H_
+#define _APP_PACKET_H_
+
+#include <stdint.h>
+
+#include "link_layer.h"
+
+// Control field of application packets
+#define C_DATA 1
+#define C_START 2
+#define C_END 3
+#define C_SESSION 4 // Start of a multi-file session
+#define C_PACK 5    // Records of one or more files of a session
+#define C_BOND 6    // Packet striped over a bond of links, see bond.h
+#define C_CHANNEL 7 // Message of a logical channel, see channel.h
+
+// TLV types of START / END / SESSION packets
+#define T_SIZE 0
+#define T_NAME 1
+#define T_RESUME 2 // Offset the transfer continues from
+#define T_HASH 3   // hash64 of the bytes before T_RESUME
+#define T_COUNT 4  // Number of files in a session
+#define T_MTIME 5  // Modification time of the file, seconds since the epoch
+#define T_FILE_HASH 6 // hash64 of the whole file, or of every R_DATA of a session (END)
+
+// Packets are up to llmaxpayload() bytes, so lengths inside them fit 16 bits
+#define DATA_HEADER_SIZE 3
+
+// Records carried by C_PACK packets: type (1 byte), length (2 bytes), value
+#define R_FILE 0 // Next file: size and mtime (8 bytes each) followed by its relative name
+#define R_DATA 1 // Bytes of the current file
+#define RECORD_HEADER_SIZE 3
+// Largest record for C_PACK packets of packetSize bytes, llmaxpayload()
+// on the open link: one record fills a packet
+#define RECORD_MAX(packetSize) ((packetSize) - 1)
+#define RECORD_DATA_MAX(packetSize) (RECORD_MAX(packetSize) - RECORD_HEADER_SIZE)
+
+// Contents of a START / END / SESSION packet
+typedef struct
+{
+    long fileSize; // Size of the file, or of all files of a session
+    char name[256];
+    long resumeOffset;
+    uint64_t resumeHash;
+    long fileCount;
+    long mtime; // 0 if unknown
+    uint64_t fileHash;
+    int hasFileHash;
+} ControlInfo;
+
+// Build a control packet with control field C. Return its length.
+int build_control_packet(unsigned char *packet, unsigned char C, const ControlInfo *info);
+
+// Parse the TLVs of a control packet. Return 0 on success or -1 if malformed.
+int parse_control_packet(const unsigned char *packet, int len, ControlInfo *info);
+
+#endif // _APP_PACKET_H_
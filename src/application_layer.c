@@ -1,15 +1,908 @@
 // Application layer protocol implementation
 
+#define _GNU_SOURCE // fallocate(), sync_file_range()
+
 #include "application_layer.h"
+#include "app_packet.h"
+#include "batch.h"
+#include "bond.h"
+#include "channel.h"
+#include "hash.h"
+#include "journal.h"
 #include "link_layer.h"
+#include "metrics.h"
+#include "packet_ring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Slots in each ring between two pipeline stages
+#define RING_SLOTS 16
+
+// DATA packets between two journal updates
+#define JOURNAL_INTERVAL 16
+
+// Bytes of output handed to writeback at a time. The receiver waits for
+// the previous window only, so dirty pages stay bounded without one large
+// fsync at the end.
+#define SYNC_WINDOW (1 << 20)
+
+// Every payload in the receiver's rings may be lent at once
+#if 2 * RING_SLOTS > LL_RX_VIEWS
+#error "The receiver rings hold more payloads than llreadview() lends"
+#endif
+
+// Calls a transfer runs over: a single link, or a bond of several
+typedef struct
+{
+    int (*write)(const unsigned char *buf, int bufSize);
+    void (*setcallback)(LlEventCallback callback, void *user);
+    int (*flush)(void);
+    int (*readview)(const unsigned char **data);
+    void (*release)(const unsigned char *data);
+    int (*maxpayload)(void);
+} Transport;
+
+static const Transport g_single = {llwrite, llsetcallback, llflush, llreadview, llrelease, llmaxpayload};
+static const Transport g_bonded = {bond_write, bond_setcallback, bond_flush,
+                                   bond_readview, bond_release, bond_maxpayload};
+static const Transport *g_link = &g_single;
+
+// Transmitter: file reader -> packetizer -> link sender
+typedef struct
+{
+    int fd;
+    const char *filename;
+    int chunkSize; // File bytes per DATA packet
+    ControlInfo info;
+    Journal journal; // Bytes acknowledged so far
+    int sinceJournal;
+    Hash64 hash;       // Of the bytes acknowledged, for the journal
+    Hash64 packedHash; // Of the bytes packetized, sent in END
+    PacketRing chunks;  // reader -> packetizer
+    PacketRing packets; // packetizer -> link sender
+} TxPipeline;
+
+// Bytes of a payload lent by g_link->readview(). The receiver's rings carry
+// these rather than copies, so file data goes from the link's receive
+// buffer straight to write().
+typedef struct
+{
+    const unsigned char *data;
+    const unsigned char *release; // Payload to give back once used, or NULL
+} View;
+
+// Receiver: link receiver -> depacketizer -> file writer
+typedef struct
+{
+    const char *filename;
+    int fd; // Opened by the depacketizer when START arrives
+    long fileSize;
+    long written;
+    long synced; // Output offset writeback was started up to
+    long mtime;  // From END, applied once the file is complete
+    uint64_t fileHash; // From END, checked once the file is complete
+    int hasFileHash;
+    int failed;
+    int batch; // Multi-file session, chunks carry R_FILE / R_DATA records
+    BatchWriter batchWriter;
+    Journal journal; // Bytes written so far
+    Hash64 hash;     // Of the bytes written (R_DATA values in a session)
+    PacketRing packets; // link receiver -> depacketizer, one View per slot
+    PacketRing chunks;  // depacketizer -> file writer, one View per slot
+} RxPipeline;
+
+////////////////////////////////////////////////
+// TRANSMITTER STAGES
+////////////////////////////////////////////////
+static void *tx_reader(void *arg)
+{
+    TxPipeline *p = arg;
+    while (TRUE)
+    {
+        unsigned char *slot = ring_acquire(&p->chunks);
+        if (slot == NULL)
+            return NULL;
+        int n = read(p->fd, slot, p->chunkSize);
+        if (n < 0)
+        {
+            perror("[APP] read");
+            ring_abort(&p->chunks);
+            return NULL;
+        }
+        if (n == 0)
+        {
+            ring_close(&p->chunks);
+            return NULL;
+        }
+        ring_commit(&p->chunks, n);
+    }
+}
+
+static void *tx_packetizer(void *arg)
+{
+    TxPipeline *p = arg;
+    unsigned char *packet = ring_acquire(&p->packets);
+    if (packet == NULL)
+        return NULL;
+    ring_commit(&p->packets, build_control_packet(packet, C_START, &p->info));
+
+    int len;
+    unsigned char *chunk;
+    while ((chunk = ring_peek(&p->chunks, &len)) != NULL)
+    {
+        packet = ring_acquire(&p->packets);
+        if (packet == NULL)
+        {
+            ring_abort(&p->chunks);
+            return NULL;
+        }
+        packet[0] = C_DATA;
+        packet[1] = (unsigned char)(len >> 8);
+        packet[2] = (unsigned char)(len & 0xFF);
+        memcpy(&packet[DATA_HEADER_SIZE], chunk, len);
+        hash64_update(&p->packedHash, chunk, len);
+        ring_commit(&p->packets, DATA_HEADER_SIZE + len);
+        ring_release(&p->chunks);
+    }
+    if (ring_is_aborted(&p->chunks))
+    {
+        ring_abort(&p->packets);
+        return NULL;
+    }
+
+    packet = ring_acquire(&p->packets);
+    if (packet == NULL)
+        return NULL;
+    p->info.resumeOffset = 0;
+    p->info.fileHash = hash64_final(&p->packedHash);
+    p->info.hasFileHash = TRUE;
+    ring_commit(&p->packets, build_control_packet(packet, C_END, &p->info));
+    ring_close(&p->packets);
+    return NULL;
+}
+
+typedef void (*SentHandler)(const unsigned char *packet, int len, void *user);
+
+typedef struct
+{
+    SentHandler onSent;
+    void *user;
+} SentHook;
+
+static void on_link_event(const LlEvent *event, void *user)
+{
+    SentHook *hook = user;
+    if (event->type == LlSent)
+        hook->onSent(event->data, event->len, hook->user);
+}
+
+// Queue every line typed on stdin as a message on CH_MESSAGE, until
+// stdin ends or the ring is aborted.
+static void *tx_messages(void *arg)
+{
+    PacketRing *messages = arg;
+    int max = g_link->maxpayload() - CH_HEADER_SIZE;
+    unsigned char *line = ring_acquire(messages);
+    int len = 0;
+    while (line != NULL && !ring_is_aborted(messages))
+    {
+        struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        unsigned char c;
+        if (read(STDIN_FILENO, &c, 1) != 1)
+        {
+            if (len > 0)
+                ring_commit(messages, len);
+            ring_close(messages);
+            return NULL;
+        }
+        if (c != '\n' && len < max)
+            line[len++] = c;
+        if (c == '\n' && len > 0)
+        {
+            ring_commit(messages, len);
+            line = ring_acquire(messages);
+            len = 0;
+        }
+    }
+    return NULL;
+}
+
+// Send the packets through the channel scheduler, with the lines typed on
+// stdin as messages of a higher priority.
+static int channel_sender(PacketRing *packets, SentHook *hook)
+{
+    PacketRing messages;
+    if (ring_init(&messages, RING_SLOTS, g_link->maxpayload() - CH_HEADER_SIZE) < 0)
+        return -1;
+    ch_add(CH_BULK, packets, 0, 1);
+    ch_add(CH_MESSAGE, &messages, 1, 1);
+    pthread_t reader;
+    pthread_create(&reader, NULL, tx_messages, &messages);
+
+    int ret = ch_transmit(hook->onSent != NULL ? on_link_event : NULL, hook);
+
+    ring_abort(&messages);
+    pthread_join(reader, NULL);
+    ch_reset();
+    ring_destroy(&messages);
+    return ret;
+}
+
+// Link sender stage, runs on the calling thread. write() only queues the
+// packet, onSent is called once the receiver acknowledged it.
+static int link_sender(PacketRing *packets, SentHandler onSent, void *user)
+{
+    SentHook hook = {.onSent = onSent, .user = user};
+    // The channels share a single link, a bond schedules its own packets
+    if (g_link == &g_single)
+        return channel_sender(packets, &hook);
+    if (onSent != NULL)
+        g_link->setcallback(on_link_event, &hook);
+
+    int ret = 0;
+    int len;
+    unsigned char *packet;
+    while ((packet = ring_peek(packets, &len)) != NULL)
+    {
+        if (g_link->write(packet, len) != len)
+        {
+            fprintf(stderr, "[APP] llwrite failed\n");
+            ring_abort(packets);
+            ret = -1;
+            break;
+        }
+        ring_release(packets);
+    }
+    if (ret == 0 && ring_is_aborted(packets))
+        ret = -1;
+    // Wait for the packets still in the link window
+    if (g_link->flush() < 0)
+        ret = -1;
+    g_link->setcallback(NULL, NULL);
+    return ret;
+}
+
+// Record acknowledged DATA in the journal
+static void tx_journal_sent(const unsigned char *packet, int len, void *user)
+{
+    TxPipeline *p = user;
+    if (packet[0] != C_DATA)
+        return;
+    hash64_update(&p->hash, &packet[DATA_HEADER_SIZE], len - DATA_HEADER_SIZE);
+    p->journal.offset += len - DATA_HEADER_SIZE;
+    p->journal.hash = p->hash;
+    g_metrics->transferDone = p->journal.offset;
+    if (++p->sinceJournal == JOURNAL_INTERVAL)
+    {
+        journal_save(p->filename, &p->journal);
+        p->sinceJournal = 0;
+    }
+}
+
+static int transmit_file(const char *filename)
+{
+    TxPipeline p;
+    memset(&p, 0, sizeof(p));
+    p.filename = filename;
+    p.fd = open(filename, O_RDONLY);
+    if (p.fd < 0)
+    {
+        perror(filename);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(p.fd, &st) < 0)
+    {
+        perror("[APP] fstat");
+        close(p.fd);
+        return -1;
+    }
+    p.info.fileSize = st.st_size;
+    p.info.mtime = (long)st.st_mtime;
+    strncpy(p.info.name, filename, sizeof(p.info.name) - 1);
+
+    // Continue an interrupted transfer of the same, unmodified file
+    hash64_init(&p.hash);
+    if (journal_load(filename, &p.journal) == 0 && p.journal.fileSize == st.st_size &&
+        p.journal.mtime == (long)st.st_mtime && p.journal.offset > 0 &&
+        lseek(p.fd, p.journal.offset, SEEK_SET) == p.journal.offset)
+    {
+        p.hash = p.journal.hash;
+        p.info.resumeOffset = p.journal.offset;
+        p.info.resumeHash = hash64_final(&p.journal.hash);
+        printf("[APP] Resuming %s at offset %ld\n", filename, p.journal.offset);
+    }
+    else
+    {
+        p.journal.fileSize = st.st_size;
+        p.journal.mtime = (long)st.st_mtime;
+        p.journal.offset = 0;
+        p.journal.hash = p.hash;
+    }
+    p.packedHash = p.hash;
+
+    p.chunkSize = g_link->maxpayload() - DATA_HEADER_SIZE;
+    if (ring_init(&p.chunks, RING_SLOTS, p.chunkSize) < 0 ||
+        ring_init(&p.packets, RING_SLOTS, g_link->maxpayload()) < 0)
+    {
+        fprintf(stderr, "[APP] Out of memory\n");
+        close(p.fd);
+        return -1;
+    }
+    printf("[APP] Sending %s (%ld bytes)\n", filename, p.info.fileSize);
+    g_metrics->transferTotal = p.info.fileSize;
+    g_metrics->transferDone = p.journal.offset;
+
+    pthread_t reader, packetizer;
+    pthread_create(&reader, NULL, tx_reader, &p);
+    pthread_create(&packetizer, NULL, tx_packetizer, &p);
+
+    int ret = link_sender(&p.packets, tx_journal_sent, &p);
+    if (ret < 0)
+    {
+        ring_abort(&p.chunks);
+        if (p.journal.offset > 0 && journal_save(filename, &p.journal) == 0)
+            printf("[APP] Progress saved at offset %ld\n", p.journal.offset);
+    }
+    else
+        journal_remove(filename);
+
+    pthread_join(reader, NULL);
+    pthread_join(packetizer, NULL);
+    ring_destroy(&p.chunks);
+    ring_destroy(&p.packets);
+    close(p.fd);
+    return ret;
+}
+
+// Count the acknowledged file bytes of a session
+static void tx_batch_sent(const unsigned char *packet, int len, void *user)
+{
+    (void)user;
+    if (packet[0] != C_PACK)
+        return;
+    for (int k = 1; k + RECORD_HEADER_SIZE <= len;)
+    {
+        int dataLen = (packet[k + 1] << 8) | packet[k + 2];
+        if (packet[k] == R_DATA)
+            g_metrics->transferDone += dataLen;
+        k += RECORD_HEADER_SIZE + dataLen;
+    }
+}
+
+// Send every file of a directory or manifest in one session. Resuming is
+// not supported for sessions.
+static int transmit_batch(const char *source)
+{
+    BatchSource b;
+    if (batch_collect(&b, source) < 0)
+        return -1;
+    PacketRing packets;
+    b.packetSize = g_link->maxpayload();
+    if (ring_init(&b.records, RING_SLOTS, RECORD_MAX(b.packetSize)) < 0 ||
+        ring_init(&packets, RING_SLOTS, b.packetSize) < 0)
+    {
+        fprintf(stderr, "[APP] Out of memory\n");
+        batch_free(&b);
+        return -1;
+    }
+    b.packets = &packets;
+    printf("[APP] Sending %d files (%ld bytes) from %s\n", b.nFiles, b.totalSize, source);
+    g_metrics->transferTotal = b.totalSize;
+
+    pthread_t reader, packer;
+    pthread_create(&reader, NULL, batch_reader, &b);
+    pthread_create(&packer, NULL, batch_packer, &b);
+
+    int ret = link_sender(&packets, tx_batch_sent, NULL);
+    if (ret < 0)
+        ring_abort(&b.records);
+
+    pthread_join(reader, NULL);
+    pthread_join(packer, NULL);
+    ring_destroy(&b.records);
+    ring_destroy(&packets);
+    batch_free(&b);
+    return ret;
+}
+
+////////////////////////////////////////////////
+// RECEIVER STAGES
+////////////////////////////////////////////////
+// Check that the first offset bytes of the output match the transmitter's
+// hash, trusting our own journal when it describes exactly that prefix,
+// and continue p->hash from them.
+static int rx_verify_prefix(RxPipeline *p, const ControlInfo *info)
+{
+    struct stat st;
+    if (fstat(p->fd, &st) < 0 || st.st_size < info->resumeOffset)
+        return -1;
+    Journal own;
+    if (journal_load(p->filename, &own) == 0 && own.fileSize == info->fileSize &&
+        own.offset == info->resumeOffset && hash64_final(&own.hash) == info->resumeHash)
+    {
+        p->hash = own.hash;
+        return 0;
+    }
+
+    Hash64 hash;
+    hash64_init(&hash);
+    unsigned char buf[4096];
+    long left = info->resumeOffset;
+    while (left > 0)
+    {
+        int n = pread(p->fd, buf, left < (long)sizeof(buf) ? left : (long)sizeof(buf),
+                      info->resumeOffset - left);
+        if (n <= 0)
+            return -1;
+        hash64_update(&hash, buf, n);
+        left -= n;
+    }
+    if (hash64_final(&hash) != info->resumeHash)
+        return -1;
+    p->hash = hash;
+    return 0;
+}
+
+// Reserve the blocks of the rest of the file so writes never wait on block
+// allocation. The size still grows as data arrives.
+static void rx_preallocate(RxPipeline *p, long from)
+{
+    if (p->fileSize > from && fallocate(p->fd, FALLOC_FL_KEEP_SIZE, from, p->fileSize - from) < 0 &&
+        errno != EOPNOTSUPP)
+        perror("[APP] fallocate");
+}
+
+static int rx_open_output(RxPipeline *p, const ControlInfo *info)
+{
+    p->fileSize = info->fileSize;
+    p->journal.fileSize = info->fileSize;
+    p->journal.mtime = 0;
+    if (info->resumeOffset <= 0)
+    {
+        p->fd = open(p->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (p->fd < 0)
+        {
+            perror(p->filename);
+            return -1;
+        }
+        hash64_init(&p->hash);
+        p->journal.offset = 0;
+        p->journal.hash = p->hash;
+        rx_preallocate(p, 0);
+        return 0;
+    }
+
+    p->fd = open(p->filename, O_RDWR);
+    if (p->fd < 0 || rx_verify_prefix(p, info) < 0)
+    {
+        fprintf(stderr, "[APP] Cannot resume at offset %ld: local copy does not match. "
+                        "Remove %s.journal on the transmitter to start over.\n",
+                info->resumeOffset, info->name);
+        return -1;
+    }
+    // Drop anything past the acknowledged prefix (e.g. a frame whose RR was lost)
+    if (ftruncate(p->fd, info->resumeOffset) < 0 ||
+        lseek(p->fd, info->resumeOffset, SEEK_SET) != info->resumeOffset)
+    {
+        perror("[APP] resume");
+        return -1;
+    }
+    p->journal.offset = info->resumeOffset;
+    p->journal.hash = p->hash;
+    p->synced = info->resumeOffset;
+    g_metrics->transferDone = info->resumeOffset;
+    rx_preallocate(p, info->resumeOffset);
+    printf("[APP] Resuming at offset %ld (prefix verified)\n", info->resumeOffset);
+    return 0;
+}
+
+// Queue a view of len bytes at data for the writer.
+// Return 0, or -1 if the pipeline was aborted.
+static int rx_queue_chunk(RxPipeline *p, const unsigned char *data, int len, const unsigned char *release)
+{
+    View *chunk = (View *)ring_acquire(&p->chunks);
+    if (chunk == NULL)
+        return -1;
+    chunk->data = data;
+    chunk->release = release;
+    ring_commit(&p->chunks, len);
+    return 0;
+}
+
+static void *rx_depacketizer(void *arg)
+{
+    RxPipeline *p = arg;
+    int len;
+    View *view;
+    while ((view = (View *)ring_peek(&p->packets, &len)) != NULL)
+    {
+        const unsigned char *packet = view->data;
+        // The writer gives DATA and C_PACK payloads back, the rest is done with here
+        const unsigned char *release = view->release;
+        if (packet[0] == C_START)
+        {
+            ControlInfo info;
+            parse_control_packet(packet, len, &info);
+            printf("[APP] START: %s (%ld bytes)\n", info.name, info.fileSize);
+            g_metrics->transferTotal = info.fileSize;
+            if (p->fd < 0 && rx_open_output(p, &info) < 0)
+            {
+                p->failed = TRUE;
+                break;
+            }
+        }
+        else if (packet[0] == C_SESSION)
+        {
+            ControlInfo info;
+            parse_control_packet(packet, len, &info);
+            printf("[APP] SESSION: %s (%ld files, %ld bytes)\n", info.name, info.fileCount, info.fileSize);
+            p->fileSize = info.fileSize;
+            g_metrics->transferTotal = info.fileSize;
+            if (batch_writer_open(&p->batchWriter, p->filename) < 0)
+            {
+                p->failed = TRUE;
+                break;
+            }
+            hash64_init(&p->hash);
+            p->batch = TRUE;
+        }
+        else if (packet[0] == C_PACK && p->batch)
+        {
+            // Hand every record to the writer as is, the last view releases the packet
+            int k = 1;
+            while (k + RECORD_HEADER_SIZE <= len)
+            {
+                int recordLen = RECORD_HEADER_SIZE + ((packet[k + 1] << 8) | packet[k + 2]);
+                if (k + recordLen > len)
+                    break;
+                if (rx_queue_chunk(p, &packet[k], recordLen, NULL) < 0)
+                {
+                    ring_abort(&p->packets);
+                    return NULL;
+                }
+                k += recordLen;
+            }
+            if (rx_queue_chunk(p, NULL, 0, packet) < 0)
+            {
+                ring_abort(&p->packets);
+                return NULL;
+            }
+            release = NULL;
+        }
+        else if (packet[0] == C_DATA && len >= DATA_HEADER_SIZE && p->fd >= 0)
+        {
+            int dataLen = (packet[1] << 8) | packet[2];
+            if (dataLen > len - DATA_HEADER_SIZE)
+                dataLen = len - DATA_HEADER_SIZE;
+            if (rx_queue_chunk(p, &packet[DATA_HEADER_SIZE], dataLen, packet) < 0)
+            {
+                ring_abort(&p->packets);
+                return NULL;
+            }
+            release = NULL;
+        }
+        else if (packet[0] == C_END)
+        {
+            ControlInfo info;
+            if (parse_control_packet(packet, len, &info) == 0)
+            {
+                p->mtime = info.mtime;
+                p->fileHash = info.fileHash;
+                p->hasFileHash = info.hasFileHash;
+            }
+            g_link->release(packet);
+            ring_release(&p->packets);
+            ring_close(&p->chunks);
+            return NULL;
+        }
+        g_link->release(release);
+        ring_release(&p->packets);
+    }
+    ring_abort(&p->packets);
+    ring_abort(&p->chunks);
+    return NULL;
+}
+
+// Write all of iov, n entries, which is modified on a partial write.
+// Return 0 or -1 on error.
+static int write_all(int fd, struct iovec *iov, int n)
+{
+    while (n > 0)
+    {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (; n > 0 && (size_t)w >= iov->iov_len; iov++, n--)
+            w -= iov->iov_len;
+        if (n > 0)
+        {
+            iov->iov_base = (unsigned char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+// Start writeback of every full SYNC_WINDOW written and wait for the one
+// before it.
+static void rx_sync(RxPipeline *p)
+{
+    while (p->journal.offset - p->synced >= SYNC_WINDOW)
+    {
+        sync_file_range(p->fd, p->synced, SYNC_WINDOW, SYNC_FILE_RANGE_WRITE);
+        if (p->synced >= SYNC_WINDOW)
+            sync_file_range(p->fd, p->synced - SYNC_WINDOW, SYNC_WINDOW,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        p->synced += SYNC_WINDOW;
+    }
+}
+
+// Save the journal once the data it describes is on disk: a resume that
+// finds it trusts the prefix without reading it back.
+static void rx_save_journal(RxPipeline *p)
+{
+    if (fdatasync(p->fd) < 0)
+    {
+        perror("[APP] fdatasync");
+        return;
+    }
+    journal_save(p->filename, &p->journal);
+}
+
+// Write the file data of n queued views with one writev().
+// Return the number of DATA chunks written or -1 on error.
+static int rx_write_views(RxPipeline *p, unsigned char **slots, const int *lens, int n)
+{
+    struct iovec iov[RING_SLOTS];
+    int k = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        const View *view = (const View *)slots[i];
+        if (view->data != NULL && lens[i] > 0)
+        {
+            iov[k].iov_base = (void *)view->data;
+            iov[k++].iov_len = lens[i];
+        }
+    }
+    if (write_all(p->fd, iov, k) < 0)
+        return -1;
+    for (int i = 0; i < n; ++i)
+    {
+        const View *view = (const View *)slots[i];
+        if (view->data == NULL)
+            continue;
+        hash64_update(&p->hash, view->data, lens[i]);
+        p->written += lens[i];
+        p->journal.offset += lens[i];
+    }
+    p->journal.hash = p->hash;
+    g_metrics->transferDone = p->journal.offset;
+    rx_sync(p);
+    return k;
+}
+
+// Apply the records of n queued views of a session, writing the data of
+// each file with one writev().
+// Return 0 or -1 on a bad record or a write error.
+static int rx_write_records(RxPipeline *p, unsigned char **slots, const int *lens, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        const unsigned char *record = ((const View *)slots[i])->data;
+        if (record == NULL)
+            continue;
+        if (batch_writer_record(&p->batchWriter, record, lens[i]) < 0)
+            return -1;
+        if (record[0] == R_DATA)
+        {
+            hash64_update(&p->hash, &record[RECORD_HEADER_SIZE], lens[i] - RECORD_HEADER_SIZE);
+            g_metrics->transferDone += lens[i] - RECORD_HEADER_SIZE;
+        }
+        p->written += lens[i] - RECORD_HEADER_SIZE;
+    }
+    return batch_writer_flush(&p->batchWriter);
+}
+
+// Compare what was written with the hash END carried, if any. The data was
+// hashed as it was written, so neither file is read again.
+// Return 0 if it matches or -1.
+static int rx_check_hash(RxPipeline *p)
+{
+    if (!p->hasFileHash)
+        return 0;
+    uint64_t hash = hash64_final(&p->hash);
+    if (hash != p->fileHash)
+    {
+        fprintf(stderr, "[APP] Hash mismatch: received %016llx, sent %016llx\n",
+                (unsigned long long)hash, (unsigned long long)p->fileHash);
+        return -1;
+    }
+    printf("[APP] Hash %016llx verified\n", (unsigned long long)hash);
+    return 0;
+}
+
+// Give the output its final size and the transmitter's mtime, and flush
+// what the incremental writeback has not yet.
+static int rx_finish(RxPipeline *p)
+{
+    if (rx_check_hash(p) < 0)
+    {
+        // Resuming would build on the damaged bytes
+        journal_remove(p->filename);
+        return -1;
+    }
+    if (ftruncate(p->fd, p->journal.offset) < 0 || fdatasync(p->fd) < 0)
+    {
+        perror("[APP] finish");
+        return -1;
+    }
+    struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = p->mtime}};
+    if (p->mtime > 0 && futimens(p->fd, times) < 0)
+        perror("[APP] futimens");
+    return 0;
+}
+
+// Writes everything queued at once, so the disk sees large writes and
+// never holds up the link receiver, which sends the RRs.
+static void *rx_writer(void *arg)
+{
+    RxPipeline *p = arg;
+    unsigned char *slots[RING_SLOTS];
+    int lens[RING_SLOTS];
+    int sinceJournal = 0;
+    int n;
+    while ((n = ring_peek_batch(&p->chunks, slots, lens, RING_SLOTS)) > 0)
+    {
+        if (p->batch && rx_write_records(p, slots, lens, n) < 0)
+        {
+            fprintf(stderr, "[APP] Bad record in session\n");
+            p->failed = TRUE;
+            ring_abort(&p->chunks);
+            break;
+        }
+        if (!p->batch)
+        {
+            int written = rx_write_views(p, slots, lens, n);
+            if (written < 0)
+            {
+                perror("[APP] write");
+                p->failed = TRUE;
+                ring_abort(&p->chunks);
+                break;
+            }
+            sinceJournal += written;
+            if (sinceJournal >= JOURNAL_INTERVAL)
+            {
+                rx_save_journal(p);
+                sinceJournal = 0;
+            }
+        }
+        for (int i = 0; i < n; ++i)
+            g_link->release(((const View *)slots[i])->release);
+        ring_release_batch(&p->chunks, n);
+    }
+    if (p->batch)
+    {
+        if (batch_writer_close(&p->batchWriter) < 0)
+            p->failed = TRUE;
+        else if (!ring_is_aborted(&p->chunks) && rx_check_hash(p) < 0)
+            p->failed = TRUE;
+    }
+    else if (ring_is_aborted(&p->chunks))
+    {
+        p->failed = TRUE;
+        if (p->journal.offset > 0)
+            rx_save_journal(p);
+    }
+    else if (p->fd >= 0 && rx_finish(p) < 0)
+        p->failed = TRUE;
+    else
+        journal_remove(p->filename);
+    return NULL;
+}
+
+// Print a message of CH_MESSAGE as soon as it arrives
+static void rx_print_message(int id, const unsigned char *msg, int len, void *user)
+{
+    (void)id;
+    (void)user;
+    printf("[APP] Message: %.*s\n", len, (const char *)msg);
+    fflush(stdout);
+}
+
+static int receive_file(const char *filename, int nTries)
+{
+    RxPipeline p;
+    memset(&p, 0, sizeof(p));
+    p.filename = filename;
+    p.fd = -1;
+    if (ring_init(&p.packets, RING_SLOTS, sizeof(View)) < 0 ||
+        ring_init(&p.chunks, RING_SLOTS, sizeof(View)) < 0)
+    {
+        fprintf(stderr, "[APP] Out of memory\n");
+        return -1;
+    }
+
+    ch_sethandler(CH_MESSAGE, rx_print_message, NULL);
+    pthread_t depacketizer, writer;
+    pthread_create(&depacketizer, NULL, rx_depacketizer, &p);
+    pthread_create(&writer, NULL, rx_writer, &p);
+
+    // Link receiver stage runs on the calling thread
+    int ret = -1;
+    int idle = 0;
+    while (idle <= nTries)
+    {
+        View *view = (View *)ring_acquire(&p.packets);
+        if (view == NULL)
+            break;
+        int n = g_link->readview(&view->data);
+        if (n < 0)
+            break;
+        if (n == 0)
+        {
+            printf("[APP] Timeout waiting for data\n");
+            idle++;
+            continue;
+        }
+        idle = 0;
+        if (view->data[0] == C_CHANNEL)
+        {
+            ch_deliver(view->data, n);
+            g_link->release(view->data);
+            continue;
+        }
+        view->release = view->data;
+        int last = view->data[0] == C_END;
+        ring_commit(&p.packets, n);
+        if (last)
+        {
+            ret = 0;
+            break;
+        }
+    }
+    if (ret < 0)
+        ring_abort(&p.packets);
+    else
+        ring_close(&p.packets);
+
+    pthread_join(depacketizer, NULL);
+    pthread_join(writer, NULL);
+    ring_destroy(&p.packets);
+    ring_destroy(&p.chunks);
+    if (p.fd >= 0)
+        close(p.fd);
+    if (ret == 0 && p.failed)
+        ret = -1;
+    if (p.batch)
+        printf("[APP] Received %ld files (%ld of %ld bytes) into %s\n",
+               p.batchWriter.files, p.batchWriter.bytes, p.fileSize, filename);
+    else
+        printf("[APP] Wrote %ld bytes, %ld of %ld bytes in %s\n", p.written, p.journal.offset, p.fileSize, filename);
+    return ret;
+}
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename)
 {
     LinkLayer ll;
-    strcpy(ll.serialPort, serialPort);
+    memset(&ll, 0, sizeof(ll));
+    strncpy(ll.serialPort, serialPort, sizeof(ll.serialPort) - 1);
     ll.role = (strcmp(role, "tx") == 0) ? LlTx : LlRx;
     ll.baudRate = baudRate;
     ll.nRetransmissions = nTries;
@@ -18,33 +911,40 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     printf("[APP] Starting on port %s as %s...\n", serialPort,
            (ll.role == LlTx ? "Transmitter" : "Receiver"));
 
-    if (llopen(ll) != 0) {
+    // Larger packets where the baud rate allows and the peer agrees
+    llsetmaxpayload(LL_JUMBO_PAYLOAD_SIZE);
+
+    // Several ports separated by commas are bonded into one transfer
+    g_link = strchr(serialPort, ',') != NULL ? &g_bonded : &g_single;
+    if (g_link == &g_bonded && bond_open(serialPort, ll) != 0) {
+        fprintf(stderr, "[APP] bond_open failed.\n");
+        return;
+    }
+    if (g_link == &g_single && llopen(ll) != 0) {
         fprintf(stderr, "[APP] llopen failed.\n");
         return;
     }
 
-    if (ll.role == LlTx) {
-        const unsigned char msg[] = "hello link layer";
-        int len = sizeof(msg);
-        printf("[APP] Sending test message (%d bytes)...\n", len);
-        if (llwrite(msg, len) > 0)
-            printf("[APP] Message sent successfully.\n");
-        else
-            fprintf(stderr, "[APP] Error sending message.\n");
-    } else {
-        unsigned char buffer[256];
-        int n = llread(buffer);
-        if (n > 0) {
-            printf("[APP] Received %d bytes: ", n);
-            for (int i = 0; i < n; i++)
-                putchar(buffer[i]);
-            printf("\n");
-        } else {
-            fprintf(stderr, "[APP] Error or timeout in llread.\n");
-        }
-    }
-
-    llclose();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret;
+    if (ll.role == LlRx)
+        ret = receive_file(filename, nTries);
+    else if (batch_is_source(filename))
+        ret = transmit_batch(filename);
+    else
+        ret = transmit_file(filename);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (ret == 0)
+        printf("[APP] Transfer complete in %.2f s.\n", elapsed);
+    else
+        fprintf(stderr, "[APP] Transfer failed after %.2f s.\n", elapsed);
+
+    if (g_link == &g_bonded)
+        bond_close();
+    else
+        llclose();
     printf("[APP] Connection closed.\n");
 }
-
@@ -0,0 +1,446 @@
+// Multi-file session
+
+#define _GNU_SOURCE // fallocate(), sync_file_range()
+
+#include "batch.h"
+#include "app_packet.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NAME_MAX_LEN 255
+
+// Bytes of a file handed to writeback at a time, as for a single file
+#define SYNC_WINDOW (1 << 20)
+
+static void put_u64(unsigned char *p, uint64_t value)
+{
+    for (int k = 0; k < 8; ++k)
+        p[k] = (unsigned char)(value >> (8 * (7 - k)));
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    uint64_t value = 0;
+    for (int k = 0; k < 8; ++k)
+        value = (value << 8) | p[k];
+    return value;
+}
+
+static int batch_add(BatchSource *batch, const char *path, const char *name, const struct stat *st)
+{
+    if (strlen(name) > NAME_MAX_LEN)
+    {
+        fprintf(stderr, "[APP] Name too long, skipped: %s\n", name);
+        return 0;
+    }
+    if (batch->nFiles == batch->capacity)
+    {
+        int capacity = batch->capacity ? batch->capacity * 2 : 64;
+        BatchFile *files = realloc(batch->files, capacity * sizeof(BatchFile));
+        if (files == NULL)
+            return -1;
+        batch->files = files;
+        batch->capacity = capacity;
+    }
+    BatchFile *file = &batch->files[batch->nFiles];
+    file->path = strdup(path);
+    file->name = strdup(name);
+    if (file->path == NULL || file->name == NULL)
+        return -1;
+    file->size = st->st_size;
+    file->mtime = st->st_mtime;
+    batch->nFiles++;
+    batch->totalSize += st->st_size;
+    return 0;
+}
+
+// Add every regular file below dir, named relative to the session root.
+static int batch_walk(BatchSource *batch, const char *dir, const char *prefix)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        perror(dir);
+        return -1;
+    }
+    int ret = 0;
+    struct dirent *entry;
+    while (ret == 0 && (entry = readdir(d)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char path[4096], name[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        snprintf(name, sizeof(name), "%s%s%s", prefix, *prefix ? "/" : "", entry->d_name);
+        struct stat st;
+        if (stat(path, &st) < 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            ret = batch_walk(batch, path, name);
+        else if (S_ISREG(st.st_mode))
+            ret = batch_add(batch, path, name, &st);
+    }
+    closedir(d);
+    return ret;
+}
+
+static int batch_read_manifest(BatchSource *batch, const char *manifest)
+{
+    FILE *f = fopen(manifest, "r");
+    if (f == NULL)
+    {
+        perror(manifest);
+        return -1;
+    }
+    int ret = 0;
+    char line[4096];
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        struct stat st;
+        if (stat(line, &st) < 0 || !S_ISREG(st.st_mode))
+        {
+            fprintf(stderr, "[APP] Not a regular file, skipped: %s\n", line);
+            continue;
+        }
+        const char *name = line;
+        while (*name == '/')
+            name++;
+        ret = batch_add(batch, line, name, &st);
+    }
+    fclose(f);
+    return ret;
+}
+
+int batch_is_source(const char *source)
+{
+    struct stat st;
+    return source[0] == '@' || (stat(source, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+int batch_collect(BatchSource *batch, const char *source)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->source = source;
+    int ret = (source[0] == '@') ? batch_read_manifest(batch, source + 1)
+                                 : batch_walk(batch, source, "");
+    if (ret < 0)
+        batch_free(batch);
+    return ret;
+}
+
+void batch_free(BatchSource *batch)
+{
+    for (int i = 0; i < batch->nFiles; ++i)
+    {
+        free(batch->files[i].path);
+        free(batch->files[i].name);
+    }
+    free(batch->files);
+    batch->files = NULL;
+    batch->nFiles = 0;
+}
+
+void *batch_reader(void *arg)
+{
+    BatchSource *batch = arg;
+    for (int i = 0; i < batch->nFiles; ++i)
+    {
+        const BatchFile *file = &batch->files[i];
+        int fd = open(file->path, O_RDONLY);
+        if (fd < 0)
+        {
+            perror(file->path);
+            continue;
+        }
+
+        unsigned char *record = ring_acquire(&batch->records);
+        if (record == NULL)
+        {
+            close(fd);
+            return NULL;
+        }
+        int nameLen = strlen(file->name);
+        int len = 16 + nameLen;
+        record[0] = R_FILE;
+        record[1] = (unsigned char)(len >> 8);
+        record[2] = (unsigned char)(len & 0xFF);
+        put_u64(&record[RECORD_HEADER_SIZE], file->size);
+        put_u64(&record[RECORD_HEADER_SIZE + 8], file->mtime);
+        memcpy(&record[RECORD_HEADER_SIZE + 16], file->name, nameLen);
+        ring_commit(&batch->records, RECORD_HEADER_SIZE + len);
+
+        while (TRUE)
+        {
+            record = ring_acquire(&batch->records);
+            if (record == NULL)
+            {
+                close(fd);
+                return NULL;
+            }
+            int n = read(fd, &record[RECORD_HEADER_SIZE], RECORD_DATA_MAX(batch->packetSize));
+            if (n < 0)
+            {
+                perror(file->path);
+                close(fd);
+                ring_abort(&batch->records);
+                return NULL;
+            }
+            if (n == 0)
+                break;
+            record[0] = R_DATA;
+            record[1] = (unsigned char)(n >> 8);
+            record[2] = (unsigned char)(n & 0xFF);
+            ring_commit(&batch->records, RECORD_HEADER_SIZE + n);
+        }
+        close(fd);
+    }
+    ring_close(&batch->records);
+    return NULL;
+}
+
+void *batch_packer(void *arg)
+{
+    BatchSource *batch = arg;
+    ControlInfo info;
+    memset(&info, 0, sizeof(info));
+    info.fileSize = batch->totalSize;
+    info.fileCount = batch->nFiles;
+    strncpy(info.name, batch->source, sizeof(info.name) - 1);
+
+    unsigned char *packet = ring_acquire(batch->packets);
+    if (packet == NULL)
+        return NULL;
+    ring_commit(batch->packets, build_control_packet(packet, C_SESSION, &info));
+    hash64_init(&batch->hash);
+
+    // Records are appended to the current packet until it is full; R_DATA
+    // records are split across packets so every I-frame leaves full.
+    packet = NULL;
+    int k = 0;
+    int len;
+    unsigned char *record;
+    while ((record = ring_peek(&batch->records, &len)) != NULL)
+    {
+        int pos = RECORD_HEADER_SIZE;
+        while (pos < len)
+        {
+            if (packet == NULL)
+            {
+                packet = ring_acquire(batch->packets);
+                if (packet == NULL)
+                {
+                    ring_abort(&batch->records);
+                    return NULL;
+                }
+                packet[0] = C_PACK;
+                k = 1;
+            }
+            int space = batch->packetSize - k - RECORD_HEADER_SIZE;
+            int n = len - pos;
+            if (record[0] == R_DATA && n > space)
+                n = space;
+            if (n <= 0 || n > space)
+            {
+                ring_commit(batch->packets, k);
+                packet = NULL;
+                continue;
+            }
+            packet[k++] = record[0];
+            packet[k++] = (unsigned char)(n >> 8);
+            packet[k++] = (unsigned char)(n & 0xFF);
+            memcpy(&packet[k], &record[pos], n);
+            if (record[0] == R_DATA)
+                hash64_update(&batch->hash, &record[pos], n);
+            k += n;
+            pos += n;
+        }
+        ring_release(&batch->records);
+    }
+    if (ring_is_aborted(&batch->records))
+    {
+        ring_abort(batch->packets);
+        return NULL;
+    }
+    if (packet != NULL)
+        ring_commit(batch->packets, k);
+
+    packet = ring_acquire(batch->packets);
+    if (packet == NULL)
+        return NULL;
+    info.fileHash = hash64_final(&batch->hash);
+    info.hasFileHash = TRUE;
+    ring_commit(batch->packets, build_control_packet(packet, C_END, &info));
+    ring_close(batch->packets);
+    return NULL;
+}
+
+// Reject names that would escape the output directory.
+static int batch_safe_name(const char *name)
+{
+    if (name[0] == '\0' || name[0] == '/')
+        return FALSE;
+    const char *p = name;
+    while (TRUE)
+    {
+        if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0'))
+            return FALSE;
+        p = strchr(p, '/');
+        if (p == NULL)
+            return TRUE;
+        p++;
+    }
+}
+
+// Create the missing directories of path.
+static int make_parents(char *path)
+{
+    for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        int ret = mkdir(path, 0755);
+        *p = '/';
+        if (ret < 0 && errno != EEXIST)
+            return -1;
+    }
+    return 0;
+}
+
+int batch_writer_open(BatchWriter *writer, const char *dir)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->dir = dir;
+    writer->fd = -1;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        perror(dir);
+        return -1;
+    }
+    return 0;
+}
+
+int batch_writer_record(BatchWriter *writer, const unsigned char *record, int len)
+{
+    int valueLen = len - RECORD_HEADER_SIZE;
+    const unsigned char *value = &record[RECORD_HEADER_SIZE];
+    if (valueLen < 0)
+        return -1;
+
+    if (record[0] == R_FILE)
+    {
+        if (batch_writer_close(writer) < 0)
+            return -1;
+        if (valueLen < 16 || valueLen - 16 > NAME_MAX_LEN)
+            return -1;
+        char name[NAME_MAX_LEN + 1];
+        memcpy(name, &value[16], valueLen - 16);
+        name[valueLen - 16] = '\0';
+        if (!batch_safe_name(name))
+        {
+            fprintf(stderr, "[APP] Unsafe file name rejected: %s\n", name);
+            return -1;
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", writer->dir, name);
+        if (make_parents(path) < 0)
+        {
+            perror(path);
+            return -1;
+        }
+        writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (writer->fd < 0)
+        {
+            perror(path);
+            return -1;
+        }
+        // Reserve the file's blocks, its size still grows with the data
+        long size = (long)get_u64(value);
+        if (size > 0 && fallocate(writer->fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 && errno != EOPNOTSUPP)
+            perror(path);
+        writer->mtime = (long)get_u64(&value[8]);
+        writer->offset = 0;
+        writer->synced = 0;
+        writer->files++;
+    }
+    else if (record[0] == R_DATA)
+    {
+        if (writer->fd < 0)
+            return -1;
+        if (writer->nIov == BATCH_WRITE_IOV && batch_writer_flush(writer) < 0)
+            return -1;
+        writer->iov[writer->nIov].iov_base = (void *)value;
+        writer->iov[writer->nIov++].iov_len = valueLen;
+        writer->offset += valueLen;
+        writer->bytes += valueLen;
+    }
+    return 0;
+}
+
+// Start writeback of every full SYNC_WINDOW written and wait for the one
+// before it.
+static void batch_writer_sync(BatchWriter *writer)
+{
+    while (writer->offset - writer->synced >= SYNC_WINDOW)
+    {
+        sync_file_range(writer->fd, writer->synced, SYNC_WINDOW, SYNC_FILE_RANGE_WRITE);
+        if (writer->synced >= SYNC_WINDOW)
+            sync_file_range(writer->fd, writer->synced - SYNC_WINDOW, SYNC_WINDOW,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        writer->synced += SYNC_WINDOW;
+    }
+}
+
+int batch_writer_flush(BatchWriter *writer)
+{
+    struct iovec *iov = writer->iov;
+    int n = writer->nIov;
+    writer->nIov = 0;
+    while (n > 0)
+    {
+        ssize_t w = writev(writer->fd, iov, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("[APP] write");
+            return -1;
+        }
+        for (; n > 0 && (size_t)w >= iov->iov_len; iov++, n--)
+            w -= iov->iov_len;
+        if (n > 0)
+        {
+            iov->iov_base = (unsigned char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    batch_writer_sync(writer);
+    return 0;
+}
+
+int batch_writer_close(BatchWriter *writer)
+{
+    if (writer->fd < 0)
+        return 0;
+    int ret = batch_writer_flush(writer);
+    if (ret == 0 && fdatasync(writer->fd) < 0)
+    {
+        perror("[APP] fdatasync");
+        ret = -1;
+    }
+    struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = writer->mtime}};
+    if (ret == 0 && writer->mtime > 0 && futimens(writer->fd, times) < 0)
+        perror("[APP] futimens");
+    close(writer->fd);
+    writer->fd = -1;
+    return ret;
+}
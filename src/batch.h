@@ -0,0 +1,81 @@
+// Multi-file session header.
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <sys/uio.h>
+
+#include "hash.h"
+#include "packet_ring.h"
+
+typedef struct
+{
+    char *path; // Where the transmitter reads it from
+    char *name; // Relative name sent to the receiver
+    long size;
+    long mtime;
+} BatchFile;
+
+// Transmitter side of a session: file reader and record packer stages.
+typedef struct
+{
+    const char *source;
+    BatchFile *files;
+    int nFiles;
+    int capacity;
+    long totalSize;
+    int packetSize;      // Largest C_PACK packet
+    Hash64 hash;         // Of every R_DATA packed, sent in END
+    PacketRing records;  // reader -> packer, one R_FILE / R_DATA record per slot
+    PacketRing *packets; // packer -> link sender
+} BatchSource;
+
+// R_DATA records of the current file written by one writev()
+#define BATCH_WRITE_IOV 16
+
+// Receiver side of a session: writes records below an output directory.
+typedef struct
+{
+    const char *dir;
+    int fd;      // Current file
+    long mtime;  // Of the current file, applied when it is closed
+    long offset; // Bytes of the current file written or queued
+    long synced; // Bytes of the current file handed to writeback
+    struct iovec iov[BATCH_WRITE_IOV]; // R_DATA values not yet written
+    int nIov;
+    long files;
+    long bytes;
+} BatchWriter;
+
+// Return TRUE if source names a session: a directory or "@manifest", a
+// text file listing one path per line.
+int batch_is_source(const char *source);
+
+// List the files of source. Return 0 on success or -1 on error.
+int batch_collect(BatchSource *batch, const char *source);
+
+// Release the file list.
+void batch_free(BatchSource *batch);
+
+// Reader stage: emits an R_FILE record and the R_DATA records of every file.
+void *batch_reader(void *arg);
+
+// Packer stage: emits SESSION, C_PACK packets filled with records, and END.
+void *batch_packer(void *arg);
+
+// Create the output directory. Return 0 on success or -1 on error.
+int batch_writer_open(BatchWriter *writer, const char *dir);
+
+// Apply one record. R_DATA values are only queued, so record must stay
+// valid until the next batch_writer_flush() or batch_writer_close().
+// Return 0 on success or -1 on error.
+int batch_writer_record(BatchWriter *writer, const unsigned char *record, int len);
+
+// Write the queued R_DATA values. Return 0 on success or -1 on error.
+int batch_writer_flush(BatchWriter *writer);
+
+// Write what is queued, sync the current file to disk, give it the
+// transmitter's mtime and close it. Return 0 on success or -1 on error.
+int batch_writer_close(BatchWriter *writer);
+
+#endif // _BATCH_H_
@@ -0,0 +1,637 @@
+// Multilink bonding implementation
+
+#define _POSIX_C_SOURCE 200809L // POSIX compliant source
+
+#include "bond.h"
+#include "app_packet.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Messages a member sends besides received packets, which start with C_BOND
+#define BOND_UP 0x80     // Link open: largest payload (4 bytes)
+#define BOND_SENT 0x81   // Packet acknowledged: sequence number (4 bytes)
+#define BOND_FAILED 0x82 // Packet dropped, the member is quitting
+#define BOND_MSG_SIZE 5
+
+// Packets a member link is handed at once, all fit its transmit queue
+#define LINK_CREDIT LL_TXQ_SLOTS
+
+// Busy time over which a goodput sample is taken. Acknowledgements come
+// in bursts, so shorter samples would mostly measure the bursts.
+#define RATE_PERIOD 0.5
+
+typedef struct
+{
+    char port[50];
+    pid_t pid;
+    int sock;    // To the member process, -1 once the link is gone
+    int payload; // Its llmaxpayload()
+    int inFlight; // Packets handed to it and not acknowledged
+    long queued;  // Bytes of those packets
+    double rate;  // Goodput in bytes/s, smoothed
+    double busy;  // Seconds with packets in flight since the last sample
+    long sampleBytes;           // Acknowledged since the last sample
+    struct timespec busySince;  // Last time busy was brought up to date
+    long packets; // Acknowledged
+    long bytes;
+} BondLink;
+
+// A packet written and not yet acknowledged in order
+typedef struct
+{
+    unsigned char *data; // BOND_HEADER_SIZE + packet
+    int len;
+    int link; // Member it was handed to, or -1 while it waits for one
+    int acked;
+} BondSlot;
+
+// A packet received ahead of its turn
+typedef struct
+{
+    uint32_t seq;
+    unsigned char *data;
+    int len;
+} BondHeld;
+
+static struct
+{
+    LinkLayer ll;
+    BondLink links[BOND_MAX_LINKS];
+    int nLinks;
+    int maxPayload;
+
+    // Transmitter
+    BondSlot window[BOND_WINDOW]; // Indexed by sequence number
+    uint32_t nextSeq; // Of the next packet written
+    uint32_t oldest;  // Oldest packet not acknowledged
+    LlEventCallback callback;
+    void *user;
+
+    // Receiver
+    uint32_t expected; // Next sequence number to deliver
+    BondHeld *held;
+    int nHeld;
+    int heldMax;
+} g_bond;
+
+////////////////////////////////////////////////
+// MEMBER PROCESS
+////////////////////////////////////////////////
+typedef struct
+{
+    int sock;
+    int failed;
+} Member;
+
+static void member_event(const LlEvent *event, void *user)
+{
+    Member *m = user;
+    if (event->type == LlReceived)
+    {
+        if (event->len > 0)
+            send(m->sock, event->data, event->len, MSG_NOSIGNAL);
+        return;
+    }
+    unsigned char msg[BOND_MSG_SIZE];
+    msg[0] = (event->type == LlSent) ? BOND_SENT : BOND_FAILED;
+    memcpy(&msg[1], &event->data[1], 4);
+    send(m->sock, msg, sizeof(msg), MSG_NOSIGNAL);
+    if (event->type == LlFailed)
+        m->failed = TRUE;
+}
+
+// Body of a member process: open the link on ll.serialPort, then pass
+// packets between it and the bond until the bond hangs up or the link fails.
+static int member_run(int sock, LinkLayer ll)
+{
+    if (llopen(ll) != 0)
+        return 1;
+    unsigned char hello[BOND_MSG_SIZE] = {BOND_UP};
+    uint32_t payload = (uint32_t)llmaxpayload();
+    for (int i = 0; i < 4; ++i)
+        hello[1 + i] = (unsigned char)(payload >> (24 - 8 * i));
+    send(sock, hello, sizeof(hello), MSG_NOSIGNAL);
+
+    unsigned char *buf = malloc(payload);
+    Member m = {.sock = sock, .failed = FALSE};
+    llsetcallback(member_event, &m);
+    struct pollfd fds[2] = {{.fd = sock}, {.fd = llfd(), .events = POLLIN}};
+    while (buf != NULL && !m.failed)
+    {
+        // The bond never hands more than LINK_CREDIT, this only guards the queue
+        fds[0].events = (llpending() < LL_TXQ_SLOTS) ? POLLIN : 0;
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            int n = recv(sock, buf, payload, 0);
+            if (n <= 0)
+                break; // Bond finished with this link
+            if (llsubmit(buf, n) < 0)
+                break;
+        }
+        if (llprocess() < 0)
+            break;
+    }
+    llsetcallback(NULL, NULL);
+    free(buf);
+    llclose();
+    return m.failed ? 1 : 0;
+}
+
+////////////////////////////////////////////////
+// BOND_OPEN / BOND_CLOSE
+////////////////////////////////////////////////
+static double seconds_between(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static int start_member(BondLink *link, LinkLayer ll)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) < 0)
+    {
+        perror("[APP] socketpair");
+        return -1;
+    }
+    // The member must not print what the bond has not yet
+    fflush(stdout);
+    fflush(stderr);
+    link->pid = fork();
+    if (link->pid < 0)
+    {
+        perror("[APP] fork");
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if (link->pid == 0)
+    {
+        close(pair[0]);
+        for (int i = 0; i < g_bond.nLinks; ++i)
+            if (g_bond.links[i].sock >= 0)
+                close(g_bond.links[i].sock);
+        strncpy(ll.serialPort, link->port, sizeof(ll.serialPort) - 1);
+        exit(member_run(pair[1], ll));
+    }
+    close(pair[1]);
+    link->sock = pair[0];
+    return 0;
+}
+
+// Stop using a link. Its packets not yet acknowledged wait for another.
+static void bond_drop_link(int i)
+{
+    BondLink *link = &g_bond.links[i];
+    if (link->sock < 0)
+        return;
+    close(link->sock);
+    link->sock = -1;
+    int moved = 0;
+    for (uint32_t seq = g_bond.oldest; seq != g_bond.nextSeq; ++seq)
+    {
+        BondSlot *slot = &g_bond.window[seq % BOND_WINDOW];
+        if (slot->link == i && !slot->acked)
+        {
+            slot->link = -1;
+            moved++;
+        }
+    }
+    link->inFlight = 0;
+    link->queued = 0;
+    if (g_bond.ll.role == LlTx)
+        printf("[APP] Bond: link %s lost, %d packets moved to the other links\n", link->port, moved);
+    else
+        printf("[APP] Bond: link %s lost\n", link->port);
+}
+
+static int bond_links_up(void)
+{
+    int up = 0;
+    for (int i = 0; i < g_bond.nLinks; ++i)
+        if (g_bond.links[i].sock >= 0)
+            up++;
+    return up;
+}
+
+int bond_open(const char *ports, LinkLayer ll)
+{
+    memset(&g_bond, 0, sizeof(g_bond));
+    g_bond.ll = ll;
+
+    // One member per port
+    const char *p = ports;
+    while (*p != '\0')
+    {
+        int len = (int)strcspn(p, ",");
+        if (len > 0)
+        {
+            if (g_bond.nLinks == BOND_MAX_LINKS || len >= (int)sizeof(g_bond.links[0].port))
+            {
+                fprintf(stderr, "[APP] Bond: at most %d ports of up to %d characters\n",
+                        BOND_MAX_LINKS, (int)sizeof(g_bond.links[0].port) - 1);
+                bond_close();
+                return -1;
+            }
+            BondLink *link = &g_bond.links[g_bond.nLinks];
+            memcpy(link->port, p, len);
+            link->port[len] = '\0';
+            link->sock = -1;
+            link->rate = ll.baudRate / 10.0;
+            if (start_member(link, ll) < 0)
+            {
+                bond_close();
+                return -1;
+            }
+            g_bond.nLinks++;
+        }
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+
+    // Each member reports once its llopen() is over
+    g_bond.maxPayload = LL_JUMBO_PAYLOAD_SIZE;
+    for (int i = 0; i < g_bond.nLinks; ++i)
+    {
+        BondLink *link = &g_bond.links[i];
+        unsigned char hello[BOND_MSG_SIZE];
+        int n;
+        do
+            n = recv(link->sock, hello, sizeof(hello), 0);
+        while (n < 0 && errno == EINTR);
+        if (n != BOND_MSG_SIZE || hello[0] != BOND_UP)
+        {
+            fprintf(stderr, "[APP] Bond: link %s did not open\n", link->port);
+            bond_drop_link(i);
+            continue;
+        }
+        link->payload = (hello[1] << 24) | (hello[2] << 16) | (hello[3] << 8) | hello[4];
+        if (link->payload < g_bond.maxPayload)
+            g_bond.maxPayload = link->payload;
+    }
+    int up = bond_links_up();
+    if (up == 0)
+    {
+        bond_close();
+        return -1;
+    }
+    g_bond.maxPayload -= BOND_HEADER_SIZE;
+    printf("[APP] Bond: %d of %d links up, packets of up to %d bytes\n", up, g_bond.nLinks, g_bond.maxPayload);
+    return 0;
+}
+
+int bond_close(void)
+{
+    for (int i = 0; i < g_bond.nLinks; ++i)
+    {
+        BondLink *link = &g_bond.links[i];
+        if (link->sock >= 0)
+            close(link->sock);
+        link->sock = -1;
+    }
+    int ret = 0;
+    for (int i = 0; i < g_bond.nLinks; ++i)
+    {
+        BondLink *link = &g_bond.links[i];
+        int status;
+        if (link->pid > 0 && waitpid(link->pid, &status, 0) < 0)
+            ret = -1;
+        if (g_bond.ll.role == LlTx && link->packets > 0)
+            printf("[APP] Bond: %s carried %ld packets, %ld bytes (%.0f B/s)\n",
+                   link->port, link->packets, link->bytes, link->rate);
+    }
+    for (uint32_t seq = g_bond.oldest; seq != g_bond.nextSeq; ++seq)
+        free(g_bond.window[seq % BOND_WINDOW].data);
+    for (int i = 0; i < g_bond.nHeld; ++i)
+        free(g_bond.held[i].data);
+    free(g_bond.held);
+    memset(&g_bond, 0, sizeof(g_bond));
+    return ret;
+}
+
+int bond_maxpayload(void)
+{
+    return g_bond.maxPayload;
+}
+
+////////////////////////////////////////////////
+// TRANSMITTER
+////////////////////////////////////////////////
+// Hand the packets waiting for a link to the one that would finish each
+// first at its goodput.
+static void bond_dispatch(void)
+{
+    for (uint32_t seq = g_bond.oldest; seq != g_bond.nextSeq; ++seq)
+    {
+        BondSlot *slot = &g_bond.window[seq % BOND_WINDOW];
+        if (slot->link >= 0 || slot->acked)
+            continue;
+        int best = -1;
+        double bestTime = 0;
+        for (int i = 0; i < g_bond.nLinks; ++i)
+        {
+            BondLink *link = &g_bond.links[i];
+            if (link->sock < 0 || link->inFlight == LINK_CREDIT)
+                continue;
+            double t = (link->queued + slot->len) / link->rate;
+            if (best < 0 || t < bestTime)
+            {
+                best = i;
+                bestTime = t;
+            }
+        }
+        if (best < 0)
+            return;
+        BondLink *link = &g_bond.links[best];
+        if (send(link->sock, slot->data, slot->len, MSG_NOSIGNAL) != slot->len)
+        {
+            bond_drop_link(best);
+            seq = g_bond.oldest - 1; // Start over without it
+            continue;
+        }
+        slot->link = best;
+        if (link->inFlight == 0)
+            clock_gettime(CLOCK_MONOTONIC, &link->busySince);
+        link->inFlight++;
+        link->queued += slot->len;
+    }
+}
+
+static void bond_on_sent(int i, uint32_t seq)
+{
+    BondLink *link = &g_bond.links[i];
+    if (seq - g_bond.oldest >= (uint32_t)(g_bond.nextSeq - g_bond.oldest))
+        return;
+    BondSlot *slot = &g_bond.window[seq % BOND_WINDOW];
+    if (slot->acked || slot->link != i)
+        return;
+    slot->acked = TRUE;
+    link->inFlight--;
+    link->queued -= slot->len;
+
+    // Goodput while the link had work, idle time does not count
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    link->busy += seconds_between(&link->busySince, &now);
+    link->busySince = now;
+    link->sampleBytes += slot->len;
+    if (link->busy >= RATE_PERIOD)
+    {
+        link->rate += (link->sampleBytes / link->busy - link->rate) / 4;
+        link->busy = 0;
+        link->sampleBytes = 0;
+    }
+    link->packets++;
+    link->bytes += slot->len - BOND_HEADER_SIZE;
+
+    // Report in write order
+    while (g_bond.oldest != g_bond.nextSeq && g_bond.window[g_bond.oldest % BOND_WINDOW].acked)
+    {
+        BondSlot *done = &g_bond.window[g_bond.oldest % BOND_WINDOW];
+        if (g_bond.callback != NULL)
+        {
+            LlEvent ev = {.type = LlSent,
+                          .id = (int)g_bond.oldest,
+                          .data = done->data + BOND_HEADER_SIZE,
+                          .len = done->len - BOND_HEADER_SIZE};
+            g_bond.callback(&ev, g_bond.user);
+        }
+        free(done->data);
+        done->data = NULL;
+        g_bond.oldest++;
+    }
+}
+
+// Wait for the members and handle what they report.
+// Return 0, or -1 once no link is left.
+static int bond_wait(void)
+{
+    if (bond_links_up() == 0)
+        return -1;
+    struct pollfd fds[BOND_MAX_LINKS];
+    for (int i = 0; i < g_bond.nLinks; ++i)
+    {
+        fds[i].fd = g_bond.links[i].sock;
+        fds[i].events = POLLIN;
+    }
+    if (poll(fds, g_bond.nLinks, -1) < 0 && errno != EINTR)
+    {
+        perror("[APP] poll");
+        return -1;
+    }
+    for (int i = 0; i < g_bond.nLinks; ++i)
+    {
+        if (g_bond.links[i].sock < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        unsigned char msg[BOND_MSG_SIZE];
+        int n = recv(g_bond.links[i].sock, msg, sizeof(msg), MSG_DONTWAIT);
+        if (n < 0 && errno == EAGAIN)
+            continue;
+        if (n != BOND_MSG_SIZE || msg[0] == BOND_FAILED)
+        {
+            bond_drop_link(i);
+            continue;
+        }
+        uint32_t seq = ((uint32_t)msg[1] << 24) | (msg[2] << 16) | (msg[3] << 8) | msg[4];
+        if (msg[0] == BOND_SENT)
+            bond_on_sent(i, seq);
+    }
+    if (bond_links_up() == 0)
+    {
+        fprintf(stderr, "[APP] Bond: every link failed\n");
+        return -1;
+    }
+    bond_dispatch();
+    return 0;
+}
+
+int bond_write(const unsigned char *buf, int bufSize)
+{
+    if (bufSize < 0 || bufSize > g_bond.maxPayload)
+        return -1;
+    while (g_bond.nextSeq - g_bond.oldest == BOND_WINDOW)
+    {
+        if (bond_wait() < 0)
+            return -1;
+    }
+    if (bond_links_up() == 0)
+        return -1;
+
+    BondSlot *slot = &g_bond.window[g_bond.nextSeq % BOND_WINDOW];
+    slot->data = malloc(BOND_HEADER_SIZE + bufSize);
+    if (slot->data == NULL)
+        return -1;
+    uint32_t seq = g_bond.nextSeq++;
+    slot->data[0] = C_BOND;
+    for (int i = 0; i < 4; ++i)
+        slot->data[1 + i] = (unsigned char)(seq >> (24 - 8 * i));
+    memcpy(&slot->data[BOND_HEADER_SIZE], buf, bufSize);
+    slot->len = BOND_HEADER_SIZE + bufSize;
+    slot->link = -1;
+    slot->acked = FALSE;
+    bond_dispatch();
+    return bufSize;
+}
+
+void bond_setcallback(LlEventCallback callback, void *user)
+{
+    g_bond.callback = callback;
+    g_bond.user = user;
+}
+
+int bond_flush(void)
+{
+    while (g_bond.oldest != g_bond.nextSeq)
+    {
+        if (bond_wait() < 0)
+            return -1;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////
+// RECEIVER
+////////////////////////////////////////////////
+// Keep a packet received from a member until its turn, or drop it if it
+// is a copy of one already held or delivered.
+// Return 0, or -1 if there is no memory to hold it.
+static int bond_hold(unsigned char *data, int len)
+{
+    if (len < BOND_HEADER_SIZE || data[0] != C_BOND)
+    {
+        free(data);
+        return 0;
+    }
+    uint32_t seq = ((uint32_t)data[1] << 24) | (data[2] << 16) | (data[3] << 8) | data[4];
+    // Delivered already: resent on another link after its own failed
+    if ((int32_t)(seq - g_bond.expected) < 0)
+    {
+        free(data);
+        return 0;
+    }
+    for (int i = 0; i < g_bond.nHeld; ++i)
+    {
+        if (g_bond.held[i].seq == seq)
+        {
+            free(data);
+            return 0;
+        }
+    }
+    if (g_bond.nHeld == g_bond.heldMax)
+    {
+        int max = g_bond.heldMax ? 2 * g_bond.heldMax : BOND_WINDOW;
+        BondHeld *held = realloc(g_bond.held, max * sizeof(*held));
+        if (held == NULL)
+        {
+            // Packet seq would never be delivered
+            fprintf(stderr, "[APP] Bond: out of memory holding packet %u\n", seq);
+            free(data);
+            return -1;
+        }
+        g_bond.held = held;
+        g_bond.heldMax = max;
+    }
+    g_bond.held[g_bond.nHeld++] = (BondHeld){.seq = seq, .data = data, .len = len};
+    return 0;
+}
+
+// Receive everything the members have for us, waiting up to timeout_ms
+// for the first message. Return the number of messages, or -1 when no
+// link is left or a packet could not be kept.
+static int bond_receive(int timeout_ms)
+{
+    struct pollfd fds[BOND_MAX_LINKS];
+    for (int i = 0; i < g_bond.nLinks; ++i)
+    {
+        fds[i].fd = g_bond.links[i].sock;
+        fds[i].events = POLLIN;
+    }
+    int ready = poll(fds, g_bond.nLinks, timeout_ms);
+    if (ready < 0)
+        return errno == EINTR ? 0 : -1;
+    int got = 0;
+    for (int i = 0; i < g_bond.nLinks; ++i)
+    {
+        if (g_bond.links[i].sock < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        // Drain this member so a later packet never waits behind it
+        while (TRUE)
+        {
+            int size = g_bond.links[i].payload;
+            unsigned char *data = malloc(size);
+            if (data == NULL)
+            {
+                fprintf(stderr, "[APP] Bond: out of memory\n");
+                return -1;
+            }
+            int n = recv(g_bond.links[i].sock, data, size, MSG_DONTWAIT);
+            if (n < 0 && errno == EAGAIN)
+            {
+                free(data);
+                break;
+            }
+            if (n <= 0)
+            {
+                free(data);
+                bond_drop_link(i);
+                break;
+            }
+            if (bond_hold(data, n) < 0)
+                return -1;
+            got++;
+        }
+    }
+    if (bond_links_up() == 0)
+    {
+        fprintf(stderr, "[APP] Bond: every link is gone\n");
+        return -1;
+    }
+    return got;
+}
+
+int bond_readview(const unsigned char **data)
+{
+    *data = NULL;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int timeoutMs = g_bond.ll.timeout * 1000;
+    while (TRUE)
+    {
+        for (int i = 0; i < g_bond.nHeld; ++i)
+        {
+            BondHeld held = g_bond.held[i];
+            if (held.seq != g_bond.expected)
+                continue;
+            g_bond.held[i] = g_bond.held[--g_bond.nHeld];
+            g_bond.expected++;
+            *data = held.data + BOND_HEADER_SIZE;
+            return held.len - BOND_HEADER_SIZE;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int left = timeoutMs - (int)(seconds_between(&start, &now) * 1000);
+        if (left <= 0)
+            return 0;
+        if (bond_receive(left) < 0)
+            return -1;
+    }
+}
+
+void bond_release(const unsigned char *data)
+{
+    if (data != NULL)
+        free((unsigned char *)data - BOND_HEADER_SIZE);
+}
@@ -0,0 +1,56 @@
+// Multilink bonding header.
+
+#ifndef _BOND_H_
+#define _BOND_H_
+
+#include "link_layer.h"
+
+// A bond stripes the packets of one transfer across several links, e.g.
+// "/tmp/ttyS10,/tmp/ttyS12". The link layer drives a single port per
+// process, so every member link is opened by a child process of its own,
+// which exchanges packets with the bond over a socket pair.
+//
+// Each packet goes out as C_BOND, a 4-byte bond sequence number and the
+// packet itself on one of the links, and the link layer numbers its frames
+// on that link as usual. The transmitter hands packets to the link that
+// would finish them first at its measured goodput, and moves those of a
+// failed link to the others. The receiver puts them back in sequence
+// order and drops copies.
+#define BOND_MAX_LINKS 8
+#define BOND_HEADER_SIZE 5
+#define BOND_WINDOW 64 // Packets sent and not acknowledged in order
+
+// Open a link on every comma-separated port of ports with the other
+// parameters of ll. Links that fail to open are left out.
+// Return 0 if at least one link is up or -1 on error.
+int bond_open(const char *ports, LinkLayer ll);
+
+// Close every link of the bond and print what each carried.
+// Return 0 on success or -1 on error.
+int bond_close(void);
+
+// Largest packet bond_write() accepts: the smallest llmaxpayload() of
+// the links, less BOND_HEADER_SIZE.
+int bond_maxpayload(void);
+
+// Like llwrite(): queue buf for the first link with room and return
+// bufSize, or -1 once every link failed. LlSent events are reported
+// through the callback in the order the packets were written.
+int bond_write(const unsigned char *buf, int bufSize);
+
+// Register the function called for every LlSent event. Pass NULL to disable.
+void bond_setcallback(LlEventCallback callback, void *user);
+
+// Wait until every packet written was acknowledged.
+// Return 0, or -1 if every link failed first.
+int bond_flush(void);
+
+// Like llreadview(): lend the next packet in sequence order until
+// bond_release(data). Return its length, 0 on timeout (data is NULL) or
+// -1 once every link is gone.
+int bond_readview(const unsigned char **data);
+
+// Give back a packet returned by bond_readview(). Safe to call from any thread.
+void bond_release(const unsigned char *data);
+
+#endif // _BOND_H_
@@ -0,0 +1,109 @@
+// Link capabilities exchanged in the SETX / UAX handshake
+
+#include "capability.h"
+
+#include <string.h>
+
+void cap_classic(Capabilities *caps, int maxPayload)
+{
+    memset(caps, 0, sizeof(*caps));
+    caps->maxPayload = maxPayload;
+    caps->window = 1;
+    caps->check = CHECK_XOR;
+    caps->framing = FRAMING_PPP;
+    caps->compression = COMPRESS_NONE;
+    caps->ack = ACK_EACH;
+    caps->timerMs = 1;
+}
+
+static int put_tlv(unsigned char *out, int outMax, int k, unsigned char type, int value, int size)
+{
+    if (k < 0 || k + 2 + size > outMax)
+        return -1;
+    out[k++] = type;
+    out[k++] = (unsigned char)size;
+    for (int i = size - 1; i >= 0; i--)
+        out[k++] = (unsigned char)(value >> (8 * i));
+    return k;
+}
+
+int cap_encode(const Capabilities *caps, unsigned char *out, int outMax)
+{
+    int k = 0;
+    k = put_tlv(out, outMax, k, CAP_MAX_PAYLOAD, caps->maxPayload, 2);
+    k = put_tlv(out, outMax, k, CAP_WINDOW, caps->window, 1);
+    k = put_tlv(out, outMax, k, CAP_CHECK, caps->check, 1);
+    k = put_tlv(out, outMax, k, CAP_FRAMING, caps->framing, 1);
+    k = put_tlv(out, outMax, k, CAP_COMPRESSION, caps->compression, 1);
+    k = put_tlv(out, outMax, k, CAP_ACK, caps->ack, 1);
+    k = put_tlv(out, outMax, k, CAP_TIMER, caps->timerMs, 2);
+    return k;
+}
+
+int cap_decode(const unsigned char *in, int len, int maxPayload, Capabilities *caps)
+{
+    cap_classic(caps, maxPayload);
+    int i = 0;
+    while (i < len)
+    {
+        if (i + 2 > len || i + 2 + in[i + 1] > len)
+            return -1;
+        unsigned char type = in[i];
+        int size = in[i + 1];
+        int value = 0;
+        for (int n = 0; n < size && n < 3; n++)
+            value = (value << 8) | in[i + 2 + n];
+        i += 2 + size;
+        // No field needs more than 3 bytes
+        if (type <= CAP_TIMER && size > 3)
+            return -1;
+
+        switch (type)
+        {
+        case CAP_MAX_PAYLOAD:
+            if (value < 1)
+                return -1;
+            caps->maxPayload = value;
+            break;
+        case CAP_WINDOW:
+            if (value < 1)
+                return -1;
+            caps->window = value;
+            break;
+        case CAP_CHECK:
+            caps->check = (unsigned char)value;
+            break;
+        case CAP_FRAMING:
+            caps->framing = (unsigned char)value;
+            break;
+        case CAP_COMPRESSION:
+            caps->compression = (unsigned char)value;
+            break;
+        case CAP_ACK:
+            caps->ack = (unsigned char)value;
+            break;
+        case CAP_TIMER:
+            if (value < 1)
+                return -1;
+            caps->timerMs = value;
+            break;
+        default:
+            break; // Added by a newer peer
+        }
+    }
+    return 0;
+}
+
+void cap_intersect(const Capabilities *a, const Capabilities *b, Capabilities *out)
+{
+    Capabilities both;
+    both.maxPayload = a->maxPayload < b->maxPayload ? a->maxPayload : b->maxPayload;
+    both.window = a->window < b->window ? a->window : b->window;
+    both.check = (unsigned char)((a->check & b->check) | CHECK_XOR);
+    both.framing = (unsigned char)((a->framing & b->framing) | FRAMING_PPP);
+    both.compression = (unsigned char)((a->compression & b->compression) | COMPRESS_NONE);
+    both.ack = (unsigned char)((a->ack & b->ack) | ACK_EACH);
+    // The coarser timer bounds both ends
+    both.timerMs = a->timerMs > b->timerMs ? a->timerMs : b->timerMs;
+    *out = both;
+}
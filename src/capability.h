@@ -0,0 +1,59 @@
+// Link capabilities exchanged in the SETX / UAX handshake header.
+
+#ifndef _CAPABILITY_H_
+#define _CAPABILITY_H_
+
+// Capability block: a sequence of TLVs, each a type byte, a length byte and
+// that many value bytes. Integers are big-endian. Unknown types are skipped
+// and a missing type means the classic protocol for that field.
+#define CAP_MAX_PAYLOAD 0x01 // Largest I-frame payload accepted (2 bytes)
+#define CAP_WINDOW 0x02      // I-frames in flight (1 byte), 1 means modulo 2 numbering
+#define CAP_CHECK 0x03       // Frame checks (1 byte, CHECK_*)
+#define CAP_FRAMING 0x04     // Framings (1 byte, FRAMING_*)
+#define CAP_COMPRESSION 0x05 // Payload compressions (1 byte, COMPRESS_*)
+#define CAP_ACK 0x06         // Acknowledgement policies (1 byte, ACK_*)
+#define CAP_TIMER 0x07       // Timer granularity in ms (2 bytes)
+
+#define CHECK_XOR 0x01   // 8-bit XOR BCC2
+#define CHECK_CRC32 0x02 // CRC-32 at the end of every I-frame payload
+
+#define FRAMING_PPP 0x01  // Byte stuffing
+#define FRAMING_COBS 0x02 // COBS encoded information field
+#define FRAMING_LEN 0x04  // Length-prefixed I-frames (C_LEN)
+
+#define COMPRESS_NONE 0x01
+
+#define ACK_EACH 0x01    // One RR per I-frame
+#define ACK_DELAYED 0x02 // Cumulative RR, possibly delayed
+
+// Largest block written by cap_encode()
+#define CAP_BLOCK_SIZE 23
+
+// Bitmask fields list every option an end supports; after cap_intersect()
+// they list the options both support.
+typedef struct
+{
+    int maxPayload;
+    int window;
+    unsigned char check;
+    unsigned char framing;
+    unsigned char compression;
+    unsigned char ack;
+    int timerMs;
+} Capabilities;
+
+// What a peer speaking only the classic SET / UA supports.
+void cap_classic(Capabilities *caps, int maxPayload);
+
+// Write the capability block of caps.
+// Return the number of bytes written or -1 if out is too small.
+int cap_encode(const Capabilities *caps, unsigned char *out, int outMax);
+
+// Parse a capability block. Fields it lacks keep the classic values.
+// Return 0 or -1 if the block is malformed.
+int cap_decode(const unsigned char *in, int len, int maxPayload, Capabilities *caps);
+
+// Keep what both a and b support. The classic options always remain.
+void cap_intersect(const Capabilities *a, const Capabilities *b, Capabilities *out);
+
+#endif // _CAPABILITY_H_
@@ -0,0 +1,200 @@
+// Logical channels multiplexed over one link implementation
+
+#include "channel.h"
+#include "app_packet.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct
+{
+    PacketRing *ring; // NULL if the channel is not in use
+    int priority;
+    int weight;
+    double finish; // Bytes sent / weight, for the channels of one priority
+    ChHandler handler;
+    void *user;
+} Channel;
+
+static Channel g_channels[CH_MAX];
+
+// Failures seen by ch_transmit(), and the events of CH_BULK passed on
+typedef struct
+{
+    LlEventCallback callback;
+    void *user;
+    int failed;
+} ChHook;
+
+static void ch_on_link_event(const LlEvent *event, void *user)
+{
+    ChHook *hook = user;
+    if (event->type == LlFailed)
+        hook->failed = TRUE;
+    if (hook->callback != NULL && !(event->len > 0 && event->data[0] == C_CHANNEL))
+        hook->callback(event, hook->user);
+}
+
+int ch_add(int id, PacketRing *ring, int priority, int weight)
+{
+    if (id < 0 || id >= CH_MAX || g_channels[id].ring != NULL || weight < 1)
+        return -1;
+    g_channels[id].ring = ring;
+    g_channels[id].priority = priority;
+    g_channels[id].weight = weight;
+    g_channels[id].finish = 0;
+    return 0;
+}
+
+void ch_reset(void)
+{
+    for (int id = 0; id < CH_MAX; ++id)
+    {
+        if (g_channels[id].ring != NULL)
+            ring_set_notify(g_channels[id].ring, -1);
+        g_channels[id].ring = NULL;
+    }
+}
+
+// Channel whose packet goes next, or -1 if every ring is empty. Among the
+// channels of the highest priority with a packet, the one that would
+// finish it first if each had its weight's share of the link.
+static int ch_pick(double *now)
+{
+    int best = -1;
+    double bestFinish = 0;
+    for (int id = 0; id < CH_MAX; ++id)
+    {
+        Channel *c = &g_channels[id];
+        int len;
+        if (c->ring == NULL || ring_try_peek(c->ring, &len) == NULL)
+            continue;
+        // A channel that was idle does not catch up on the share it left
+        if (c->finish < *now)
+            c->finish = *now;
+        double finish = c->finish + (double)len / c->weight;
+        if (best < 0 || c->priority > g_channels[best].priority ||
+            (c->priority == g_channels[best].priority && finish < bestFinish))
+        {
+            best = id;
+            bestFinish = finish;
+        }
+    }
+    if (best >= 0)
+        *now = g_channels[best].finish;
+    return best;
+}
+
+// Hand the link the packet at the head of channel id.
+// Return 0 or -1 if the link refused it.
+static int ch_submit(int id, unsigned char *buf)
+{
+    Channel *c = &g_channels[id];
+    int len;
+    unsigned char *packet = ring_try_peek(c->ring, &len);
+    if (id != CH_BULK)
+    {
+        buf[0] = C_CHANNEL;
+        buf[1] = (unsigned char)id;
+        memcpy(&buf[CH_HEADER_SIZE], packet, len);
+        packet = buf;
+        len += CH_HEADER_SIZE;
+    }
+    c->finish += (double)len / c->weight;
+    int ret = llsubmit(packet, len);
+    ring_release(c->ring);
+    return ret < 0 ? -1 : 0;
+}
+
+int ch_transmit(LlEventCallback callback, void *user)
+{
+    if (g_channels[CH_BULK].ring == NULL)
+        return -1;
+    int wake[2];
+    if (pipe(wake) < 0)
+    {
+        perror("[APP] pipe");
+        return -1;
+    }
+    fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    for (int id = 0; id < CH_MAX; ++id)
+        if (g_channels[id].ring != NULL)
+            ring_set_notify(g_channels[id].ring, wake[1]);
+
+    ChHook hook = {.callback = callback, .user = user, .failed = FALSE};
+    llsetcallback(ch_on_link_event, &hook);
+    unsigned char *buf = malloc(llmaxpayload());
+    double now = 0;
+    int ret = buf != NULL ? 0 : -1;
+    while (ret == 0)
+    {
+        while (llpending() < CH_LINK_DEPTH)
+        {
+            int id = ch_pick(&now);
+            if (id < 0)
+                break;
+            if (ch_submit(id, buf) < 0)
+            {
+                fprintf(stderr, "[APP] llsubmit failed\n");
+                ret = -1;
+                break;
+            }
+        }
+        if (ret < 0 || ring_is_drained(g_channels[CH_BULK].ring))
+            break;
+
+        struct pollfd fds[2] = {{.fd = llfd(), .events = POLLIN}, {.fd = wake[0], .events = POLLIN}};
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            perror("[APP] poll");
+            ret = -1;
+            break;
+        }
+        char drain[64];
+        while (read(wake[0], drain, sizeof(drain)) > 0)
+            ;
+        if (llprocess() < 0 || hook.failed)
+            ret = -1;
+    }
+    if (ret == 0 && ring_is_aborted(g_channels[CH_BULK].ring))
+        ret = -1;
+    // Wait for the packets still in the link
+    if (llflush() < 0 || hook.failed)
+        ret = -1;
+    llsetcallback(NULL, NULL);
+    // Stop the stages still filling the rings, as link_sender() does
+    if (ret < 0)
+        for (int id = 0; id < CH_MAX; ++id)
+            if (g_channels[id].ring != NULL)
+                ring_abort(g_channels[id].ring);
+    for (int id = 0; id < CH_MAX; ++id)
+        if (g_channels[id].ring != NULL)
+            ring_set_notify(g_channels[id].ring, -1);
+    close(wake[0]);
+    close(wake[1]);
+    free(buf);
+    return ret;
+}
+
+void ch_sethandler(int id, ChHandler handler, void *user)
+{
+    if (id < 0 || id >= CH_MAX)
+        return;
+    g_channels[id].handler = handler;
+    g_channels[id].user = user;
+}
+
+int ch_deliver(const unsigned char *packet, int len)
+{
+    if (len < CH_HEADER_SIZE || packet[0] != C_CHANNEL || packet[1] >= CH_MAX)
+        return -1;
+    Channel *c = &g_channels[packet[1]];
+    if (c->handler != NULL)
+        c->handler(packet[1], &packet[CH_HEADER_SIZE], len - CH_HEADER_SIZE, c->user);
+    return 0;
+}
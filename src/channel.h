@@ -0,0 +1,50 @@
+// Logical channels multiplexed over one link header.
+
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+#include "link_layer.h"
+#include "packet_ring.h"
+
+// Every channel queues its packets in a ring of its own. ch_transmit()
+// hands the link the packet of the most urgent channel each time the link
+// has room: the highest priority first and, among channels of the same
+// priority, in proportion to their weights. Only CH_LINK_DEPTH packets are
+// queued in the link at once, so a control message waits for at most that
+// many bulk packets rather than for the whole transfer.
+//
+// Packets of CH_BULK go on the link as they are. Those of any other
+// channel go as C_CHANNEL, the channel id (1 byte) and the message, and
+// the receiver hands them to the channel's handler.
+#define CH_MAX 8
+#define CH_BULK 0    // The file transfer
+#define CH_MESSAGE 1 // Text lines from the transmitter's stdin
+#define CH_HEADER_SIZE 2
+#define CH_LINK_DEPTH 4
+
+// Called for every message received on a channel.
+typedef void (*ChHandler)(int id, const unsigned char *msg, int len, void *user);
+
+// Queue the packets of ring on channel id. ch_transmit() waits for them
+// through ring_set_notify().
+// Return 0 or -1 if id is taken or out of range.
+int ch_add(int id, PacketRing *ring, int priority, int weight);
+
+// Forget every channel added.
+void ch_reset(void);
+
+// Send the packets of every channel over the link until the CH_BULK ring
+// is closed and drained. The LlSent and LlFailed events of CH_BULK packets
+// go to callback, as with llsetcallback().
+// Return 0, or -1 if the CH_BULK ring was aborted or a packet was dropped;
+// every ring is then aborted so that their producers stop.
+int ch_transmit(LlEventCallback callback, void *user);
+
+// Register the handler of the messages of channel id. Pass NULL to drop them.
+void ch_sethandler(int id, ChHandler handler, void *user);
+
+// Hand a C_CHANNEL packet to its channel's handler.
+// Return 0 or -1 if it is malformed.
+int ch_deliver(const unsigned char *packet, int len);
+
+#endif // _CHANNEL_H_
@@ -0,0 +1,492 @@
+// Frame encoding and incremental frame parser
+
+#include "frame.h"
+#include "frame_tables.h"
+
+#include <string.h>
+
+unsigned char compute_bcc2(const unsigned char *data, int len)
+{
+    unsigned char bcc2 = 0x00;
+    for (int i = 0; i < len; i++)
+    {
+        bcc2 ^= data[i];
+    }
+    return bcc2;
+}
+
+uint32_t compute_crc32(const unsigned char *data, int len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (int i = 0; i < len; i++)
+        crc = fr_crc32[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+int stuff_ppp(const unsigned char *in, int inLen, unsigned char *out, int outMax)
+{
+    int j = 0;
+    for (int i = 0; i < inLen; i++)
+    {
+        unsigned char d = in[i];
+        if (d == FLAG || d == ESC)
+        {
+            if (j + 2 > outMax)
+                return -1;
+            out[j++] = ESC;
+            out[j++] = (unsigned char)(d ^ ESC_XOR);
+        }
+        else
+        {
+            if (j + 1 > outMax)
+                return -1;
+            out[j++] = d;
+        }
+    }
+    return j;
+}
+
+int destuff_ppp(const unsigned char *in, int inLen, unsigned char *out, int outMax)
+{
+    int j = 0;
+    for (int i = 0; i < inLen; i++)
+    {
+        unsigned char d = in[i];
+        if (d == ESC)
+        {
+            if (i + 1 >= inLen)
+                return -1;
+            unsigned char y = (unsigned char)(in[i + 1] ^ ESC_XOR);
+            if (j + 1 > outMax)
+                return -1;
+            out[j++] = y;
+            i++;
+        }
+        else
+        {
+            if (j + 1 > outMax)
+                return -1;
+            out[j++] = d;
+        }
+    }
+    return j;
+}
+
+// COBS-encode in followed by tail, so the BCC2 needs no copy of the payload.
+static int cobs_encode(const unsigned char *in, int inLen, const unsigned char *tail, int tailLen,
+                       unsigned char *out, int outMax)
+{
+    int total = inLen + tailLen;
+    if (outMax < 1)
+        return -1;
+    int k = 1;
+    int codePos = 0;
+    unsigned char code = 1;
+    for (int i = 0; i < total; i++)
+    {
+        unsigned char b = (i < inLen) ? in[i] : tail[i - inLen];
+        if (b != 0)
+        {
+            if (k >= outMax)
+                return -1;
+            out[k++] = (unsigned char)(b ^ FLAG);
+            code++;
+        }
+        if (b == 0 || code == 0xFF)
+        {
+            // Close the block; a full block at the very end needs no successor
+            out[codePos] = (unsigned char)(code ^ FLAG);
+            code = 1;
+            codePos = k;
+            if (b == 0 || i + 1 < total)
+            {
+                if (k >= outMax)
+                    return -1;
+                k++;
+            }
+        }
+    }
+    if (codePos < k)
+        out[codePos] = (unsigned char)(code ^ FLAG);
+    return k;
+}
+
+int stuff_cobs(const unsigned char *in, int inLen, unsigned char *out, int outMax)
+{
+    return cobs_encode(in, inLen, NULL, 0, out, outMax);
+}
+
+int destuff_cobs(const unsigned char *in, int inLen, unsigned char *out, int outMax)
+{
+    // Output never gets ahead of the input, so decoding in place is safe
+    int j = 0;
+    int i = 0;
+    while (i < inLen)
+    {
+        int code = in[i++] ^ FLAG;
+        if (code == 0 || i + code - 1 > inLen || j + code - 1 > outMax)
+            return -1;
+        for (int n = 1; n < code; n++)
+            out[j++] = (unsigned char)(in[i++] ^ FLAG);
+        if (code < 0xFF && i < inLen)
+        {
+            if (j + 1 > outMax)
+                return -1;
+            out[j++] = 0;
+        }
+    }
+    return j;
+}
+
+static int build_frame(unsigned char *out, int outMax, unsigned char A, unsigned char C,
+                       const unsigned char *payload, int payloadLen, Framing framing)
+{
+    if (payloadLen < 0 || outMax < SUPERVISION_FRAME_SIZE + 1)
+        return -1;
+
+    unsigned char bcc2 = compute_bcc2(payload, payloadLen);
+    int header = (C & C_LEN) ? 4 + LEN_FIELD_SIZE : 4;
+    if (outMax < header + 2)
+        return -1;
+
+    int k = 0;
+    out[k++] = FLAG;
+    out[k++] = A;
+    out[k++] = C;
+    k = header;
+
+    // Stuff straight into the frame, leaving room for the closing FLAG
+    int sLen;
+    if (framing == FramingCobs)
+    {
+        sLen = cobs_encode(payload, payloadLen, &bcc2, 1, &out[k], outMax - k - 1);
+        if (sLen < 0)
+            return -1;
+        k += sLen;
+    }
+    else
+    {
+        sLen = stuff_ppp(payload, payloadLen, &out[k], outMax - k - 1);
+        if (sLen < 0)
+            return -1;
+        k += sLen;
+        sLen = stuff_ppp(&bcc2, 1, &out[k], outMax - k - 1);
+        if (sLen < 0)
+            return -1;
+        k += sLen;
+    }
+
+    // The header goes last, once the wire length of the field is known
+    unsigned char bcc1 = (unsigned char)(A ^ C);
+    if (C & C_LEN)
+    {
+        int wire = k - header;
+        if (wire > LEN_MAX)
+            return -1;
+        for (int i = 0; i < LEN_FIELD_SIZE; i++)
+        {
+            unsigned char l = (unsigned char)(0x80 | ((wire >> (6 * (LEN_FIELD_SIZE - 1 - i))) & 0x3F));
+            out[3 + i] = l;
+            bcc1 ^= l;
+        }
+    }
+    out[header - 1] = bcc1;
+    out[k++] = FLAG;
+
+    return k;
+}
+
+int build_i_frame(unsigned char *out, int outMax,
+                  const unsigned char *payload, int payloadLen,
+                  unsigned char C, Framing framing)
+{
+    return build_frame(out, outMax, A_1, C, payload, payloadLen, framing);
+}
+
+int build_control_frame(unsigned char *out, int outMax, unsigned char A, unsigned char C,
+                        const unsigned char *info, int infoLen)
+{
+    return build_frame(out, outMax, A, C, info, infoLen, FramingPpp);
+}
+
+int build_supervision_frame(unsigned char *out, unsigned char A, unsigned char C)
+{
+    out[0] = FLAG;
+    out[1] = A;
+    out[2] = C;
+    out[3] = (unsigned char)(A ^ C);
+    out[4] = FLAG;
+    return SUPERVISION_FRAME_SIZE;
+}
+
+void deframer_init(Deframer *d, unsigned char *buf, int limit)
+{
+    memset(d, 0, sizeof(*d));
+    d->state = DF_HUNT;
+    d->buf = buf;
+    d->limit = limit;
+    d->expect = -1;
+    deframer_set_framing(d, FramingPpp);
+}
+
+void deframer_set_framing(Deframer *d, Framing framing)
+{
+    d->framing = framing;
+    if (framing == FramingCobs)
+    {
+        // Keep the encoded field, it is decoded in place at the closing FLAG
+        d->byteClass = fr_byte_class_cobs;
+        d->cap = COBS_MAX_ENCODED(d->limit);
+    }
+    else
+    {
+        d->byteClass = fr_byte_class;
+        d->cap = d->limit;
+    }
+}
+
+void deframer_set_buffer(Deframer *d, unsigned char *buf)
+{
+    // A frame restarts at len 0 once its header checks out
+    d->buf = buf;
+}
+
+static void deframer_emit(Deframer *d, FrameStatus status, Frame *frame)
+{
+    unsigned short ctrl = fr_ctrl_class[d->C];
+    frame->type = (FrameType)(ctrl & 0x0F);
+    frame->seq = (ctrl >> 4) & 0x07;
+    frame->pf = (ctrl >> 7) & 0x01;
+    frame->mod8 = (ctrl >> 8) & 0x01;
+    frame->A = d->A;
+    frame->C = d->C;
+    frame->status = status;
+    frame->payload = NULL;
+    frame->payloadLen = 0;
+
+    // A length-prefixed field is complete in DF_TAIL
+    int data = d->state == DF_DATA || d->state == DF_TAIL;
+    d->expect = -1;
+
+    if (status == FrameOk && data && d->framing == FramingCobs)
+    {
+        // Only I-frames are COBS encoded, the ESCs of a SETX / UAX were kept
+        int n = frame->type == FrameI ? destuff_cobs(d->buf, d->len, d->buf, d->cap)
+                                      : destuff_ppp(d->buf, d->len, d->buf, d->cap);
+        if (n < 0)
+            frame->status = FrameBadData;
+        else if (n > d->limit)
+            frame->status = FrameOverflow;
+        else
+        {
+            d->len = n;
+            d->bcc = compute_bcc2(d->buf, n);
+        }
+    }
+    if (frame->status == FrameOk && data)
+    {
+        if (d->len < 1 || d->bcc != 0)
+            frame->status = FrameBadData;
+        else
+        {
+            frame->payload = d->buf;
+            frame->payloadLen = d->len - 1;
+        }
+    }
+    else if (frame->status == FrameOk && frame->type == FrameI)
+        frame->status = FrameBadData; // No BCC2
+}
+
+// Take the rest of a length-prefixed field, or as much of it as in holds.
+// A FLAG before the announced length means the frame was cut short.
+// Return 1 if a frame was emitted.
+static int deframer_body(Deframer *d, const unsigned char *in, int inLen, int *i, Frame *frame)
+{
+    int n = inLen - *i;
+    if (n > d->expect - d->wire)
+        n = d->expect - d->wire;
+    const unsigned char *p = &in[*i];
+
+    const unsigned char *flag = memchr(p, FLAG, n);
+    if (flag != NULL)
+    {
+        *i += (int)(flag - p) + 1;
+        deframer_emit(d, FrameBadData, frame);
+        d->state = DF_FLAG;
+        return 1;
+    }
+
+    if (d->framing == FramingCobs)
+    {
+        // The field was checked against cap in the header
+        memcpy(&d->buf[d->len], p, n);
+        d->len += n;
+        d->state = DF_DATA;
+    }
+    else
+    {
+        for (int k = 0; k < n; k++)
+        {
+            unsigned char b = p[k];
+            if (d->state == DF_ESC)
+                b ^= ESC_XOR;
+            else if (b == ESC)
+            {
+                d->state = DF_ESC;
+                continue;
+            }
+            if (d->len == d->cap)
+            {
+                *i += k + 1;
+                deframer_emit(d, FrameOverflow, frame);
+                d->state = DF_HUNT;
+                return 1;
+            }
+            d->buf[d->len++] = b;
+            d->bcc ^= b;
+            d->state = DF_DATA;
+        }
+    }
+    *i += n;
+    d->wire += n;
+    if (d->wire == d->expect)
+    {
+        // A trailing ESC leaves the field incomplete
+        if (d->state == DF_ESC)
+        {
+            deframer_emit(d, FrameBadData, frame);
+            d->state = DF_HUNT;
+            return 1;
+        }
+        d->state = DF_TAIL;
+    }
+    return 0;
+}
+
+int deframer_feed(Deframer *d, const unsigned char *in, int inLen, int *consumed, Frame *frame)
+{
+    int i = 0;
+    while (i < inLen)
+    {
+        if (d->expect >= 0 && (d->state == DF_HEADER || d->state == DF_DATA || d->state == DF_ESC))
+        {
+            if (deframer_body(d, in, inLen, &i, frame))
+            {
+                *consumed = i;
+                return 1;
+            }
+            continue;
+        }
+
+        unsigned char b = in[i++];
+        unsigned char t = fr_next[d->state][d->byteClass[b]];
+        int next = t & 0x0F;
+
+        switch (t >> 4)
+        {
+        case ACT_NONE:
+            break;
+
+        case ACT_SAVE_A:
+            d->A = b;
+            break;
+
+        case ACT_SAVE_C:
+            d->C = b;
+            d->bcc1 = (unsigned char)(d->A ^ b);
+            d->expect = -1;
+            d->lenBytes = 0;
+            d->wire = 0;
+            if ((fr_ctrl_class[b] >> 9) & 0x01)
+                next = DF_LEN;
+            break;
+
+        case ACT_SAVE_LEN:
+            if ((b & 0xC0) != 0x80)
+            {
+                deframer_emit(d, FrameBadHeader, frame);
+                d->state = DF_HUNT;
+                *consumed = i;
+                return 1;
+            }
+            d->bcc1 ^= b;
+            d->wire = (d->wire << 6) | (b & 0x3F);
+            if (++d->lenBytes == LEN_FIELD_SIZE)
+                next = DF_C;
+            break;
+
+        case ACT_CHECK_BCC1:
+            if (b != d->bcc1)
+            {
+                deframer_emit(d, FrameBadHeader, frame);
+                d->state = DF_HUNT;
+                *consumed = i;
+                return 1;
+            }
+            d->len = 0;
+            d->bcc = 0;
+            if (d->lenBytes == LEN_FIELD_SIZE)
+            {
+                // Length-prefixed: refuse a field that cannot fit before reading it
+                int maxWire = d->framing == FramingCobs ? d->cap : 2 * d->cap;
+                d->expect = d->wire;
+                d->wire = 0;
+                d->lenBytes = 0;
+                if (d->expect > maxWire)
+                {
+                    deframer_emit(d, FrameOverflow, frame);
+                    d->state = DF_HUNT;
+                    *consumed = i;
+                    return 1;
+                }
+                if (d->expect == 0)
+                    next = DF_TAIL;
+            }
+            break;
+
+        case ACT_STORE_ESC:
+            b ^= ESC_XOR;
+            // fall through
+        case ACT_STORE:
+            if (d->len == d->cap)
+            {
+                deframer_emit(d, FrameOverflow, frame);
+                d->state = DF_HUNT;
+                *consumed = i;
+                return 1;
+            }
+            d->buf[d->len++] = b;
+            d->bcc ^= b;
+            // Fast path: copy the run of plain bytes up to the next FLAG/ESC
+            while (i < inLen && d->len < d->cap && d->byteClass[in[i]] == BC_OTHER)
+            {
+                b = in[i++];
+                d->buf[d->len++] = b;
+                d->bcc ^= b;
+            }
+            break;
+
+        case ACT_END:
+            // The closing FLAG may also open the next frame
+            deframer_emit(d, FrameOk, frame);
+            d->state = next;
+            *consumed = i;
+            return 1;
+
+        case ACT_ABORT:
+            deframer_emit(d, FrameBadData, frame);
+            d->state = next;
+            *consumed = i;
+            return 1;
+
+        case ACT_SHORT:
+            deframer_emit(d, FrameBadHeader, frame);
+            d->state = next;
+            *consumed = i;
+            return 1;
+        }
+        d->state = next;
+    }
+    *consumed = i;
+    return 0;
+}
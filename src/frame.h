@@ -0,0 +1,171 @@
+// Frame encoding and incremental frame parser header.
+
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include <stdint.h>
+
+#define FLAG 0x7E
+#define A_1 0x03 // Commands sent by the transmitter, replies by the receiver
+#define A_3 0x01 // Commands sent by the receiver, replies by the transmitter
+
+#define C_Set 0x03
+#define C_UA 0x07
+#define C_DISC 0x0B
+#define C_SETX 0x23 // SET carrying a capability block
+#define C_UAX 0x27  // UA carrying the agreed capabilities
+
+#define ESC 0x7D
+#define ESC_XOR 0x20
+
+// Largest COBS encoding of n bytes
+#define COBS_MAX_ENCODED(n) ((n) + (n) / 254 + 1)
+
+#define C_I(ns) ((unsigned char)((ns) ? 0x80 : 0x00))
+#define C_RR(r) ((unsigned char)((r) ? 0xAB : 0xAA))
+#define C_REJ(r) ((unsigned char)((r) ? 0x55 : 0x54))
+// RR with the poll/final bit: a keepalive poll from the transmitter, or the
+// receiver's answer carrying the next Ns it expects
+#define C_RR_PF(r) ((unsigned char)(C_RR(r) | 0x10))
+
+// Modulo 8 numbering, used when more than one I-frame may be outstanding.
+// An RR or REJ acknowledges every frame before Nr.
+#define C_IW(ns) ((unsigned char)(0x40 | ((ns) & 0x07)))
+#define C_RRW(r) ((unsigned char)(0xC0 | ((r) & 0x07)))
+#define C_RRW_PF(r) ((unsigned char)(0xC8 | ((r) & 0x07)))
+#define C_REJW(r) ((unsigned char)(0x60 | ((r) & 0x07)))
+
+// Added to C_I / C_IW: LEN_FIELD_SIZE length bytes follow C and are covered
+// by BCC1. Each carries 6 bits (most significant first) with the top bit
+// set, so it is never a FLAG or an ESC. The length counts the bytes on the
+// wire between BCC1 and the closing FLAG.
+#define C_LEN 0x08
+#define LEN_FIELD_SIZE 3
+#define LEN_MAX ((1 << (6 * LEN_FIELD_SIZE)) - 1)
+
+// Size of a frame without information field
+#define SUPERVISION_FRAME_SIZE 5
+
+typedef enum
+{
+    FrameI,
+    FrameRR,
+    FrameREJ,
+    FrameSET,
+    FrameUA,
+    FrameDISC,
+    FrameUnknown,
+} FrameType;
+
+// Encoding of the information field between the header and the closing FLAG
+typedef enum
+{
+    FramingPpp,  // 0x7E / 0x7D escaped with ESC, up to twice the size
+    FramingCobs, // COBS, then XOR 0x7E: at most one extra byte per 254
+} Framing;
+
+typedef enum
+{
+    FrameOk,
+    FrameBadHeader, // BCC1 mismatch or header cut short, A/C cannot be trusted
+    FrameBadData,   // BCC2 mismatch or invalid escape / COBS sequence
+    FrameOverflow,  // Closing FLAG missing before the buffer filled up
+} FrameStatus;
+
+typedef struct
+{
+    FrameType type;
+    FrameStatus status;
+    unsigned char A;
+    unsigned char C;
+    unsigned char seq;              // Ns of I-frames, Nr of RR/REJ
+    unsigned char pf;               // Poll/final bit
+    unsigned char mod8;             // Modulo 8 numbering
+    const unsigned char *payload;   // Destuffed information field (I-frames)
+    int payloadLen;
+} Frame;
+
+// Incremental deframer state. Keeps a partial frame between calls so the
+// input can be split at any byte boundary.
+typedef struct
+{
+    int state;
+    Framing framing;
+    const unsigned char *byteClass;
+    unsigned char A;
+    unsigned char C;
+    unsigned char bcc1; // Expected BCC1, computed once C is known
+    unsigned char bcc;  // Running XOR of the destuffed information field
+    unsigned char *buf;
+    int cap;   // Bytes stored in buf before the closing FLAG
+    int limit; // Largest decoded information field
+    int len;
+    int expect; // Wire length of a length-prefixed field, -1 if unknown
+    int wire;   // Wire bytes of that field received so far
+    int lenBytes;
+} Deframer;
+
+// Size of the buffer given to deframer_init() for a given limit
+#define DEFRAMER_BUF_SIZE(limit) COBS_MAX_ENCODED(limit)
+
+// Compute the XOR of len bytes of data.
+unsigned char compute_bcc2(const unsigned char *data, int len);
+
+// Size of the CRC-32 ending the payload when the link agreed on CHECK_CRC32
+#define CRC32_SIZE 4
+
+// Compute the CRC-32 (IEEE 802.3) of len bytes of data.
+uint32_t compute_crc32(const unsigned char *data, int len);
+
+// Byte-stuff inLen bytes of in into out.
+// Return the number of bytes written or -1 if out is too small.
+int stuff_ppp(const unsigned char *in, int inLen, unsigned char *out, int outMax);
+
+// Undo stuff_ppp(). Return the number of bytes written or -1 on error.
+int destuff_ppp(const unsigned char *in, int inLen, unsigned char *out, int outMax);
+
+// COBS-encode inLen bytes of in into out, XORing every byte with FLAG so
+// that none of them is a FLAG.
+// Return the number of bytes written or -1 if out is too small.
+int stuff_cobs(const unsigned char *in, int inLen, unsigned char *out, int outMax);
+
+// Undo stuff_cobs(). in and out may be the same buffer.
+// Return the number of bytes written or -1 on error.
+int destuff_cobs(const unsigned char *in, int inLen, unsigned char *out, int outMax);
+
+// Build a complete I-frame (FLAG A C BCC1 stuffed(payload BCC2) FLAG),
+// C being C_I(ns) or C_IW(ns). With C_LEN added the length field is
+// inserted before BCC1.
+// Return the frame length or -1 if out is too small.
+int build_i_frame(unsigned char *out, int outMax, const unsigned char *payload, int payloadLen,
+                  unsigned char C, Framing framing);
+
+// Build a SETX / UAX frame (FLAG A C BCC1 stuffed(info BCC2) FLAG). It is
+// byte-stuffed whatever the framing, as the handshake decides the framing.
+// Return the frame length or -1 if out is too small.
+int build_control_frame(unsigned char *out, int outMax, unsigned char A, unsigned char C,
+                        const unsigned char *info, int infoLen);
+
+// Build a frame without information field. Return SUPERVISION_FRAME_SIZE.
+int build_supervision_frame(unsigned char *out, unsigned char A, unsigned char C);
+
+// Reset the deframer to PPP framing. limit is the largest information
+// field accepted (payload plus BCC2); buf receives it and must hold
+// DEFRAMER_BUF_SIZE(limit) bytes.
+void deframer_init(Deframer *d, unsigned char *buf, int limit);
+
+// Select the framing of the frames fed from now on.
+void deframer_set_framing(Deframer *d, Framing framing);
+
+// Decode the next frames into buf, of the same size as the first one. The
+// frame just emitted stays in the old buffer, so the caller can keep it.
+// Call only right after deframer_feed() returned a frame.
+void deframer_set_buffer(Deframer *d, unsigned char *buf);
+
+// Parse up to inLen bytes of in. Stops after the first complete frame and
+// stores it in frame, which stays valid until the next call.
+// consumed receives the number of bytes used.
+// Return 1 if a frame was emitted, 0 if more input is needed.
+int deframer_feed(Deframer *d, const unsigned char *in, int inLen, int *consumed, Frame *frame);
+
+#endif // _FRAME_H_
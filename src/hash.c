@@ -0,0 +1,171 @@
+// Streaming 64-bit content hash
+
+#include "hash.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// Little-endian loads, whatever the host
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v)
+{
+    acc ^= round64(0, v);
+    return acc * PRIME1 + PRIME4;
+}
+
+void hash64_init(Hash64 *hash)
+{
+    memset(hash, 0, sizeof(*hash));
+    hash->v[0] = PRIME1 + PRIME2;
+    hash->v[1] = PRIME2;
+    hash->v[2] = 0;
+    hash->v[3] = -PRIME1;
+}
+
+// Fold 32-byte stripes into the lanes. Return the bytes consumed.
+static int hash64_stripes(uint64_t v[4], const unsigned char *p, int len)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    int i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        v0 = round64(v0, read64(p + i));
+        v1 = round64(v1, read64(p + i + 8));
+        v2 = round64(v2, read64(p + i + 16));
+        v3 = round64(v3, read64(p + i + 24));
+    }
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+    v[3] = v3;
+    return i;
+}
+
+void hash64_update(Hash64 *hash, const unsigned char *data, int len)
+{
+    hash->total += (uint64_t)len;
+    if (hash->memSize + len < 32)
+    {
+        memcpy(hash->mem + hash->memSize, data, len);
+        hash->memSize += len;
+        return;
+    }
+    if (hash->memSize > 0)
+    {
+        // Complete the pending stripe first
+        int fill = 32 - hash->memSize;
+        memcpy(hash->mem + hash->memSize, data, fill);
+        hash64_stripes(hash->v, hash->mem, 32);
+        data += fill;
+        len -= fill;
+        hash->memSize = 0;
+    }
+    int used = hash64_stripes(hash->v, data, len);
+    memcpy(hash->mem, data + used, len - used);
+    hash->memSize = len - used;
+}
+
+uint64_t hash64_final(const Hash64 *hash)
+{
+    uint64_t h;
+    if (hash->total >= 32)
+    {
+        const uint64_t *v = hash->v;
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = merge64(h, v[i]);
+    }
+    else
+        h = PRIME5;
+    h += hash->total;
+
+    const unsigned char *p = hash->mem;
+    int left = hash->memSize;
+    for (; left >= 8; p += 8, left -= 8)
+        h = rotl(h ^ round64(0, read64(p)), 27) * PRIME1 + PRIME4;
+    if (left >= 4)
+    {
+        h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--)
+        h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+void hash64_format(const Hash64 *hash, char *out)
+{
+    int k = sprintf(out, "%016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %" PRIu64 " ",
+                    hash->v[0], hash->v[1], hash->v[2], hash->v[3], hash->total);
+    // The pending bytes, "-" if none
+    if (hash->memSize == 0)
+        out[k++] = '-';
+    for (int i = 0; i < hash->memSize; i++)
+        k += sprintf(out + k, "%02x", hash->mem[i]);
+    out[k] = '\0';
+}
+
+int hash64_parse(Hash64 *hash, const char *text)
+{
+    char mem[65];
+    memset(hash, 0, sizeof(*hash));
+    if (sscanf(text, "%" SCNx64 " %" SCNx64 " %" SCNx64 " %" SCNx64 " %" SCNu64 " %64s",
+               &hash->v[0], &hash->v[1], &hash->v[2], &hash->v[3], &hash->total, mem) != 6)
+        return -1;
+    // The pending bytes are what is left of the last stripe
+    hash->memSize = (int)(hash->total % 32);
+    if (strcmp(mem, "-") == 0 ? hash->memSize != 0 : (int)strlen(mem) != 2 * hash->memSize)
+        return -1;
+    for (int i = 0; i < hash->memSize; i++)
+    {
+        unsigned byte;
+        if (sscanf(mem + 2 * i, "%2x", &byte) != 1)
+            return -1;
+        hash->mem[i] = (unsigned char)byte;
+    }
+    return 0;
+}
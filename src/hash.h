@@ -0,0 +1,37 @@
+// Streaming 64-bit content hash header.
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stdint.h>
+
+// xxHash64 (seed 0), fed in pieces of any size. The state is more than the
+// running value, so a journal keeps the whole state (hash64_format()) to
+// continue a hash later, while packets carry only hash64_final().
+typedef struct
+{
+    uint64_t v[4];         // Lane accumulators
+    uint64_t total;        // Bytes added
+    unsigned char mem[32]; // Bytes not yet folded into a lane
+    int memSize;
+} Hash64;
+
+// Longest text written by hash64_format(), terminating NUL included
+#define HASH64_TEXT_SIZE (4 * 17 + 21 + 65)
+
+// Start a new hash.
+void hash64_init(Hash64 *hash);
+
+// Add len bytes of data.
+void hash64_update(Hash64 *hash, const unsigned char *data, int len);
+
+// Return the hash of everything added so far (the state is not modified).
+uint64_t hash64_final(const Hash64 *hash);
+
+// Write the state as one line of text into out (HASH64_TEXT_SIZE bytes).
+void hash64_format(const Hash64 *hash, char *out);
+
+// Read a state written by hash64_format(). Return 0 or -1 if malformed.
+int hash64_parse(Hash64 *hash, const char *text);
+
+#endif // _HASH_H_
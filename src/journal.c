@@ -0,0 +1,67 @@
+// Transfer checkpoint journal
+
+#include "journal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "RCJ2"
+
+static void journal_path(const char *filename, char *path, int pathMax)
+{
+    snprintf(path, pathMax, "%s.journal", filename);
+}
+
+int journal_load(const char *filename, Journal *journal)
+{
+    char path[512];
+    journal_path(filename, path, sizeof(path));
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    char magic[8];
+    char hash[HASH64_TEXT_SIZE];
+    int n = fscanf(f, "%7s %ld %ld %ld ", magic, &journal->fileSize, &journal->mtime, &journal->offset);
+    if (n != 4 || strcmp(magic, JOURNAL_MAGIC) != 0 || fgets(hash, sizeof(hash), f) == NULL)
+    {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    if (hash64_parse(&journal->hash, hash) < 0)
+        return -1;
+    if (journal->offset < 0 || journal->offset > journal->fileSize ||
+        journal->hash.total != (uint64_t)journal->offset)
+        return -1;
+    return 0;
+}
+
+int journal_save(const char *filename, const Journal *journal)
+{
+    char path[512], tmp[520];
+    journal_path(filename, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+        return -1;
+    char hash[HASH64_TEXT_SIZE];
+    hash64_format(&journal->hash, hash);
+    fprintf(f, "%s %ld %ld %ld %s\n", JOURNAL_MAGIC, journal->fileSize, journal->mtime,
+            journal->offset, hash);
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+    {
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(f);
+    return rename(tmp, path);
+}
+
+void journal_remove(const char *filename)
+{
+    char path[512];
+    journal_path(filename, path, sizeof(path));
+    unlink(path);
+}
@@ -0,0 +1,29 @@
+// Transfer checkpoint journal header.
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "hash.h"
+
+// Progress of an interrupted transfer, kept in "<filename>.journal" next
+// to the file being sent or received.
+typedef struct
+{
+    long fileSize; // Size of the whole file
+    long mtime;    // Modification time of the source file (transmitter only)
+    long offset;   // Bytes acknowledged (transmitter) or written (receiver)
+    Hash64 hash;   // State after the first offset bytes
+} Journal;
+
+// Load the journal of filename.
+// Return 0 on success or -1 if there is none or it is invalid.
+int journal_load(const char *filename, Journal *journal);
+
+// Atomically replace the journal of filename.
+// Return 0 on success or -1 on error.
+int journal_save(const char *filename, const Journal *journal);
+
+// Delete the journal of filename, if any.
+void journal_remove(const char *filename);
+
+#endif // _JOURNAL_H_
@@ -1,72 +1,182 @@
 // Link layer protocol implementation
 
 // MISC
-#define _POSIX_SOURCE 1 // POSIX compliant source
+#define _POSIX_C_SOURCE 200809L // POSIX compliant source
 
-#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include "link_layer.h"
+#include "capability.h"
+#include "frame.h"
+#include "metrics.h"
 #include "serial_port.h"
+#include "trace.h"
 
 #define FALSE 0
 #define TRUE 1
 
-#define BAUDRATE 38400
-#define BUF_SIZE 256
+#define BUF_SIZE MAX_PAYLOAD_SIZE
 
-#define FLAG 0x7E
-#define A_1 0x03
-#define A_3 0x01
+// Worst case frame of a payload: every byte stuffed, plus the header
+#define FRAME_SIZE(payload) ((payload) * 2 + 16)
+#define FRAME_BUF_SIZE FRAME_SIZE(BUF_SIZE)
 
-#define C_Set 0x03
-#define C_UA 0x07
+// Link supervision
+#define KEEPALIVE_MS 1000 // Silence on an idle link before a poll
+#define PROBE_MIN_MS 100  // First probe interval once the link is down
+#define PROBE_MAX_MS 1000 // Cap of the probe interval backoff
+#define NEGOTIATE_MS 1000 // Wait for UAX before falling back to SET, at most half the timeout
 
-#define ESC 0x7D
-#define ESC_XOR 0x20
+// Sliding window. A window of 1 is the original stop-and-wait protocol
+// with modulo 2 numbering, anything larger uses modulo 8 numbering.
+#define WINDOW_MAX 4 // Largest window where duplicates and gaps can be told apart
+#ifndef TX_WINDOW
+#define TX_WINDOW WINDOW_MAX
+#endif
+#if TX_WINDOW < 1 || TX_WINDOW > WINDOW_MAX || TX_WINDOW > LL_TXQ_SLOTS
+#error "TX_WINDOW must be 1-4 so that duplicates and gaps can be told apart"
+#endif
+#define ACK_EVERY 2     // In-sequence frames acknowledged by one RR
+#define ACK_DELAY_MS 20 // Line silence before a delayed RR goes out
 
-#define C_I(ns) ((unsigned char)((ns) ? 0x80 : 0x00))
-#define C_RR(r) ((unsigned char)((r) ? 0xAB : 0xAA))
-#define C_REJ(r) ((unsigned char)((r) ? 0x55 : 0x54))
+// I-frames carry their wire length (C_LEN), so the receiver takes the
+// field in bulk and notices a cut or merged frame at once. Offered in
+// SETX, a receiver always accepts it.
+#ifndef TX_LENGTH_PREFIX
+#define TX_LENGTH_PREFIX 1
+#endif
 
-typedef enum
+typedef struct
 {
-    ST_START = 0,
-    ST_FLAG_RCV,
-    ST_A_RCV,
-    ST_C_RCV,
-    ST_BCC_OK,
-} RxState;
+    unsigned char *payload; // maxPayload bytes of the slot pool
+    int payloadLen;
+    unsigned char *frame; // FRAME_SIZE(maxPayload) bytes of the slot pool
+    int frameLen;
+    int id;
+    int attempt;
+    int sends;                // Including resends behind the oldest frame
+    struct timespec firstSent; // For the round trip time
+} TxSlot;
+
+// State of the event-driven engine behind llprocess().
+typedef struct
+{
+    int fd;   // Serial port
+    int epfd; // Descriptor returned by llfd()
+    int tfd;  // Retransmission timer
+    LlEventCallback callback;
+    void *user;
+
+    // Settled in the SETX / UAX handshake
+    int window;       // I-frames in flight
+    int mod8;         // Modulo 8 numbering (window > 1)
+    int mask;         // Sequence number mask, 0x01 or 0x07
+    int maxPayload;   // Largest buffer llsubmit() accepts
+    int crc;          // I-frame payloads end in their CRC-32
+    Framing framing;  // Of I-frames, the handshake is byte-stuffed
+    int lengthPrefix; // I-frames sent with C_LEN
+    int ackEvery;     // In-sequence frames acknowledged by one RR
+    int ackDelayMs;
+
+    // Transmit slots and receive buffer, sized for maxPayload
+    unsigned char *pool;
+    int poolPayload;
+
+    TxSlot txq[LL_TXQ_SLOTS];
+    int txHead;
+    int txCount;
+    int txSent; // Slots from txHead on that were sent and wait for RR/REJ
+    int nextId;
+    int failed; // A buffer was dropped, reported by llwrite() / llflush()
+
+    // Link supervision (transmitter)
+    int linkDown;
+    int probeMs;                // Next probe interval while down
+    int pollPending;            // Keepalive poll sent and not answered
+    int pollEnd;                // Ns following the frames a poll went out behind, or -1
+    struct timespec downSince;
+
+    // Acknowledgement policy (receiver)
+    int unacked; // In-sequence frames not acknowledged yet
+    int rejHold; // Frames still to come from the window in flight when REJ went out
+
+    unsigned char in[FRAME_BUF_SIZE]; // Bytes read but not yet parsed, room for a classic frame
+    int inPos;
+    int inLen;
+    Deframer deframer;
+    unsigned char *rx; // Decoded information field and BCC2, in the slot pool
+
+    // Receive buffers of the slot pool. The deframer decodes into rx, one
+    // of them; those lent by llreadview() are skipped until llrelease().
+    unsigned char *rxBufs[LL_RX_VIEWS + 1];
+    int rxLent[LL_RX_VIEWS + 1]; // Set by the engine, cleared by llrelease() on any thread
+    int rxCount;
+    size_t rxSize;
+
+    // Used by the blocking wrappers
+    const unsigned char **readView;
+    int readLen;
+} LinkEngine;
 
 static LinkLayer g_ll;
+static LlFraming g_framing = LlFramingPpp;
+static int g_maxPayload = MAX_PAYLOAD_SIZE;
 static unsigned char g_ns = 0;
-static volatile sig_atomic_t g_timed_out = 0;
-
-static void alarm_handler(int sig);
-static void set_alarm_handler(void);
-static int send_set(void);
-static int send_ua(void);
-static int stateMachineEstablishment(unsigned char Aexintp, unsigned char Cexp, int timeout_s);
-static int wait_supervision_resp(unsigned char ns, int timeout_s);
-static unsigned char compute_bcc2(const unsigned char *data, int len);
-static int stuff_ppp(const unsigned char *in, int inLen, unsigned char *out, int outMax);
-static int destuff_ppp(const unsigned char *in, int inLen, unsigned char *out, int outMax);
-static int build_i_frame(unsigned char *out, int outMax, const unsigned char *payload, int payloadLen, unsigned char ns);
-static int get_frame(unsigned char *frame, int maxLen, int timeout_s);
-static int frame_check(const unsigned char *frame, int frameLen);
-static int bcc2_check(const unsigned char *stuffed, int stuffedLen, unsigned char *outData, int outMax);
+static LinkEngine g_eng = {.fd = -1, .epfd = -1, .tfd = -1};
+
+static int send_set(int extended);
+static int send_ua(const Capabilities *agreed);
+static int wait_control_frame(unsigned char A, FrameType type, int timeout_ms, Frame *frame);
+static int establish(int extended, int attempt, int timeout_ms);
+static void local_capabilities(Capabilities *caps);
+static int accept_set(const Frame *frame);
+static int agreed_payload(const Capabilities *agreed);
+static int engine_apply(const Capabilities *agreed);
+static void print_statistics(void);
+static int send_supervision(unsigned char A, unsigned char C);
 static int send_rr(unsigned char r);
 static int send_rej(unsigned char r);
-static int read_byte_with_timeout(unsigned char *b, int timeout_s);
+static int engine_open(int fd);
+static int engine_reserve(int maxPayload);
+static int engine_lent(void);
+static const unsigned char *engine_lend(const unsigned char *data);
+static void engine_close(void);
+static int engine_fill(int timeout_ms);
+static int engine_wait(int timeout_ms);
+static void engine_emit(LlEventType type, int id, const unsigned char *data, int len);
+static void engine_arm_timer(int timeout_ms);
+static int engine_pump(void);
+static int engine_transmit_next(void);
+static int engine_acknowledge(unsigned char nr);
+static void engine_go_back(void);
+static void engine_complete_head(LlEventType type);
+static void engine_fail_queue(void);
+static void engine_send_ack(void);
+static void engine_reject(const char *reason, int seq);
+static void engine_on_timeout(void);
+static void engine_link_down(void);
+static void engine_link_up(void);
+static void engine_probe(void);
+static void engine_query(void);
+static void engine_on_frame(const Frame *frame);
+static void engine_on_supervision(const Frame *frame);
+static void engine_on_i_frame(const Frame *frame);
 
 ////////////////////////////////////////////////
 // LLOPEN
 ////////////////////////////////////////////////
 int llopen(LinkLayer connectionParameters)
 {
-    if (openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate) < 0)
+    int fd = openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate);
+    if (fd < 0)
     {
         perror("openSerialPort");
         return -1;
@@ -74,25 +184,27 @@ int llopen(LinkLayer connectionParameters)
     g_ll = connectionParameters;
     g_ns = 0;
     printf("Serial port %s opened\n", connectionParameters.serialPort);
+    if (engine_open(fd) < 0)
+        return -1;
+    TRACE_OPEN(connectionParameters.role == LlTx ? "ll-tx.trace" : "ll-rx.trace");
+    metrics_open(connectionParameters.serialPort, connectionParameters.role == LlRx);
     if (connectionParameters.role == LlTx)
     {
+        // An old receiver ignores SETX: offer it briefly, then send a classic SET
+        int timeoutMs = connectionParameters.timeout * 1000;
+        int offerMs = (timeoutMs / 2 < NEGOTIATE_MS) ? timeoutMs / 2 : NEGOTIATE_MS;
         for (int attempt = 1; attempt <= connectionParameters.nRetransmissions; ++attempt)
         {
-            if (send_set() < 0)
-            {
-                perror("[TX] SET not sent");
+            int done = establish(TRUE, attempt, offerMs);
+            if (done == 0)
+                done = establish(FALSE, attempt, timeoutMs - offerMs);
+            if (done < 0)
                 return -1;
-            }
-            printf("[TX] SET sent (try %d/%d), waiting UA (%ds)\n",
-                   attempt, connectionParameters.nRetransmissions, connectionParameters.timeout);
-
-            int received = stateMachineEstablishment(A_3, C_UA, connectionParameters.timeout);
-            if (received == 1)
+            if (done)
             {
-                printf("[TX] UA recieved\n");
+                engine_arm_timer(KEEPALIVE_MS);
                 return 0;
             }
-            printf("[TX] Timeout waiting UA\n");
         }
         fprintf(stderr, "[TX] Fail: exceeded retransmissions.\n");
         return -1;
@@ -100,17 +212,10 @@ int llopen(LinkLayer connectionParameters)
     else
     {
         printf("[RX] waiting SET (%ds)...\n", connectionParameters.timeout);
-        int received = stateMachineEstablishment(A_1, C_Set, connectionParameters.timeout);
+        Frame frame;
+        int received = wait_control_frame(A_1, FrameSET, connectionParameters.timeout * 1000, &frame);
         if (received == 1)
-        {
-            printf("[RX] SET received. Sending UA\n");
-            if (send_ua() < 0)
-            {
-                perror("[RX] UA not sent");
-                return -1;
-            }
-            return 0;
-        }
+            return accept_set(&frame);
         else if (received == 0)
         {
             fprintf(stderr, "[RX] Timeout waiting SET\n");
@@ -129,51 +234,18 @@ int llopen(LinkLayer connectionParameters)
 ////////////////////////////////////////////////
 int llwrite(const unsigned char *buf, int bufSize)
 {
-    if (bufSize < 0 || bufSize > BUF_SIZE)
+    // Returns once buf is queued: acknowledgements arrive as LlSent events
+    // and a dropped buffer fails the next llwrite() or llflush().
+    if (llprocess() < 0)
         return -1;
-    unsigned char frame[BUF_SIZE * 2 + 16];
-    int frameLen = build_i_frame(frame, sizeof(frame), buf, bufSize, g_ns);
-    if (frameLen < 0)
+    while (g_eng.txCount == LL_TXQ_SLOTS && !g_eng.failed)
     {
-        fprintf(stderr, "[TX] build_i_frame failed\n");
-        return -1;
-    }
-    for (int attempt = 1; attempt <= g_ll.nRetransmissions; ++attempt)
-    {
-        int sent = writeBytesSerialPort(frame, frameLen);
-        if (sent != frameLen)
-        {
-            perror("[TX] write I frame");
+        if (engine_wait(-1) < 0 || llprocess() < 0)
             return -1;
-        }
-        printf("[TX] I(Ns=%u) sent (try %d/%d), waiting RR/REJ (%ds)\n",
-               g_ns, attempt, g_ll.nRetransmissions, g_ll.timeout);
-
-        int resp = wait_supervision_resp(g_ns, g_ll.timeout);
-        if (resp == 1)
-        {
-            printf("[TX] RR ok. Advancing Ns.\n");
-            g_ns ^= 0x01;
-            return bufSize;
-        }
-        else if (resp == 0)
-        {
-            printf("[TX] REJ received. Retransmitting same I(Ns=%u)...\n", g_ns);
-            continue;
-        }
-        else if (resp == -2)
-        {
-            printf("[TX] Timeout waiting RR/REJ. Retransmitting...\n");
-            continue;
-        }
-        else
-        {
-            fprintf(stderr, "[TX] Unexpected response (%d). Retransmitting...\n", resp);
-            continue;
-        }
     }
-    fprintf(stderr, "[TX] Fail: exceeded retransmissions in llwrite.\n");
-    return -1;
+    if (g_eng.failed || llsubmit(buf, bufSize) < 0)
+        return -1;
+    return bufSize;
 }
 
 ////////////////////////////////////////////////
@@ -181,43 +253,59 @@ int llwrite(const unsigned char *buf, int bufSize)
 ////////////////////////////////////////////////
 int llread(unsigned char *packet)
 {
-    unsigned char frame[BUF_SIZE * 2 + 16];
-    int flen = get_frame(frame, sizeof(frame), g_ll.timeout);
-    if (flen == 0)
+    const unsigned char *data;
+    int n = llreadview(&data);
+    if (data == NULL)
+        return n;
+    // packet holds MAX_PAYLOAD_SIZE bytes unless llsetmaxpayload() raised
+    // the offer, and the link never settles above the offer
+    if (n > g_maxPayload)
     {
-        return 0;
-    }
-    if (flen < 0)
-    {
-        perror("[RX] rx_capture_frame");
+        fprintf(stderr, "[RX] llread: %d-byte payload, only %d bytes expected\n", n, g_maxPayload);
+        llrelease(data);
         return -1;
     }
+    memcpy(packet, data, n);
+    llrelease(data);
+    return n;
+}
 
-    if (frame_check(frame, flen) < 0)
+int llreadview(const unsigned char **data)
+{
+    *data = NULL;
+    if (engine_lent() == LL_RX_VIEWS)
     {
+        fprintf(stderr, "[RX] llreadview: all %d receive buffers are lent\n", LL_RX_VIEWS);
         return -1;
     }
-    unsigned char C = frame[2];
-    unsigned char Ns = (C == C_I(1)) ? 1 : 0;
-    const unsigned char *stuffed = &frame[4];
-    int stuffedLen = flen - 5;
-    int payloadLen = bcc2_check(stuffed, stuffedLen, packet, BUF_SIZE);
-    if (payloadLen < 0)
+    g_eng.readView = data;
+    g_eng.readLen = -1;
+    while (g_eng.readLen < 0)
     {
-        (void)send_rej(g_ns);
-        fprintf(stderr, "[RX] BCC2 error (%d). Sent REJ(r=%u)\n", payloadLen, g_ns);
-        return -1;
+        int ready = engine_wait(g_ll.timeout * 1000);
+        if (ready <= 0 || llprocess() < 0)
+        {
+            g_eng.readView = NULL;
+            if (ready == 0)
+                return 0;
+            perror("[RX] llread");
+            return -1;
+        }
     }
-    if (Ns == g_ns)
+    g_eng.readView = NULL;
+    return g_eng.readLen;
+}
+
+void llrelease(const unsigned char *data)
+{
+    for (int i = 0; data != NULL && i < g_eng.rxCount; ++i)
     {
-        int r = (g_ns ^ 1) & 0x01;
-        (void)send_rr(r);
-        g_ns = r;
-        return payloadLen;
+        if (data >= g_eng.rxBufs[i] && data < g_eng.rxBufs[i] + g_eng.rxSize)
+        {
+            __atomic_store_n(&g_eng.rxLent[i], 0, __ATOMIC_RELEASE);
+            return;
+        }
     }
-    (void)send_rr(g_ns);
-    fprintf(stderr, "[RX] Duplicate I(Ns=%u). Sent RR(r=%u). Payload dropped.\n", Ns, g_ns);
-    return -3;
 }
 
 ////////////////////////////////////////////////
@@ -225,473 +313,963 @@ int llread(unsigned char *packet)
 ////////////////////////////////////////////////
 int llclose()
 {
-    // TODO: Implement this function
+    // A buffer dropped since llopen(), or still queued and now dropped,
+    // fails the close: llwrite() already returned for it
+    int ret = 0;
+    if (g_ll.role == LlTx)
+        ret = llflush();
+    else if (g_eng.unacked > 0)
+        engine_send_ack();
+    TRACE(TraceClose, 0, 0, 0);
+    TRACE_DUMP();
+    print_statistics();
+    metrics_close();
+    engine_close();
+    if (closeSerialPort() < 0)
+        return -1;
+    return ret;
+}
+
+////////////////////////////////////////////////
+// EVENT-DRIVEN INTERFACE
+////////////////////////////////////////////////
+int llfd()
+{
+    return g_eng.epfd;
+}
 
-    return 0;
+void llsetcallback(LlEventCallback callback, void *user)
+{
+    g_eng.callback = callback;
+    g_eng.user = user;
 }
 
-// Establishment
-static int send_set(void)
+void llsetframing(LlFraming framing)
 {
-    unsigned char SET[] = {FLAG, A_1, C_Set, (unsigned char)(A_1 ^ C_Set), FLAG};
-    int n = writeBytesSerialPort(SET, 5);
-    return (n == 5) ? 0 : -1;
+    g_framing = framing;
 }
 
-static int send_ua(void)
+void llsetmaxpayload(int size)
 {
-    unsigned char UA[BUF_SIZE] = {FLAG, A_3, C_UA, (unsigned char)(A_3 ^ C_UA), FLAG};
-    int n = writeBytesSerialPort(UA, 5);
-    return (n == 5) ? 0 : -1;
+    if (size < MAX_PAYLOAD_SIZE)
+        size = MAX_PAYLOAD_SIZE;
+    g_maxPayload = size > LL_JUMBO_PAYLOAD_SIZE ? LL_JUMBO_PAYLOAD_SIZE : size;
 }
 
-// State machines
-static int stateMachineEstablishment(unsigned char A, unsigned char C, int timeout_s)
+int llmaxpayload()
 {
-    RxState st = ST_START;
-    g_timed_out = 0;
-    set_alarm_handler();
-    alarm(timeout_s);
+    return g_eng.maxPayload > 0 ? g_eng.maxPayload : MAX_PAYLOAD_SIZE;
+}
 
-    while (TRUE)
+int llsubmit(const unsigned char *buf, int bufSize)
+{
+    if (g_eng.epfd < 0 || g_ll.role != LlTx)
+        return -1;
+    if (bufSize < 0 || bufSize > g_eng.maxPayload || g_eng.txCount == LL_TXQ_SLOTS)
+        return -1;
+
+    TxSlot *slot = &g_eng.txq[(g_eng.txHead + g_eng.txCount) % LL_TXQ_SLOTS];
+    // A failure drops the whole queue, so Ns simply counts up from the head.
+    unsigned char ns = (g_ns + g_eng.txCount) & g_eng.mask;
+    memcpy(slot->payload, buf, bufSize);
+    int fieldLen = bufSize;
+    if (g_eng.crc)
     {
-        if (g_timed_out)
-        {
-            alarm(0);
-            return 0;
-        }
+        uint32_t crc = compute_crc32(buf, bufSize);
+        for (int i = 0; i < CRC32_SIZE; ++i)
+            slot->payload[fieldLen++] = (unsigned char)(crc >> (8 * (CRC32_SIZE - 1 - i)));
+    }
+    slot->frameLen = build_i_frame(slot->frame, FRAME_SIZE(g_eng.poolPayload), slot->payload, fieldLen,
+                                   (g_eng.mod8 ? C_IW(ns) : C_I(ns)) | (g_eng.lengthPrefix ? C_LEN : 0),
+                                   g_eng.framing);
+    if (slot->frameLen < 0)
+    {
+        fprintf(stderr, "[TX] build_i_frame failed\n");
+        return -1;
+    }
+    slot->payloadLen = bufSize;
+    slot->id = g_eng.nextId++;
+    slot->attempt = 0;
+    slot->sends = 0;
+    g_eng.txCount++;
 
-        unsigned char b = 0;
-        int received = read_byte_with_timeout(&b, timeout_s);
-        if (received == 0)
-        {
-            alarm(0);
-            return 0;
-        }
-        if (received < 0)
-        {
-            alarm(0);
+    if (engine_pump() < 0)
+        return -1;
+    return slot->id;
+}
+
+int llpending()
+{
+    return g_eng.txCount;
+}
+
+int llflush()
+{
+    while (g_eng.txCount > 0)
+    {
+        if (engine_wait(-1) < 0 || llprocess() < 0)
             return -1;
-        }
+    }
+    return g_eng.failed ? -1 : 0;
+}
 
-        switch (st)
-        {
-        case ST_START:
-            if (b == FLAG)
-                st = ST_FLAG_RCV;
-            break;
+int llprocess()
+{
+    if (g_eng.epfd < 0)
+        return -1;
+    TRACE_POLL();
 
-        case ST_FLAG_RCV:
-            if (b == FLAG)
-            {
-            }
-            else if (b == A)
-                st = ST_A_RCV;
-            else
-                st = ST_START;
-            break;
+    uint64_t expirations;
+    if (read(g_eng.tfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        engine_on_timeout();
 
-        case ST_A_RCV:
-            if (b == FLAG)
-                st = ST_FLAG_RCV;
-            else if (b == C)
-                st = ST_C_RCV;
-            else
-                st = ST_START;
-            break;
+    int n = engine_fill(0);
+    if (n < 0)
+        return -1;
+    // A delayed RR waits for the line to go quiet
+    if (n > 0 && g_ll.role == LlRx && g_eng.unacked > 0)
+        engine_arm_timer(g_eng.ackDelayMs);
 
-        case ST_C_RCV:
-        {
-            unsigned char bcc_ok = (unsigned char)(A ^ C);
-            if (b == FLAG)
-                st = ST_FLAG_RCV;
-            else if (b == bcc_ok)
-                st = ST_BCC_OK;
-            else
-                st = ST_START;
-        }
-        break;
+    // Stop after one payload when a blocking llread() is waiting for it,
+    // the remaining bytes stay in in[] for the next call.
+    while (g_eng.inPos < g_eng.inLen && !(g_eng.readView != NULL && g_eng.readLen >= 0))
+    {
+        Frame frame;
+        int used;
+        int got = deframer_feed(&g_eng.deframer, &g_eng.in[g_eng.inPos],
+                                g_eng.inLen - g_eng.inPos, &used, &frame);
+        g_eng.inPos += used;
+        if (got)
+            engine_on_frame(&frame);
+    }
 
-        case ST_BCC_OK:
-            if (b == FLAG)
-            {
-                alarm(0);
-                return 1;
-            }
-            else
-                st = ST_START;
-            break;
-        }
+    return engine_pump();
+}
+
+static long elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// Establishment
+static int send_set(int extended)
+{
+    unsigned char SET[2 * (SUPERVISION_FRAME_SIZE + CAP_BLOCK_SIZE + 1)];
+    int len = build_supervision_frame(SET, A_1, C_Set);
+    if (extended)
+    {
+        Capabilities local;
+        unsigned char block[CAP_BLOCK_SIZE];
+        local_capabilities(&local);
+        len = build_control_frame(SET, sizeof(SET), A_1, C_SETX,
+                                  block, cap_encode(&local, block, sizeof(block)));
+    }
+    int n = writeBytesSerialPort(SET, len);
+    return (len > 0 && n == len) ? 0 : -1;
+}
+
+// UA, or UAX with the capabilities both ends will use.
+static int send_ua(const Capabilities *agreed)
+{
+    unsigned char UA[2 * (SUPERVISION_FRAME_SIZE + CAP_BLOCK_SIZE + 1)];
+    int len = build_supervision_frame(UA, A_3, C_UA);
+    if (agreed != NULL)
+    {
+        unsigned char block[CAP_BLOCK_SIZE];
+        len = build_control_frame(UA, sizeof(UA), A_3, C_UAX,
+                                  block, cap_encode(agreed, block, sizeof(block)));
     }
+    int n = writeBytesSerialPort(UA, len);
+    return (len > 0 && n == len) ? 0 : -1;
 }
 
-static int wait_supervision_resp(unsigned char ns, int timeout_s)
+// Largest payload offered for a window of frames. Writes block while a
+// whole window is queued for the wire, so the window, stuffed at worst,
+// must go out within half the timeout or the retransmission timer fires
+// before the first RR is read. Only the configured baud rate is known
+// here: on a slower line the window outlasts the timer and the link falls
+// back on go-back-N, so configure the rate the line actually runs at.
+static int offered_payload(int window)
 {
-    RxState st = ST_START;
-    unsigned char A = 0, C = 0;
-    g_timed_out = 0;
-    set_alarm_handler();
-    alarm(timeout_s);
+    long payload = (long)g_ll.baudRate / 10 * g_ll.timeout / (4 * window);
+    if (payload < BUF_SIZE)
+        return BUF_SIZE;
+    return payload < g_maxPayload ? (int)payload : g_maxPayload;
+}
 
-    while (TRUE)
+// Frames a transmitter keeps in flight. A go-back retransmission queues
+// behind the frames already sent, so on a slow line fewer are sent ahead:
+// each REJ would otherwise end in a timeout.
+static int offered_window(void)
+{
+    long frames = (long)g_ll.baudRate / 10 * g_ll.timeout / (2 * BUF_SIZE);
+    if (frames < 1)
+        return 1;
+    return frames < TX_WINDOW ? (int)frames : TX_WINDOW;
+}
+
+// What this end offers in SETX / UAX.
+static void local_capabilities(Capabilities *caps)
+{
+    cap_classic(caps, BUF_SIZE);
+    caps->window = (g_ll.role == LlTx) ? offered_window() : WINDOW_MAX;
+    caps->maxPayload = offered_payload(caps->window);
+    if (g_framing == LlFramingCobs)
+        caps->framing |= FRAMING_COBS;
+    // A receiver takes length-prefixed frames whatever it sends
+    if (g_ll.role == LlRx || TX_LENGTH_PREFIX)
+        caps->framing |= FRAMING_LEN;
+    caps->ack |= ACK_DELAYED;
+    caps->check |= CHECK_CRC32;
+}
+
+// Answer a SET with UA, or a SETX with UAX carrying the intersection of
+// both offers, and use the result. A repeated SET starts over.
+static int accept_set(const Frame *frame)
+{
+    Capabilities agreed;
+    int extended = frame->C == C_SETX &&
+                   cap_decode(frame->payload, frame->payloadLen, BUF_SIZE, &agreed) == 0;
+    if (extended)
     {
-         if (g_timed_out)
-        {
-            alarm(0);
-            return 0;
-        }
+        Capabilities local;
+        local_capabilities(&local);
+        cap_intersect(&local, &agreed, &agreed);
+        // Tell a transmitter that lacks the CRC-32 the payload it may use
+        agreed.maxPayload = agreed_payload(&agreed);
+    }
+    else
+        cap_classic(&agreed, BUF_SIZE);
 
-        unsigned char b = 0;
-        int received = read_byte_with_timeout(&b, timeout_s);
-        if (received == 0)
-        {
-            alarm(0);
-            return 0;
-        }
-        if (received < 0)
-        {
-            alarm(0);
-            return -1;
-        }
+    printf("[RX] %s received. Sending %s\n", extended ? "SETX" : "SET", extended ? "UAX" : "UA");
+    if (send_ua(extended ? &agreed : NULL) < 0)
+    {
+        perror("[RX] UA not sent");
+        return -1;
+    }
+    return engine_apply(&agreed);
+}
 
-        switch (st)
-        {
-        case ST_START:
-            if (b == FLAG)
-                st = ST_FLAG_RCV;
-            break;
+// Largest payload the agreed capabilities allow. BCC2 misses any even
+// number of flips in a bit column, too likely in a long frame, so payloads
+// above the classic size need the CRC-32.
+static int agreed_payload(const Capabilities *agreed)
+{
+    int maxPayload = agreed->maxPayload < LL_JUMBO_PAYLOAD_SIZE ? agreed->maxPayload : LL_JUMBO_PAYLOAD_SIZE;
+    if (!(agreed->check & CHECK_CRC32) && maxPayload > MAX_PAYLOAD_SIZE)
+        return MAX_PAYLOAD_SIZE;
+    return maxPayload;
+}
 
-        case ST_FLAG_RCV:
-            if (b == FLAG)
-            {
-            }
-            else if (b == A_3)
-            {
-                A = b;
-                st = ST_A_RCV;
-            }
-            else
-                st = ST_START;
-            break;
+// Return 0, or -1 if the buffers for the agreed payload cannot be allocated.
+static int engine_apply(const Capabilities *agreed)
+{
+    int crc = (agreed->check & CHECK_CRC32) != 0;
+    int maxPayload = agreed_payload(agreed);
+    if (engine_reserve(maxPayload + (crc ? CRC32_SIZE : 0)) < 0)
+    {
+        fprintf(stderr, "[LL] Out of memory for %d-byte payloads\n", maxPayload);
+        return -1;
+    }
+    g_eng.window = agreed->window;
+    g_eng.mod8 = g_eng.window > 1;
+    g_eng.mask = g_eng.mod8 ? 0x07 : 0x01;
+    g_eng.maxPayload = maxPayload;
+    g_eng.crc = crc;
+    g_eng.framing = (agreed->framing & FRAMING_COBS) ? FramingCobs : FramingPpp;
+    g_eng.lengthPrefix = (agreed->framing & FRAMING_LEN) != 0;
+    g_eng.ackEvery = (g_eng.mod8 && (agreed->ack & ACK_DELAYED)) ? ACK_EVERY : 1;
+    g_eng.ackDelayMs = agreed->timerMs > ACK_DELAY_MS ? agreed->timerMs : ACK_DELAY_MS;
+    deframer_set_framing(&g_eng.deframer, g_eng.framing);
+    g_metrics->window = g_eng.window;
+    TRACE(TraceOpen, g_ll.role == LlRx, g_eng.window,
+          (g_eng.framing == FramingCobs) | (g_eng.lengthPrefix << 1) | ((g_eng.ackEvery > 1) << 2));
+    printf("[LL] Window %d, payload %d, %s%s framing, %s acknowledgements, %s check\n",
+               g_eng.window, g_eng.maxPayload, g_eng.framing == FramingCobs ? "COBS" : "PPP",
+               g_eng.lengthPrefix ? " length-prefixed" : "",
+               g_eng.ackEvery > 1 ? "cumulative" : "per-frame", g_eng.crc ? "CRC-32" : "BCC2");
+    return 0;
+}
 
-        case ST_A_RCV:
-            if (b == FLAG)
-                st = ST_FLAG_RCV;
-            else
-            {
-                C = b;
-                st = ST_C_RCV;
-            }
-            break;
+// Send SETX or SET and wait up to timeout_ms for the matching UAX or UA,
+// then use what both ends settled on.
+// Return 1 when established, 0 on timeout or -1 on error.
+static int establish(int extended, int attempt, int timeout_ms)
+{
+    const char *set = extended ? "SETX" : "SET";
+    const char *ua = extended ? "UAX" : "UA";
+    if (send_set(extended) < 0)
+    {
+        perror("[TX] SET not sent");
+        return -1;
+    }
+    printf("[TX] %s sent (try %d/%d), waiting %s (%dms)\n",
+           set, attempt, g_ll.nRetransmissions, ua, timeout_ms);
+
+    struct timespec since;
+    clock_gettime(CLOCK_MONOTONIC, &since);
+    long remaining_ms;
+    while ((remaining_ms = timeout_ms - elapsed_ms(&since)) > 0)
+    {
+        Frame frame;
+        int received = wait_control_frame(A_3, FrameUA, (int)remaining_ms, &frame);
+        if (received <= 0)
+            return received;
 
-        case ST_C_RCV:
+        // Only the answer to this SET tells what the receiver settled on
+        Capabilities agreed;
+        if (frame.C != (extended ? C_UAX : C_UA))
         {
-            unsigned char bcc_ok = (unsigned char)(A ^ C);
-            if (b == FLAG)
-                st = ST_FLAG_RCV;
-            else if (b == bcc_ok)
-                st = ST_BCC_OK;
-            else
-                st = ST_START;
+            printf("[TX] Answer to an earlier SET, ignored\n");
+            continue;
         }
-        break;
-
-        case ST_BCC_OK:
-            if (b == FLAG)
-            {
-                alarm(0);
-
-                if (C == C_RR(0) || C == C_RR(1))
-                {
-                    unsigned char r = (C == C_RR(0)) ? 0 : 1;
-                    if (r == ((ns ^ 1) & 0x01))
-                        return 1;
-                    else
-                        return -4;
-                }
-                else if (C == C_REJ(0) || C == C_REJ(1))
-                {
-                    unsigned char rejNs = (C == C_REJ(0)) ? 0 : 1;
-                    if (rejNs == ns)
-                        return 0;
-                    else
-                        return -5;
-                }
-                else
-                {
-                    return -6;
-                }
-            }
-            else
-            {
-                st = ST_START;
-            }
-            break;
+        if (!extended)
+            cap_classic(&agreed, BUF_SIZE);
+        else if (cap_decode(frame.payload, frame.payloadLen, BUF_SIZE, &agreed) < 0)
+        {
+            printf("[TX] Malformed UAX, ignored\n");
+            continue;
         }
+        else
+        {
+            Capabilities local;
+            local_capabilities(&local);
+            cap_intersect(&local, &agreed, &agreed);
+        }
+        printf("[TX] %s recieved\n", ua);
+        return engine_apply(&agreed) < 0 ? -1 : 1;
     }
+    printf("[TX] Timeout waiting %s\n", ua);
+    return 0;
+}
+
+static void print_statistics(void)
+{
+    const LinkMetrics *m = g_metrics;
+    if (g_ll.role == LlTx)
+        printf("[LL] %llu I-frames sent (%llu resent), %llu bytes acknowledged, %llu REJ, "
+               "%llu timeouts, %llu link downs, RTT %.1f ms\n",
+               (unsigned long long)m->framesSent, (unsigned long long)m->framesResent,
+               (unsigned long long)m->bytesAcked, (unsigned long long)m->rejReceived,
+               (unsigned long long)m->timeouts, (unsigned long long)m->linkDowns, m->srttUs / 1000.0);
+    else
+        printf("[LL] %llu I-frames received (%llu bytes), %llu damaged frames, %llu REJ sent\n",
+               (unsigned long long)m->framesReceived, (unsigned long long)m->bytesReceived,
+               (unsigned long long)m->framesDamaged, (unsigned long long)m->rejSent);
 }
 
-static int read_byte_with_timeout(unsigned char *b, int timeout_s)
+// Wait for a valid frame with the given A and type, discarding anything
+// else, and store it in frame (valid until the next frame is parsed).
+// Return 1 when received, 0 on timeout or -1 on error.
+static int wait_control_frame(unsigned char A, FrameType type, int timeout_ms, Frame *frame)
 {
-    g_timed_out = 0;
-    set_alarm_handler();
-    alarm(timeout_s);
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
 
     while (TRUE)
     {
-        if (g_timed_out)
+        while (g_eng.inPos < g_eng.inLen)
         {
-            alarm(0);
-            return 0;
+            int used;
+            int got = deframer_feed(&g_eng.deframer, &g_eng.in[g_eng.inPos],
+                                    g_eng.inLen - g_eng.inPos, &used, frame);
+            g_eng.inPos += used;
+            if (got && frame->status == FrameOk && frame->A == A && frame->type == type)
+                return 1;
         }
 
-        int received = readByteSerialPort(b);
-        if (received < 0)
-        {
-            alarm(0);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining_ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+                            (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (remaining_ms <= 0)
+            return 0;
+        if (engine_fill((int)remaining_ms) < 0)
             return -1;
-        }
-        if (received == 0)
-        {
-            continue;
-        }
-        alarm(0);
-        return 1;
     }
+}
+
+// Computations llread()
+
+static int send_supervision(unsigned char A, unsigned char C)
+{
+    TRACE(TraceSTx, C, A, 0);
+    unsigned char out[SUPERVISION_FRAME_SIZE];
+    int nbytes = writeBytesSerialPort(out, build_supervision_frame(out, A, C));
+    if (nbytes == SUPERVISION_FRAME_SIZE)
+        return 0;
     return -1;
 }
 
-static void set_alarm_handler(void) {
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = alarm_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGALRM, &sa, NULL);
+static int send_rr(unsigned char r)
+{
+    return send_supervision(A_3, g_eng.mod8 ? C_RRW(r) : C_RR(r));
+}
+
+static int send_rej(unsigned char r)
+{
+    return send_supervision(A_3, g_eng.mod8 ? C_REJW(r) : C_REJ(r));
 }
 
-static void alarm_handler(int sig)
+// Poll (transmitter) or answer to a poll (receiver)
+static int send_poll(unsigned char A, unsigned char r)
 {
-    (void)sig;
-    g_timed_out = 1;
+    return send_supervision(A, g_eng.mod8 ? C_RRW_PF(r) : C_RR_PF(r));
 }
 
-static unsigned char compute_bcc2(const unsigned char *data, int len)
+// Event-driven engine
+static int engine_open(int fd)
 {
-    unsigned char bcc2 = 0x00;
-    for (size_t i = 0; i < len; i++)
+    engine_close();
+    g_eng.fd = fd;
+    g_eng.epfd = epoll_create1(0);
+    g_eng.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (g_eng.epfd < 0 || g_eng.tfd < 0 || engine_reserve(BUF_SIZE) < 0)
+    {
+        perror("[LL] engine_open");
+        engine_close();
+        return -1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.fd = fd;
+    if (epoll_ctl(g_eng.epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        perror("[LL] epoll_ctl");
+        engine_close();
+        return -1;
+    }
+    ev.data.fd = g_eng.tfd;
+    if (epoll_ctl(g_eng.epfd, EPOLL_CTL_ADD, g_eng.tfd, &ev) < 0)
     {
-        bcc2 ^= data[i];
+        perror("[LL] epoll_ctl");
+        engine_close();
+        return -1;
     }
-    return bcc2;
+    return 0;
 }
 
-static int stuff_ppp(const unsigned char *in, int inLen, unsigned char *out, int outMax)
+// Size the transmit slots and the receive buffers for payloads of up to
+// maxPayload bytes, CRC-32 included. They share one allocation, kept while
+// the size does not change, and the deframer restarts on the new buffers.
+// Return 0, or -1 if out of memory or a receive buffer is lent (the old
+// buffers stay).
+static int engine_reserve(int maxPayload)
 {
-    int j = 0;
-    for (int i = 0; i < inLen; i++)
+    if (g_eng.pool != NULL && g_eng.poolPayload == maxPayload)
+        return 0;
+    if (engine_lent() > 0)
+        return -1;
+    // Only the transmitter queues frames, only the receiver lends payloads
+    int slots = (g_ll.role == LlTx) ? LL_TXQ_SLOTS : 0;
+    int rxCount = (g_ll.role == LlRx) ? LL_RX_VIEWS + 1 : 1;
+    size_t slotSize = (size_t)maxPayload + FRAME_SIZE(maxPayload);
+    size_t rxSize = DEFRAMER_BUF_SIZE(maxPayload + 1);
+    unsigned char *pool = malloc(slots * slotSize + rxCount * rxSize);
+    if (pool == NULL)
+        return -1;
+    free(g_eng.pool);
+    g_eng.pool = pool;
+    g_eng.poolPayload = maxPayload;
+    for (int i = 0; i < slots; ++i)
     {
-        unsigned char d = in[i];
-        if (d == FLAG || d == ESC)
-        {
-            if (j + 2 > outMax)
-                return -1;
-            out[j++] = ESC;
-            out[j++] = (unsigned char)(d ^ ESC_XOR);
-        }
-        else
+        g_eng.txq[i].payload = pool + i * slotSize;
+        g_eng.txq[i].frame = g_eng.txq[i].payload + maxPayload;
+    }
+    g_eng.rxCount = rxCount;
+    g_eng.rxSize = rxSize;
+    for (int i = 0; i < rxCount; ++i)
+    {
+        g_eng.rxBufs[i] = pool + slots * slotSize + i * rxSize;
+        g_eng.rxLent[i] = 0;
+    }
+    g_eng.rx = g_eng.rxBufs[0];
+    deframer_init(&g_eng.deframer, g_eng.rx, maxPayload + 1);
+    return 0;
+}
+
+// Number of receive buffers lent by llreadview().
+static int engine_lent(void)
+{
+    int lent = 0;
+    for (int i = 0; i < g_eng.rxCount; ++i)
+        lent += __atomic_load_n(&g_eng.rxLent[i], __ATOMIC_ACQUIRE);
+    return lent;
+}
+
+// Lend the buffer holding data, the payload just decoded, and decode the
+// next frames into a free one. llreadview() keeps one free at all times.
+static const unsigned char *engine_lend(const unsigned char *data)
+{
+    for (int i = 0; i < g_eng.rxCount; ++i)
+    {
+        if (g_eng.rxBufs[i] == g_eng.rx)
+            __atomic_store_n(&g_eng.rxLent[i], 1, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < g_eng.rxCount; ++i)
+    {
+        if (!__atomic_load_n(&g_eng.rxLent[i], __ATOMIC_ACQUIRE))
         {
-            if (j + 1 > outMax)
-                return -1;
-            out[j++] = d;
+            g_eng.rx = g_eng.rxBufs[i];
+            deframer_set_buffer(&g_eng.deframer, g_eng.rx);
+            break;
         }
     }
-    return j;
+    return data;
 }
 
-static int build_i_frame(unsigned char *out, int outMax,
-                         const unsigned char *payload, int payloadLen,
-                         unsigned char ns)
+static void engine_close(void)
 {
-    if (payloadLen < 0 || payloadLen > BUF_SIZE)
-        return -1;
+    if (g_eng.epfd >= 0)
+        close(g_eng.epfd);
+    if (g_eng.tfd >= 0)
+        close(g_eng.tfd);
+    free(g_eng.pool);
+    LlEventCallback callback = g_eng.callback;
+    void *user = g_eng.user;
+    memset(&g_eng, 0, sizeof(g_eng));
+    g_eng.fd = g_eng.epfd = g_eng.tfd = -1;
+    g_eng.pollEnd = -1;
+    g_eng.mask = 0x01;
+    g_eng.callback = callback;
+    g_eng.user = user;
+}
 
-    const unsigned char A = A_1;
-    const unsigned char C = C_I(ns);
-    const unsigned char BCC1 = (unsigned char)(A ^ C);
+// Read whatever the serial port has into in[] once it is fully parsed,
+// waiting up to timeout_ms for the first byte.
+// Return the number of bytes read, 0 if none or -1 on error.
+static int engine_fill(int timeout_ms)
+{
+    if (g_eng.inPos < g_eng.inLen)
+        return 0;
+    struct pollfd pfd = {.fd = g_eng.fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready <= 0)
+        return (ready < 0 && errno != EINTR) ? -1 : 0;
+    int n = read(g_eng.fd, g_eng.in, sizeof(g_eng.in));
+    if (n < 0)
+        return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+    g_eng.inPos = 0;
+    g_eng.inLen = n;
+    return n;
+}
 
-    unsigned char bcc2 = compute_bcc2(payload, payloadLen);
-    unsigned char tmp[BUF_SIZE + 1];
-    for (int i = 0; i < payloadLen; ++i)
-        tmp[i] = payload[i];
-    tmp[payloadLen] = bcc2;
+// Wait until llprocess() has work. Return 1 when ready, 0 on timeout, -1 on error.
+static int engine_wait(int timeout_ms)
+{
+    if (g_eng.inPos < g_eng.inLen)
+        return 1;
+    struct pollfd pfd = {.fd = g_eng.epfd, .events = POLLIN};
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0 && errno == EINTR)
+        return 1;
+    return ready;
+}
 
-    unsigned char stuffed[(BUF_SIZE + 1) * 2];
-    int sLen = stuff_ppp(tmp, payloadLen + 1, stuffed, sizeof(stuffed));
-    if (sLen < 0)
+static void engine_emit(LlEventType type, int id, const unsigned char *data, int len)
+{
+    if (type == LlReceived && g_eng.readView != NULL && g_eng.readLen < 0)
+    {
+        // An empty payload has nothing to lend
+        *g_eng.readView = len > 0 ? engine_lend(data) : NULL;
+        g_eng.readLen = len;
+    }
+    if (g_eng.callback != NULL)
+    {
+        LlEvent ev = {.type = type, .id = id, .data = data, .len = len};
+        g_eng.callback(&ev, g_eng.user);
+    }
+}
+
+// Arm the timer, or disarm it when timeout_ms is 0.
+static void engine_arm_timer(int timeout_ms)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+    timerfd_settime(g_eng.tfd, 0, &its, NULL);
+}
+
+// Send queued frames while the window has room.
+static int engine_pump(void)
+{
+    while (!g_eng.linkDown && g_eng.txSent < g_eng.txCount &&
+           g_eng.txSent < g_eng.window)
+    {
+        if (engine_transmit_next() < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int engine_transmit_next(void)
+{
+    TxSlot *slot = &g_eng.txq[(g_eng.txHead + g_eng.txSent) % LL_TXQ_SLOTS];
+    // Frames resent behind the oldest one were not necessarily lost: only
+    // count them against nRetransmissions once they are the oldest.
+    if (slot->attempt == 0 || g_eng.txSent == 0)
+        slot->attempt++;
+    int sent = writeBytesSerialPort(slot->frame, slot->frameLen);
+    if (sent != slot->frameLen)
+    {
+        perror("[TX] write I frame");
         return -1;
+    }
+    TRACE(TraceITx, (g_ns + g_eng.txSent) & g_eng.mask, slot->attempt, slot->frameLen);
+    g_metrics->framesSent++;
+    if (slot->sends++ == 0)
+        clock_gettime(CLOCK_MONOTONIC, &slot->firstSent);
+    else
+        g_metrics->framesResent++;
+    // The timer runs for the oldest unacknowledged frame
+    if (g_eng.txSent++ == 0)
+    {
+        g_eng.pollEnd = -1;
+        engine_arm_timer(g_ll.timeout * 1000);
+    }
+    g_metrics->inFlight = g_eng.txSent;
+    return 0;
+}
 
-    int needed = 1 + 1 + 1 + 1 + sLen + 1;
-    if (needed > outMax)
+// Complete every sent frame before nr. Return how many were acknowledged,
+// or -1 if nr is outside the window.
+static int engine_acknowledge(unsigned char nr)
+{
+    int n = (nr - g_ns) & g_eng.mask;
+    if (n > g_eng.txSent)
         return -1;
+    for (int i = 0; i < n; ++i)
+    {
+        TxSlot *slot = &g_eng.txq[g_eng.txHead];
+        // Only frames sent once give an unambiguous sample
+        if (slot->sends == 1)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t us = (now.tv_sec - slot->firstSent.tv_sec) * 1000000LL +
+                         (now.tv_nsec - slot->firstSent.tv_nsec) / 1000;
+            int64_t srtt = (int64_t)g_metrics->srttUs;
+            g_metrics->srttUs = (uint64_t)(srtt == 0 ? us : srtt + (us - srtt) / 8);
+        }
+        g_metrics->bytesAcked += slot->payloadLen;
+        engine_complete_head(LlSent);
+    }
+    if (n > 0)
+    {
+        TRACE(TraceAck, nr, n, 0);
+        g_ns = nr;
+        if (g_eng.txSent > 0)
+            engine_arm_timer(g_ll.timeout * 1000);
+        else if (!g_eng.linkDown)
+            engine_arm_timer(KEEPALIVE_MS);
+    }
+    return n;
+}
 
-    int k = 0;
-    out[k++] = FLAG;
-    out[k++] = A;
-    out[k++] = C;
-    out[k++] = BCC1;
-    for (int i = 0; i < sLen; ++i)
-        out[k++] = stuffed[i];
-    out[k++] = FLAG;
+// The receiver wants everything from the oldest unacknowledged frame again.
+static void engine_go_back(void)
+{
+    TRACE(TraceGoBack, g_ns, g_eng.txq[g_eng.txHead].attempt, 0);
+    if (g_eng.txq[g_eng.txHead].attempt >= g_ll.nRetransmissions)
+    {
+        fprintf(stderr, "[TX] Fail: exceeded retransmissions.\n");
+        engine_fail_queue();
+        return;
+    }
+    g_eng.txSent = 0;
+    (void)engine_pump();
+}
 
-    return k;
+static void engine_complete_head(LlEventType type)
+{
+    TxSlot *slot = &g_eng.txq[g_eng.txHead];
+    g_eng.txHead = (g_eng.txHead + 1) % LL_TXQ_SLOTS;
+    g_eng.txCount--;
+    if (g_eng.txSent > 0)
+        g_eng.txSent--;
+    g_metrics->inFlight = g_eng.txSent;
+    engine_emit(type, slot->id, slot->payload, slot->payloadLen);
 }
 
-// Computations llread()
+// Drop everything still queued.
+static void engine_fail_queue(void)
+{
+    TRACE(TraceFail, 0, g_eng.txCount, 0);
+    g_eng.failed = TRUE;
+    g_eng.txSent = 0;
+    while (g_eng.txCount > 0)
+        engine_complete_head(LlFailed);
+    engine_arm_timer(g_eng.linkDown ? 0 : KEEPALIVE_MS);
+}
 
-static int send_rr(unsigned char r)
+static void engine_on_timeout(void)
 {
-    unsigned char out[BUF_SIZE];
-    const unsigned char A = A_3;
-    const unsigned char C = C_RR(r);
-    const unsigned char BCC1 = (unsigned char)(A ^ C);
-
-    out[0] = FLAG;
-    out[1] = A;
-    out[2] = C;
-    out[3] = BCC1;
-    out[4] = FLAG;
-    int nbytes = writeBytesSerialPort(out, 5);
-    if (nbytes == 5)
-        return 0;
-    return -1;
+    if (g_ll.role == LlRx)
+    {
+        // Delayed acknowledgement is due
+        TRACE(TraceTimer, TimerAck, 0, 0);
+        if (g_eng.unacked > 0)
+            engine_send_ack();
+    }
+    else if (g_eng.linkDown)
+    {
+        TRACE(TraceTimer, TimerProbe, 0, 0);
+        engine_probe();
+    }
+    else if (g_eng.txSent > 0)
+    {
+        // Probe with cheap polls instead of resending whole frames; the
+        // answer tells which frames or only which RRs were lost.
+        TRACE(TraceTimer, TimerRetransmit, 0, 0);
+        g_metrics->timeouts++;
+        printf("[TX] Timeout waiting RR/REJ.\n");
+        engine_link_down();
+    }
+    else if (g_eng.pollPending)
+    {
+        TRACE(TraceTimer, TimerKeepalive, 0, 0);
+        engine_link_down();
+    }
+    else
+    {
+        TRACE(TraceTimer, TimerKeepalive, 0, 0);
+        // Idle and silent: check the peer is still there
+        if (send_poll(A_1, g_ns) == 0)
+            g_eng.pollPending = TRUE;
+        engine_arm_timer(KEEPALIVE_MS);
+    }
 }
 
-static int send_rej(unsigned char r)
+static void engine_link_down(void)
 {
-    unsigned char out[BUF_SIZE];
-    const unsigned char A = A_3;
-    const unsigned char C = C_REJ(r);
-    const unsigned char BCC1 = (unsigned char)(A ^ C);
-
-    out[0] = FLAG;
-    out[1] = A;
-    out[2] = C;
-    out[3] = BCC1;
-    out[4] = FLAG;
-    int nbytes = writeBytesSerialPort(out, 5);
-    if (nbytes == 5)
-        return 0;
-    return -1;
+    TRACE(TraceLinkDown, 0, 0, 0);
+    g_metrics->linkDowns++;
+    printf("[LL] Link down, probing\n");
+    g_eng.linkDown = TRUE;
+    g_eng.pollPending = FALSE;
+    g_eng.probeMs = PROBE_MIN_MS;
+    clock_gettime(CLOCK_MONOTONIC, &g_eng.downSince);
+    engine_probe();
 }
 
-static int get_frame(unsigned char *frame, int maxLen, int timeout_s)
+static void engine_link_up(void)
 {
-    int started = 0;
-    int k = 0;
-    unsigned char byte;
+    long downMs = elapsed_ms(&g_eng.downSince);
+    TRACE(TraceLinkUp, 0, 0, downMs);
+    printf("[LL] Link up after %ld ms\n", downMs);
+    g_eng.linkDown = FALSE;
+    engine_arm_timer(g_eng.txSent > 0 ? g_ll.timeout * 1000 : KEEPALIVE_MS);
+}
 
-    while (TRUE)
+// Send one poll while the link is down. Gives up once the link has been
+// down for the rest of the nRetransmissions * timeout budget.
+static void engine_probe(void)
+{
+    if (elapsed_ms(&g_eng.downSince) >= (long)(g_ll.nRetransmissions - 1) * g_ll.timeout * 1000)
     {
-        int read = read_byte_with_timeout(&byte, timeout_s);
-        if (read == 0)
-            return 0;
-        if (read < 0)
-            return -1;
-        if (!started)
-        {
-            if (byte == FLAG)
-            {
-                if (k >= maxLen)
-                    return -1;
-                frame[k++] = FLAG;
-                started = 1;
-            }
-            continue;
-        }
-        if (k == 1 && byte == FLAG)
+        fprintf(stderr, "[LL] Fail: link down for too long.\n");
+        g_eng.linkDown = FALSE;
+        engine_arm_timer(0);
+        engine_fail_queue();
+        return;
+    }
+    if (send_poll(A_1, g_ns) == 0 && g_eng.txSent > 0)
+        g_eng.pollEnd = (g_ns + g_eng.txSent) & g_eng.mask;
+    engine_arm_timer(g_eng.probeMs);
+    g_eng.probeMs = (g_eng.probeMs * 2 > PROBE_MAX_MS) ? PROBE_MAX_MS : g_eng.probeMs * 2;
+}
+
+// Ask the receiver which Ns it expects. The poll follows the sent frames
+// on the wire, so the answer settles which of them arrived.
+static void engine_query(void)
+{
+    if (g_eng.txSent == 0 || g_eng.pollEnd >= 0 || g_eng.linkDown)
+        return;
+    if (send_poll(A_1, g_ns) == 0)
+        g_eng.pollEnd = (g_ns + g_eng.txSent) & g_eng.mask;
+}
+
+static void engine_on_frame(const Frame *frame)
+{
+    if (frame->type == FrameI)
+        TRACE(TraceIRx, frame->seq, frame->status, frame->payloadLen);
+    else
+        TRACE(TraceSRx, frame->C, frame->status, 0);
+    if (frame->status != FrameOk)
+        g_metrics->framesDamaged++;
+    if (frame->status != FrameOk && g_ll.role == LlTx)
+    {
+        // Possibly our RR/REJ, find out instead of waiting for the timeout
+        fprintf(stderr, "[TX] Damaged frame (%d) from receiver\n", frame->status);
+        engine_query();
+        return;
+    }
+    if (frame->status == FrameBadHeader)
+    {
+        if (frame->A != A_1)
         {
-            continue;
+            fprintf(stderr, "[RX] Damaged header, ignored\n");
+            return;
         }
-        if (k >= maxLen)
-            return -1;
-        frame[k++] = byte;
-        if (byte == FLAG && k > 1)
+        // Most likely an I-frame: ask for it now rather than after the timeout
+        engine_reject("Damaged header", -1);
+        return;
+    }
+    if (g_ll.role == LlRx && frame->type == FrameSET && frame->status == FrameOk)
+    {
+        // Our UA was lost and the transmitter is still establishing
+        (void)accept_set(frame);
+        return;
+    }
+    if (g_ll.role == LlRx && frame->A == A_1 && frame->type == FrameRR && frame->pf &&
+        frame->status == FrameOk)
+    {
+        // Poll: answer with the next Ns we expect, acknowledging everything before it
+        if (frame->mod8 != g_eng.mod8)
         {
-            return k;
+            fprintf(stderr, "[RX] Poll in modulo %d numbering, ignored\n", frame->mod8 ? 8 : 2);
+            return;
         }
+        g_eng.unacked = 0;
+        (void)send_poll(A_3, g_ns);
+        return;
     }
+    if (g_ll.role == LlTx && frame->A == A_3 && frame->status == FrameOk)
+        engine_on_supervision(frame);
+    else if (g_ll.role == LlRx && frame->A == A_1 && frame->type == FrameI)
+        engine_on_i_frame(frame);
 }
 
-static int frame_check(const unsigned char *frame, int frameLen)
+static void engine_on_supervision(const Frame *frame)
 {
-    if (frameLen < 5)
+    // Anything valid from the receiver proves the link works
+    int wasDown = g_eng.linkDown;
+    g_eng.pollPending = FALSE;
+    if (wasDown)
+        engine_link_up();
+    else if (g_eng.txSent == 0)
+        engine_arm_timer(KEEPALIVE_MS);
+
+    // Answers in the other numbering predate this connection
+    if (g_eng.txSent == 0 || frame->mod8 != g_eng.mod8)
+        return;
+    if (frame->type != FrameRR && frame->type != FrameREJ)
+        return;
+    int pollEnd = g_eng.pollEnd;
+    if (frame->pf)
+        g_eng.pollEnd = -1;
+    int n = engine_acknowledge(frame->seq);
+    if (n < 0 || g_eng.txSent == 0)
+        return;
+
+    if (frame->type == FrameREJ)
     {
-        fprintf(stderr, "[RX] Frame too short for header\n");
-        return -1;
+        printf("[TX] REJ(r=%u) received. Going back to I(Ns=%u)...\n", frame->seq, g_ns);
+        g_metrics->rejReceived++;
+        engine_go_back();
     }
-    if (frame[0] != FLAG || frame[frameLen - 1] != FLAG)
+    else if ((frame->pf && pollEnd >= 0 && frame->seq != pollEnd) || (wasDown && n == 0))
     {
-        fprintf(stderr, "[RX] Missing frame delimiters\n");
-        return -1;
+        printf("[TX] Receiver still expects Ns=%u. Retransmitting...\n", g_ns);
+        engine_go_back();
     }
-    unsigned char A = frame[1];
-    unsigned char C = frame[2];
-    unsigned char BCC1 = frame[3];
-    if (BCC1 != (unsigned char)(A ^ C))
+    else if (!frame->pf && n == 0)
     {
-        fprintf(stderr, "[RX] BCC1 mismatch \n");
-        return -1;
+        // Answer to a duplicate: only a poll tells whether a frame was lost
+        printf("[TX] Duplicate RR(r=%u). Polling receiver\n", frame->seq);
+        engine_query();
     }
-    if (!(C == C_I(0) || C == C_I(1)))
+}
+
+static void engine_send_ack(void)
+{
+    (void)send_rr(g_ns);
+    g_eng.unacked = 0;
+    engine_arm_timer(0);
+}
+
+// Ask for everything from g_ns again, prompted by I(Ns=seq), or seq -1
+// if its header was damaged. With modulo 8 numbering up to window - 1
+// frames sent behind a lost one arrive out of sequence as well; they are
+// not answered. The frame at g_ns is the retransmission: damaged again,
+// it is rejected again at once.
+static void engine_reject(const char *reason, int seq)
+{
+    if (g_eng.rejHold > 0 && seq != g_ns)
     {
-        fprintf(stderr, "[RX] Not an I-frame \n");
-        return -1;
+        g_eng.rejHold--;
+        TRACE(TraceRej, g_ns, 1, 0);
+        fprintf(stderr, "[RX] %s. REJ(r=%u) already sent\n", reason, g_ns);
+        return;
     }
-    return 0;
+    TRACE(TraceRej, g_ns, 0, 0);
+    g_metrics->rejSent++;
+    (void)send_rej(g_ns);
+    g_eng.rejHold = g_eng.mod8 ? g_eng.window - 1 : 0;
+    g_eng.unacked = 0;
+    engine_arm_timer(0);
+    fprintf(stderr, "[RX] %s. Sent REJ(r=%u)\n", reason, g_ns);
 }
-static int bcc2_check(const unsigned char *stuffed, int stuffedLen, unsigned char *outData, int outMax)
+
+static void engine_on_i_frame(const Frame *frame)
 {
-    if (stuffedLen <= 0)
-        return -1;
-    unsigned char tmp[BUF_SIZE + 1];
-    int unLen = destuff_ppp(stuffed, stuffedLen, tmp, sizeof(tmp));
-    if (unLen < 0)
-        return -2;
-    if (unLen < 1)
-        return -3;
-    unsigned char recv_bcc2 = tmp[unLen - 1];
-    int payloadLen = unLen - 1;
-    unsigned char calc_bcc2 = compute_bcc2(tmp, payloadLen);
-    if (calc_bcc2 != recv_bcc2)
-        return -4;
-    if (payloadLen > outMax)
-        return -5;
-    memcpy(outData, tmp, payloadLen);
-    return payloadLen;
-}
-static int destuff_ppp(const unsigned char *in, int inLen, unsigned char *out, int outMax)
-{
-    int j = 0;
-    for (int i = 0; i < inLen; i++)
-    {
-        unsigned char d = in[i];
-        if (d == ESC)
-        {
-            if (i + 1 >= inLen)
-                return -1;
-            unsigned char y = (unsigned char)(in[i + 1] ^ ESC_XOR);
-            if (j + 1 > outMax)
-                return -1;
-            out[j++] = y;
-            i++;
-        }
-        else
+    // The numbering was agreed in llopen(): Ns in the other one means nothing
+    if (frame->mod8 != g_eng.mod8)
+    {
+        fprintf(stderr, "[RX] I-frame in modulo %d numbering, ignored\n", frame->mod8 ? 8 : 2);
+        return;
+    }
+    if (frame->status == FrameOverflow)
+    {
+        engine_reject("Frame too long, dropped", frame->seq);
+        return;
+    }
+    if (frame->status != FrameOk)
+    {
+        engine_reject("BCC2 error", frame->seq);
+        return;
+    }
+    int payloadLen = frame->payloadLen;
+    if (g_eng.crc)
+    {
+        payloadLen -= CRC32_SIZE;
+        uint32_t crc = 0;
+        for (int i = 0; payloadLen >= 0 && i < CRC32_SIZE; ++i)
+            crc = (crc << 8) | frame->payload[payloadLen + i];
+        if (payloadLen < 0 || crc != compute_crc32(frame->payload, payloadLen))
         {
-            if (j + 1 > outMax)
-                return -1;
-            out[j++] = d;
+            engine_reject("CRC error", frame->seq);
+            return;
         }
     }
-    return j;
+    if (frame->seq == g_ns)
+    {
+        g_ns = (g_ns + 1) & g_eng.mask;
+        g_eng.rejHold = 0;
+        g_metrics->framesReceived++;
+        g_metrics->bytesReceived += payloadLen;
+        // Acknowledge every ACK_EVERY frames or after ACK_DELAY_MS of silence
+        if (++g_eng.unacked >= (g_eng.mod8 ? g_eng.ackEvery : 1))
+            engine_send_ack();
+        else if (g_eng.unacked == 1)
+            engine_arm_timer(g_eng.ackDelayMs);
+        engine_emit(LlReceived, -1, frame->payload, payloadLen);
+        return;
+    }
+    if (g_eng.mod8 && ((frame->seq - g_ns) & g_eng.mask) < g_eng.window)
+    {
+        // Ahead of g_ns, within the window: a frame in between was lost
+        engine_reject("Out of sequence", frame->seq);
+        return;
+    }
+    engine_send_ack();
+    fprintf(stderr, "[RX] Duplicate I(Ns=%u). Sent RR(r=%u). Payload dropped.\n", frame->seq, g_ns);
 }
@@ -32,16 +32,124 @@ typedef struct
 // Return 0 on success or -1 on error.
 int llopen(LinkLayer connectionParameters);
 
-// Send data in buf with size bufSize.
-// Return number of chars written, or -1 on error.
+// Queue data in buf with size bufSize for sending and return without
+// waiting for the acknowledgement. Return number of chars queued, or -1 on
+// error, including a buffer dropped earlier; a buffer dropped after the
+// last llwrite() fails llflush() or llclose().
 int llwrite(const unsigned char *buf, int bufSize);
 
-// Receive data in packet.
+// Receive data in packet, which holds MAX_PAYLOAD_SIZE bytes, or
+// llmaxpayload() bytes if llsetmaxpayload() raised the offer before llopen().
 // Return number of chars read, or -1 on error.
 int llread(unsigned char *packet);
 
 // Close previously opened connection and print transmission statistics in the console.
-// Return 0 on success or -1 on error.
+// A transmitter first waits for its queued buffers to be acknowledged.
+// Return 0 on success or -1 on error, or if any buffer was dropped.
 int llclose();
 
+////////////////////////////////////////////////
+// Event-driven interface
+////////////////////////////////////////////////
+// llwrite() and llread() are built on top of these calls; do not mix the
+// blocking and the event-driven calls while a buffer is still queued.
+// llwrite() returns as soon as the buffer is queued: LlSent reports when
+// it was acknowledged.
+
+typedef enum
+{
+    LlSent,     // A submitted buffer was acknowledged by the receiver.
+    LlReceived, // A new payload arrived (data is only valid during the callback).
+    LlFailed,   // A submitted buffer was dropped after nRetransmissions.
+} LlEventType;
+
+typedef struct
+{
+    LlEventType type;
+    int id;                    // Value returned by llsubmit() (LlSent / LlFailed).
+    const unsigned char *data; // Payload (LlReceived) or a copy of the submitted buffer.
+    int len;
+} LlEvent;
+
+typedef void (*LlEventCallback)(const LlEvent *event, void *user);
+
+// Size of the transmit queue used by llsubmit().
+#define LL_TXQ_SLOTS 8
+
+// Return a descriptor that becomes readable whenever llprocess() has work
+// to do (received bytes or an expired retransmission timer), or -1 if the
+// link is not open. It can be added to the caller's own poll/epoll set.
+int llfd();
+
+// Register the function called for every link event. Pass NULL to disable.
+void llsetcallback(LlEventCallback callback, void *user);
+
+// Copy buf into the transmit queue without waiting for the receiver.
+// Return a non-negative id reported back in LlSent / LlFailed, or -1 if the
+// queue is full or bufSize is invalid.
+int llsubmit(const unsigned char *buf, int bufSize);
+
+// Number of submitted buffers not yet acknowledged.
+int llpending();
+
+// Wait until every submitted buffer was acknowledged or dropped.
+// Return 0 if none was ever dropped since llopen(), or -1 otherwise.
+int llflush();
+
+// Advance the link state machine without blocking: consume received bytes,
+// handle expired timers and transmit queued frames. Events are delivered
+// through the registered callback.
+// Return 0 on success or -1 on a fatal serial port error.
+int llprocess();
+
+////////////////////////////////////////////////
+// Zero-copy receive
+////////////////////////////////////////////////
+
+// Payloads llreadview() can lend at once.
+#define LL_RX_VIEWS 32
+
+// Like llread(), but data receives a pointer to the payload in the receive
+// buffer it was decoded into instead of a copy. The buffer is lent to the
+// caller until llrelease(data); at most LL_RX_VIEWS can be held at once.
+// Return the payload length, 0 on timeout (data is NULL) or -1 on error.
+int llreadview(const unsigned char **data);
+
+// Give back the receive buffer of a payload returned by llreadview().
+// Safe to call from any thread.
+void llrelease(const unsigned char *data);
+
+////////////////////////////////////////////////
+// Options
+////////////////////////////////////////////////
+// Set before llopen(). Both ends offer their options in the SETX / UAX
+// handshake and use what both support; against a peer that only knows
+// SET / UA they fall back to the classic protocol.
+
+typedef enum
+{
+    LlFramingPpp,  // 0x7E / 0x7D escaped, up to twice the payload size (default)
+    LlFramingCobs, // Consistent Overhead Byte Stuffing, at most 1 byte per 254
+} LlFraming;
+
+// Select how the next llopen() offers to encode I-frames. COBS is used
+// only if the peer offers it as well.
+void llsetframing(LlFraming framing);
+
+// Largest payload a link can settle on.
+#define LL_JUMBO_PAYLOAD_SIZE 65535
+
+// Offer payloads of up to size bytes (MAX_PAYLOAD_SIZE to
+// LL_JUMBO_PAYLOAD_SIZE) in the next llopen(). The link uses the smaller
+// of both offers, further limited so that a window of frames is on the
+// wire for at most half the timeout at the chosen baud rate. Payloads above
+// MAX_PAYLOAD_SIZE are only used if both ends also agree on a CRC-32.
+void llsetmaxpayload(int size);
+
+// Largest buffer llwrite() and llsubmit() accept on the open link, and the
+// largest payload llread() and llreadview() return. MAX_PAYLOAD_SIZE unless
+// both ends offered more, which a caller that never calls llsetmaxpayload()
+// does not: its llread() buffers keep their MAX_PAYLOAD_SIZE.
+int llmaxpayload();
+
 #endif // _LINK_LAYER_H_
@@ -6,20 +6,24 @@
 #include <string.h>
 
 #include "application_layer.h"
+#include "link_layer.h"
 
 #define N_TRIES 3
 #define TIMEOUT 4
 
 // Arguments:
-//   $1: /dev/ttySxx
+//   $1: /dev/ttySxx, or several separated by commas to stripe the
+//       transfer across them (e.g. /dev/ttyS10,/dev/ttyS12)
 //   $2: baud rate
 //   $3: tx | rx
-//   $4: filename
+//   $4: filename (tx: a file, a directory or @manifest; rx: output file
+//       or, for a multi-file session, output directory)
+//   $5: optional framing, ppp (default) or cobs
 int main(int argc, char *argv[])
 {
     if (argc < 5)
     {
-        printf("Usage: %s /dev/ttySxx baudrate tx|rx filename\n", argv[0]);
+        printf("Usage: %s /dev/ttySxx[,/dev/ttySyy...] baudrate tx|rx filename [ppp|cobs]\n", argv[0]);
         exit(1);
     }
 
@@ -27,6 +31,7 @@ int main(int argc, char *argv[])
     const int baudrate = atoi(argv[2]);
     const char *role = argv[3];
     const char *filename = argv[4];
+    const char *framing = (argc > 5) ? argv[5] : "ppp";
 
     // Validate baud rate
     switch (baudrate)
@@ -40,9 +45,12 @@ int main(int argc, char *argv[])
     case 38400:
     case 57600:
     case 115200:
+    case 230400:
+    case 460800:
+    case 921600:
         break;
     default:
-        printf("Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200)\n");
+        printf("Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600)\n");
         exit(2);
     }
 
@@ -53,19 +61,32 @@ int main(int argc, char *argv[])
         exit(3);
     }
 
+    // Validate framing
+    if (strcmp("ppp", framing) == 0)
+        llsetframing(LlFramingPpp);
+    else if (strcmp("cobs", framing) == 0)
+        llsetframing(LlFramingCobs);
+    else
+    {
+        printf("ERROR: Framing must be \"ppp\" or \"cobs\"\n");
+        exit(4);
+    }
+
     printf("Starting link-layer protocol application\n"
            "  - Serial port: %s\n"
            "  - Role: %s\n"
            "  - Baudrate: %d\n"
            "  - Number of tries: %d\n"
            "  - Timeout: %d\n"
-           "  - Filename: %s\n",
+           "  - Filename: %s\n"
+           "  - Framing: %s\n",
            serialPort,
            role,
            baudrate,
            N_TRIES,
            TIMEOUT,
-           filename);
+           filename,
+           framing);
 
     applicationLayer(serialPort, role, baudrate, N_TRIES, TIMEOUT, filename);
 
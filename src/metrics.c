@@ -0,0 +1,67 @@
+// Live link and transfer metrics
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static LinkMetrics g_private;
+LinkMetrics *g_metrics = &g_private;
+
+static char g_name[64];
+
+void metrics_name(const char *port, char *name, int size)
+{
+    const char *base = strrchr(port, '/');
+    snprintf(name, size, "%s%s", METRICS_PREFIX, base != NULL ? base + 1 : port);
+}
+
+void metrics_open(const char *port, int role)
+{
+    metrics_close();
+    g_metrics = &g_private;
+    metrics_name(port, g_name, sizeof(g_name));
+    int fd = shm_open(g_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && ftruncate(fd, sizeof(LinkMetrics)) == 0)
+    {
+        void *map = mmap(NULL, sizeof(LinkMetrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED)
+            g_metrics = map;
+    }
+    if (fd >= 0)
+        close(fd);
+    if (g_metrics == &g_private)
+    {
+        perror("[LL] metrics");
+        if (fd >= 0)
+            shm_unlink(g_name);
+        g_name[0] = '\0';
+    }
+
+    // magic last, so a reader never takes a half-initialised segment
+    memset(g_metrics, 0, sizeof(LinkMetrics));
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    g_metrics->pid = (uint32_t)getpid();
+    g_metrics->role = (uint32_t)role;
+    g_metrics->startNs = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+    __atomic_store_n(&g_metrics->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+}
+
+void metrics_close(void)
+{
+    if (g_metrics == &g_private)
+        return;
+    g_metrics->closed = 1;
+    // Keep the final values readable in private memory
+    g_private = *g_metrics;
+    munmap(g_metrics, sizeof(LinkMetrics));
+    shm_unlink(g_name);
+    g_metrics = &g_private;
+}
@@ -0,0 +1,58 @@
+// Live link and transfer metrics header.
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+// While a link is open its metrics live in the POSIX shared memory object
+// METRICS_PREFIX<port name> (e.g. /ll-ttyS10), where tools/linkstat.c
+// reads them. Each field has a single writer and is naturally aligned,
+// so readers see whole values without locking.
+#define METRICS_PREFIX "/ll-"
+#define METRICS_MAGIC 0x314D4C4C // "LLM1"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t pid;
+    uint32_t role;   // 0 transmitter, 1 receiver
+    uint32_t closed; // Set by llclose()
+    uint64_t startNs; // CLOCK_MONOTONIC at llopen()
+
+    // Link layer
+    int32_t window;
+    int32_t inFlight;        // I-frames sent and not acknowledged
+    uint64_t framesSent;     // I-frames, retransmissions included
+    uint64_t framesResent;
+    uint64_t framesReceived; // In-sequence I-frames
+    uint64_t framesDamaged;  // Refused by the frame checks
+    uint64_t bytesAcked;     // Payload bytes acknowledged by the receiver
+    uint64_t bytesReceived;  // Payload bytes delivered to the application
+    uint64_t rejSent;
+    uint64_t rejReceived;
+    uint64_t timeouts;
+    uint64_t linkDowns;
+    uint64_t srttUs; // Smoothed round trip time of first transmissions
+
+    // Application layer
+    int64_t transferDone; // File bytes acknowledged / written
+    int64_t transferTotal;
+} LinkMetrics;
+
+// Where the metrics are updated: the shared object while a link is open,
+// private memory otherwise. Never NULL.
+extern LinkMetrics *g_metrics;
+
+// Publish fresh metrics for the link on port. Falls back to private
+// memory (and says so) if the shared object cannot be created.
+void metrics_open(const char *port, int role);
+
+// Mark the metrics closed and remove the shared object. They stay
+// readable through g_metrics until the next metrics_open().
+void metrics_close(void);
+
+// Build the shared memory object name of port into name.
+void metrics_name(const char *port, char *name, int size);
+
+#endif // _METRICS_H_
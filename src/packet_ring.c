@@ -0,0 +1,171 @@
+// Bounded ring of preallocated packet slots
+
+#include "packet_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Called with the lock held. A full pipe already holds wakeups the
+// consumer has not read, so a failed write loses nothing.
+static void ring_notify(PacketRing *ring)
+{
+    if (ring->notifyFd >= 0)
+        (void)write(ring->notifyFd, "", 1);
+}
+
+int ring_init(PacketRing *ring, int nSlots, int slotSize)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->storage = malloc((size_t)nSlots * (size_t)slotSize);
+    ring->lens = calloc((size_t)nSlots, sizeof(int));
+    if (ring->storage == NULL || ring->lens == NULL)
+    {
+        free(ring->storage);
+        free(ring->lens);
+        return -1;
+    }
+    ring->nSlots = nSlots;
+    ring->slotSize = slotSize;
+    ring->notifyFd = -1;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->notEmpty, NULL);
+    pthread_cond_init(&ring->notFull, NULL);
+    return 0;
+}
+
+void ring_destroy(PacketRing *ring)
+{
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->notEmpty);
+    pthread_cond_destroy(&ring->notFull);
+    free(ring->storage);
+    free(ring->lens);
+    ring->storage = NULL;
+    ring->lens = NULL;
+}
+
+unsigned char *ring_acquire(PacketRing *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    while (ring->count == ring->nSlots && !ring->aborted)
+        pthread_cond_wait(&ring->notFull, &ring->lock);
+    unsigned char *slot = NULL;
+    if (!ring->aborted)
+    {
+        int tail = (ring->head + ring->count) % ring->nSlots;
+        slot = ring->storage + (size_t)tail * (size_t)ring->slotSize;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return slot;
+}
+
+void ring_commit(PacketRing *ring, int len)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->lens[(ring->head + ring->count) % ring->nSlots] = len;
+    ring->count++;
+    pthread_cond_signal(&ring->notEmpty);
+    ring_notify(ring);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+unsigned char *ring_peek(PacketRing *ring, int *len)
+{
+    pthread_mutex_lock(&ring->lock);
+    while (ring->count == 0 && !ring->closed && !ring->aborted)
+        pthread_cond_wait(&ring->notEmpty, &ring->lock);
+    unsigned char *slot = NULL;
+    if (ring->count > 0 && !ring->aborted)
+    {
+        slot = ring->storage + (size_t)ring->head * (size_t)ring->slotSize;
+        *len = ring->lens[ring->head];
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return slot;
+}
+
+void ring_release(PacketRing *ring)
+{
+    ring_release_batch(ring, 1);
+}
+
+unsigned char *ring_try_peek(PacketRing *ring, int *len)
+{
+    pthread_mutex_lock(&ring->lock);
+    unsigned char *slot = NULL;
+    if (ring->count > 0 && !ring->aborted)
+    {
+        slot = ring->storage + (size_t)ring->head * (size_t)ring->slotSize;
+        *len = ring->lens[ring->head];
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return slot;
+}
+
+int ring_is_drained(PacketRing *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    int drained = ring->aborted || (ring->closed && ring->count == 0);
+    pthread_mutex_unlock(&ring->lock);
+    return drained;
+}
+
+void ring_set_notify(PacketRing *ring, int fd)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->notifyFd = fd;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+int ring_peek_batch(PacketRing *ring, unsigned char **slots, int *lens, int max)
+{
+    pthread_mutex_lock(&ring->lock);
+    while (ring->count == 0 && !ring->closed && !ring->aborted)
+        pthread_cond_wait(&ring->notEmpty, &ring->lock);
+    int n = 0;
+    while (!ring->aborted && n < ring->count && n < max)
+    {
+        int i = (ring->head + n) % ring->nSlots;
+        slots[n] = ring->storage + (size_t)i * (size_t)ring->slotSize;
+        lens[n++] = ring->lens[i];
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return n;
+}
+
+void ring_release_batch(PacketRing *ring, int n)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->head = (ring->head + n) % ring->nSlots;
+    ring->count -= n;
+    pthread_cond_signal(&ring->notFull);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void ring_close(PacketRing *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->closed = 1;
+    pthread_cond_broadcast(&ring->notEmpty);
+    ring_notify(ring);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void ring_abort(PacketRing *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->aborted = 1;
+    pthread_cond_broadcast(&ring->notEmpty);
+    pthread_cond_broadcast(&ring->notFull);
+    ring_notify(ring);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+int ring_is_aborted(PacketRing *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    int aborted = ring->aborted;
+    pthread_mutex_unlock(&ring->lock);
+    return aborted;
+}
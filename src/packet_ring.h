@@ -0,0 +1,75 @@
+// Bounded ring of preallocated packet slots header.
+
+#ifndef _PACKET_RING_H_
+#define _PACKET_RING_H_
+
+#include <pthread.h>
+
+// Single-producer / single-consumer queue used to connect pipeline stages.
+// Slots are allocated once in ring_init() and handed out in place, so a
+// stage fills or drains a slot without any extra copy.
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    unsigned char *storage;
+    int *lens;
+    int nSlots;
+    int slotSize;
+    int head;
+    int count;
+    int closed;  // Producer finished, consumer drains what is left
+    int aborted; // Pipeline failed, both sides stop immediately
+    int notifyFd; // Written a byte on commit, close and abort, or -1
+} PacketRing;
+
+// Allocate nSlots slots of slotSize bytes each.
+// Return 0 on success or -1 on error.
+int ring_init(PacketRing *ring, int nSlots, int slotSize);
+
+// Release the slots of a ring no stage is using anymore.
+void ring_destroy(PacketRing *ring);
+
+// Producer: wait for a free slot and return it, or NULL if the ring was aborted.
+unsigned char *ring_acquire(PacketRing *ring);
+
+// Producer: publish the slot returned by ring_acquire() holding len bytes.
+void ring_commit(PacketRing *ring, int len);
+
+// Consumer: wait for the oldest filled slot and return it with its length
+// in len, or NULL once the ring is closed and empty or aborted.
+unsigned char *ring_peek(PacketRing *ring, int *len);
+
+// Consumer: give the slot returned by ring_peek() back to the producer.
+void ring_release(PacketRing *ring);
+
+// Consumer: like ring_peek(), but return NULL at once if no slot is filled.
+unsigned char *ring_try_peek(PacketRing *ring, int *len);
+
+// Return TRUE once the ring is closed and empty, or aborted.
+int ring_is_drained(PacketRing *ring);
+
+// Write a byte to fd (non-blocking) whenever a slot is committed or the
+// ring is closed or aborted, so a consumer can wait in poll() alongside
+// other descriptors. Pass -1 to stop.
+void ring_set_notify(PacketRing *ring, int fd);
+
+// Consumer: like ring_peek(), but return up to max filled slots at once,
+// oldest first, in slots and their lengths in lens.
+// Return how many, or 0 once the ring is closed and empty or aborted.
+int ring_peek_batch(PacketRing *ring, unsigned char **slots, int *lens, int max);
+
+// Consumer: give the n oldest slots back to the producer.
+void ring_release_batch(PacketRing *ring, int n);
+
+// Producer: no more slots will be committed.
+void ring_close(PacketRing *ring);
+
+// Either side: stop the pipeline and wake every waiting stage.
+void ring_abort(PacketRing *ring);
+
+// Return TRUE if ring_abort() was called on this ring.
+int ring_is_aborted(PacketRing *ring);
+
+#endif // _PACKET_RING_H_
@@ -58,8 +58,11 @@ int openSerialPort(const char *serialPort, int baudRate)
         CASE_BAUDRATE(38400);
         CASE_BAUDRATE(57600);
         CASE_BAUDRATE(115200);
+        CASE_BAUDRATE(230400);
+        CASE_BAUDRATE(460800);
+        CASE_BAUDRATE(921600);
     default:
-        fprintf(stderr, "Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200)\n");
+        fprintf(stderr, "Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600)\n");
         return -1;
     }
 #undef CASE_BAUDRATE
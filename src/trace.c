@@ -0,0 +1,71 @@
+// Binary event trace of the link layer
+
+#include "trace.h"
+
+#ifdef LL_TRACE
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+TraceRing g_trace;
+
+static char g_path[256];
+
+static void on_sigusr1(int sig)
+{
+    (void)sig;
+    g_trace.dumpRequested = 1;
+}
+
+void trace_open(const char *path)
+{
+    const char *env = getenv("LL_TRACE_FILE");
+    snprintf(g_path, sizeof(g_path), "%s", env != NULL ? env : path);
+    g_trace.next = 0;
+    g_trace.dumpRequested = 0;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+int trace_dump(void)
+{
+    g_trace.dumpRequested = 0;
+    uint32_t count = g_trace.next < TRACE_SLOTS ? g_trace.next : TRACE_SLOTS;
+    uint32_t first = g_trace.next - count;
+
+    TraceHeader header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.eventSize = sizeof(TraceEvent);
+    header.count = count;
+    header.lost = first;
+
+    FILE *file = fopen(g_path, "wb");
+    if (file == NULL)
+    {
+        perror("[LL] trace");
+        return -1;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    // Oldest first: the ring may wrap once
+    uint32_t start = first & (TRACE_SLOTS - 1);
+    uint32_t head = TRACE_SLOTS - start < count ? TRACE_SLOTS - start : count;
+    ok = ok && fwrite(&g_trace.ev[start], sizeof(TraceEvent), head, file) == head;
+    ok = ok && fwrite(&g_trace.ev[0], sizeof(TraceEvent), count - head, file) == count - head;
+    if (fclose(file) != 0 || !ok)
+    {
+        perror("[LL] trace");
+        return -1;
+    }
+    printf("[LL] Trace of %u events written to %s\n", count, g_path);
+    return 0;
+}
+
+#endif // LL_TRACE
@@ -0,0 +1,114 @@
+// Binary event trace of the link layer header.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+// Events are recorded only when built with -DLL_TRACE (make trace);
+// otherwise every TRACE_*() below expands to nothing. The trace is kept in
+// a ring of the last TRACE_SLOTS events and written to a file at llclose()
+// or on SIGUSR1. tools/trace_decode.c prints such a file.
+
+#define TRACE_SLOTS 8192 // Power of two
+#define TRACE_MAGIC "LLTR"
+#define TRACE_VERSION 1
+
+typedef enum
+{
+    TraceOpen,     // a: role (0 tx, 1 rx), b: window, c: framing flags
+    TraceITx,      // a: Ns, b: attempt, c: frame length
+    TraceIRx,      // a: Ns, b: FrameStatus, c: payload length
+    TraceSTx,      // a: C, b: A
+    TraceSRx,      // a: C, b: FrameStatus
+    TraceAck,      // a: Nr, b: frames acknowledged
+    TraceRej,      // a: Nr, b: 1 if held back
+    TraceGoBack,   // a: Ns, b: attempt of the oldest frame
+    TraceTimer,    // a: TraceTimerKind
+    TraceLinkDown, //
+    TraceLinkUp,   // c: ms spent down
+    TraceFail,     // b: frames dropped
+    TraceClose,    //
+    TraceTypes,
+} TraceType;
+
+typedef enum
+{
+    TimerRetransmit, // Oldest frame not acknowledged
+    TimerAck,        // Delayed RR due
+    TimerKeepalive,  // Idle link poll
+    TimerProbe,      // Poll while the link is down
+} TraceTimerKind;
+
+// One event, 16 bytes
+typedef struct
+{
+    uint64_t ns; // CLOCK_MONOTONIC
+    uint8_t type;
+    uint8_t a;
+    uint16_t b;
+    uint32_t c;
+} TraceEvent;
+
+// File header, followed by count events, oldest first. Host byte order.
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t eventSize;
+    uint32_t count;
+    uint32_t lost; // Overwritten in the ring before the dump
+} TraceHeader;
+
+#ifdef LL_TRACE
+
+#include <time.h>
+
+typedef struct
+{
+    TraceEvent ev[TRACE_SLOTS];
+    uint32_t next;
+    volatile int dumpRequested; // Set by SIGUSR1
+} TraceRing;
+
+extern TraceRing g_trace;
+
+static inline void trace_record(int type, unsigned a, unsigned b, unsigned c)
+{
+    TraceEvent *e = &g_trace.ev[g_trace.next++ & (TRACE_SLOTS - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    e->ns = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    e->type = (uint8_t)type;
+    e->a = (uint8_t)a;
+    e->b = (uint16_t)b;
+    e->c = (uint32_t)c;
+}
+
+// Empty the ring and dump it to path (or $LL_TRACE_FILE) on SIGUSR1.
+void trace_open(const char *path);
+
+// Write the ring to the file given to trace_open(). Return 0 or -1.
+int trace_dump(void);
+
+#define TRACE(type, a, b, c) trace_record((type), (a), (b), (c))
+#define TRACE_OPEN(path) trace_open(path)
+#define TRACE_DUMP() (void)trace_dump()
+// Dump if SIGUSR1 arrived since the last call
+#define TRACE_POLL()                  \
+    do                                \
+    {                                 \
+        if (g_trace.dumpRequested)    \
+            (void)trace_dump();       \
+    } while (0)
+
+#else
+
+#define TRACE(type, a, b, c) ((void)0)
+#define TRACE_OPEN(path) ((void)0)
+#define TRACE_DUMP() ((void)0)
+#define TRACE_POLL() ((void)0)
+
+#endif // LL_TRACE
+
+#endif // _TRACE_H_
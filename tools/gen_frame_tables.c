@@ -0,0 +1,176 @@
+// Generator of the frame recogniser tables used by src/frame.c.
+// Run by the Makefile: ./bin/gen_frame_tables > src/frame_tables.h
+//
+// New control codes are added to the ctrl_codes[] list below; the
+// recogniser itself does not need to change.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../src/frame.h"
+
+// Recogniser states
+static const char *states[] = {
+    "DF_HUNT",   // Discarding bytes until a FLAG
+    "DF_FLAG",   // FLAG received, waiting for A
+    "DF_A",      // A received, waiting for C
+    "DF_C",      // C received, waiting for BCC1
+    "DF_HEADER", // BCC1 ok, waiting for data or the closing FLAG
+    "DF_DATA",   // Inside the information field
+    "DF_ESC",    // ESC received inside the information field
+    "DF_LEN",    // Length-prefixed C received, reading the length field
+    "DF_TAIL",   // Length-prefixed field complete, waiting for the closing FLAG
+};
+enum { DF_HUNT, DF_FLAG, DF_A, DF_C, DF_HEADER, DF_DATA, DF_ESC, DF_LEN, DF_TAIL, DF_STATES };
+
+// Byte classes
+static const char *classes[] = {"BC_OTHER", "BC_FLAG", "BC_ESC"};
+enum { BC_OTHER, BC_FLAG, BC_ESC, BC_CLASSES };
+
+// Actions run on a transition
+static const char *actions[] = {
+    "ACT_NONE",
+    "ACT_SAVE_A",
+    "ACT_SAVE_C",     // Also precomputes the expected BCC1, goes to DF_LEN if C says so
+    "ACT_CHECK_BCC1", // Falls back to DF_HUNT on mismatch
+    "ACT_STORE",
+    "ACT_STORE_ESC",
+    "ACT_END",        // Closing FLAG, emit the frame
+    "ACT_ABORT",      // FLAG right after ESC, emit a damaged frame
+    "ACT_SHORT",      // FLAG inside the header, emit a truncated frame
+    "ACT_SAVE_LEN",   // One length byte, goes to DF_C after the last one
+};
+enum { ACT_NONE, ACT_SAVE_A, ACT_SAVE_C, ACT_CHECK_BCC1, ACT_STORE, ACT_STORE_ESC, ACT_END, ACT_ABORT, ACT_SHORT, ACT_SAVE_LEN, ACT_COUNT };
+
+// CRC-32 of IEEE 802.3, bit-reversed
+#define CRC32_POLY 0xEDB88320u
+
+#define T(next, action) ((unsigned char)((next) | ((action) << 4)))
+
+static const unsigned char transitions[DF_STATES][BC_CLASSES] = {
+    //               BC_OTHER                      BC_FLAG                  BC_ESC
+    [DF_HUNT]   = {T(DF_HUNT, ACT_NONE),         T(DF_FLAG, ACT_NONE),  T(DF_HUNT, ACT_NONE)},
+    [DF_FLAG]   = {T(DF_A, ACT_SAVE_A),          T(DF_FLAG, ACT_NONE),  T(DF_A, ACT_SAVE_A)},
+    [DF_A]      = {T(DF_C, ACT_SAVE_C),          T(DF_FLAG, ACT_SHORT), T(DF_C, ACT_SAVE_C)},
+    [DF_C]      = {T(DF_HEADER, ACT_CHECK_BCC1), T(DF_FLAG, ACT_SHORT), T(DF_HEADER, ACT_CHECK_BCC1)},
+    [DF_HEADER] = {T(DF_DATA, ACT_STORE),        T(DF_FLAG, ACT_END),   T(DF_ESC, ACT_NONE)},
+    [DF_DATA]   = {T(DF_DATA, ACT_STORE),        T(DF_FLAG, ACT_END),   T(DF_ESC, ACT_NONE)},
+    [DF_ESC]    = {T(DF_DATA, ACT_STORE_ESC),    T(DF_FLAG, ACT_ABORT), T(DF_DATA, ACT_STORE_ESC)},
+    [DF_LEN]    = {T(DF_LEN, ACT_SAVE_LEN),      T(DF_FLAG, ACT_SHORT), T(DF_LEN, ACT_SAVE_LEN)},
+    [DF_TAIL]   = {T(DF_HUNT, ACT_ABORT),        T(DF_FLAG, ACT_END),   T(DF_HUNT, ACT_ABORT)},
+};
+
+typedef struct
+{
+    unsigned char C;
+    FrameType type;
+    unsigned char seq;
+    unsigned char pf;
+    unsigned char mod8;
+    unsigned char len; // Length field follows C
+} CtrlCode;
+
+static const CtrlCode ctrl_codes[] = {
+    {C_I(0), FrameI, 0},
+    {C_I(1), FrameI, 1},
+    {C_I(0) | C_LEN, FrameI, 0, 0, 0, 1},
+    {C_I(1) | C_LEN, FrameI, 1, 0, 0, 1},
+    {C_RR(0), FrameRR, 0},
+    {C_RR(1), FrameRR, 1},
+    {C_REJ(0), FrameREJ, 0},
+    {C_REJ(1), FrameREJ, 1},
+    {C_RR_PF(0), FrameRR, 0, 1},
+    {C_RR_PF(1), FrameRR, 1, 1},
+#define MOD8(n) \
+    {C_IW(n), FrameI, n, 0, 1}, {C_IW(n) | C_LEN, FrameI, n, 0, 1, 1}, {C_RRW(n), FrameRR, n, 0, 1}, \
+    {C_RRW_PF(n), FrameRR, n, 1, 1}, {C_REJW(n), FrameREJ, n, 0, 1}
+    MOD8(0), MOD8(1), MOD8(2), MOD8(3), MOD8(4), MOD8(5), MOD8(6), MOD8(7),
+    {C_Set, FrameSET, 0},
+    {C_UA, FrameUA, 0},
+    {C_DISC, FrameDISC, 0},
+    {C_SETX, FrameSET, 0},
+    {C_UAX, FrameUA, 0},
+};
+
+static void print_enum(const char *names[], int n, const char *last)
+{
+    printf("enum\n{\n");
+    for (int i = 0; i < n; ++i)
+        printf("    %s,\n", names[i]);
+    printf("    %s,\n};\n\n", last);
+}
+
+int main(void)
+{
+    unsigned char byteClass[256] = {0};
+    byteClass[FLAG] = BC_FLAG;
+    byteClass[ESC] = BC_ESC;
+
+    unsigned short ctrlClass[256];
+    for (int c = 0; c < 256; ++c)
+        ctrlClass[c] = FrameUnknown;
+    for (unsigned i = 0; i < sizeof(ctrl_codes) / sizeof(ctrl_codes[0]); ++i)
+    {
+        const CtrlCode *code = &ctrl_codes[i];
+        if (ctrlClass[code->C] != FrameUnknown)
+        {
+            fprintf(stderr, "gen_frame_tables: duplicate control code 0x%02X\n", code->C);
+            return 1;
+        }
+        ctrlClass[code->C] = (unsigned short)(code->type | (code->seq << 4) | (code->pf << 7) |
+                                              (code->mod8 << 8) | (code->len << 9));
+    }
+
+    printf("// Frame recogniser tables.\n"
+           "// Generated by tools/gen_frame_tables.c, DO NOT EDIT.\n\n"
+           "#ifndef _FRAME_TABLES_H_\n"
+           "#define _FRAME_TABLES_H_\n\n"
+           "#include <stdint.h>\n\n");
+    print_enum(states, DF_STATES, "DF_STATES");
+    print_enum(classes, BC_CLASSES, "BC_CLASSES");
+    print_enum(actions, ACT_COUNT, "ACT_COUNT");
+
+    printf("// Byte class of every input byte\n"
+           "static const unsigned char fr_byte_class[256] = {");
+    for (int b = 0; b < 256; ++b)
+        printf("%s%u,", (b % 16) ? " " : "\n    ", byteClass[b]);
+    printf("\n};\n\n");
+
+    // COBS-encoded fields have no escapes
+    byteClass[ESC] = BC_OTHER;
+    printf("// Byte class of every input byte with COBS framing\n"
+           "static const unsigned char fr_byte_class_cobs[256] = {");
+    for (int b = 0; b < 256; ++b)
+        printf("%s%u,", (b % 16) ? " " : "\n    ", byteClass[b]);
+    printf("\n};\n\n");
+
+    printf("// FrameType (bits 0-3), sequence number (bits 4-6), poll/final bit (7),\n"
+           "// modulo 8 numbering (8) and length field (9) of every C\n"
+           "static const unsigned short fr_ctrl_class[256] = {");
+    for (int c = 0; c < 256; ++c)
+        printf("%s0x%03X,", (c % 16) ? " " : "\n    ", ctrlClass[c]);
+    printf("\n};\n\n");
+
+    printf("// CRC-32 (reflected polynomial 0x%08X) of every byte value\n"
+           "static const uint32_t fr_crc32[256] = {", CRC32_POLY);
+    for (int b = 0; b < 256; ++b)
+    {
+        uint32_t crc = (uint32_t)b;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+        printf("%s0x%08X,", (b % 8) ? " " : "\n    ", crc);
+    }
+    printf("\n};\n\n");
+
+    printf("// Next state (low nibble) and action (high nibble) per state and byte class\n"
+           "static const unsigned char fr_next[DF_STATES][BC_CLASSES] = {\n");
+    for (int s = 0; s < DF_STATES; ++s)
+    {
+        printf("    [%s] = {", states[s]);
+        for (int c = 0; c < BC_CLASSES; ++c)
+            printf("%s0x%02X", c ? ", " : "", transitions[s][c]);
+        printf("},\n");
+    }
+    printf("};\n\n#endif // _FRAME_TABLES_H_\n");
+    return 0;
+}
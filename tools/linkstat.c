@@ -0,0 +1,183 @@
+// Live view of the metrics a running link publishes (src/metrics.h).
+// Usage: ./bin/linkstat [-i ms] [port]
+//
+// With no port, lists the open links, or watches the only one. The
+// segment is mapped read-only, so watching never disturbs the transfer.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/metrics.h"
+
+#define DEFAULT_INTERVAL_MS 1000
+#define RATE_SMOOTHING 0.3 // Weight of the newest interval in the goodput
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+static void format_bytes(double bytes, char *out, int size)
+{
+    if (bytes >= 1e6)
+        snprintf(out, size, "%.2f MB", bytes / 1e6);
+    else if (bytes >= 1e3)
+        snprintf(out, size, "%.1f kB", bytes / 1e3);
+    else
+        snprintf(out, size, "%.0f B", bytes);
+}
+
+// Shared memory object names of the open links. Return how many were found.
+static int list_links(char names[][64], int max)
+{
+    DIR *dir = opendir("/dev/shm");
+    if (dir == NULL)
+        return 0;
+    int n = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && n < max)
+    {
+        if (strncmp(entry->d_name, METRICS_PREFIX + 1, strlen(METRICS_PREFIX) - 1) == 0 &&
+            strlen(entry->d_name) < 63)
+        {
+            names[n][0] = '/';
+            strcpy(names[n++] + 1, entry->d_name);
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+static void print_line(const LinkMetrics *m, double elapsed, double rate, double interval,
+                       const LinkMetrics *prev)
+{
+    char moved[32];
+    char speed[32];
+    uint64_t bytes = m->role == 0 ? m->bytesAcked : m->bytesReceived;
+    format_bytes((double)bytes, moved, sizeof(moved));
+    format_bytes(rate, speed, sizeof(speed));
+    printf("%7.1f s  %s %s  %s/s", elapsed, m->role == 0 ? "acked" : "received", moved, speed);
+    if (m->role == 0)
+    {
+        uint64_t sent = m->framesSent - prev->framesSent;
+        uint64_t resent = m->framesResent - prev->framesResent;
+        printf("  window %d/%d  RTT %.1f ms  resent %.1f%%  REJ %.2f/s  timeouts %.2f/s",
+               m->inFlight, m->window, m->srttUs / 1000.0, sent ? 100.0 * resent / sent : 0.0,
+               (m->rejReceived - prev->rejReceived) / interval, (m->timeouts - prev->timeouts) / interval);
+    }
+    else
+        printf("  damaged %.2f/s  REJ sent %.2f/s", (m->framesDamaged - prev->framesDamaged) / interval,
+               (m->rejSent - prev->rejSent) / interval);
+    if (m->transferTotal > 0)
+    {
+        int64_t left = m->transferTotal - m->transferDone;
+        printf("  %.0f%%", 100.0 * m->transferDone / m->transferTotal);
+        if (left > 0 && rate > 0)
+        {
+            long eta = (long)(left / rate);
+            printf(" ETA %ld:%02ld", eta / 60, eta % 60);
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static int watch(const char *name, int intervalMs)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "linkstat: %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    const LinkMetrics *m = mmap(NULL, sizeof(LinkMetrics), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+    {
+        perror("linkstat: mmap");
+        return 1;
+    }
+    while (__atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC)
+        sleep_ms(10);
+
+    printf("%s: %s, pid %u\n", name, m->role == 0 ? "transmitter" : "receiver", m->pid);
+    struct timespec start = {.tv_sec = (time_t)(m->startNs / 1000000000u),
+                             .tv_nsec = (long)(m->startNs % 1000000000u)};
+    double startS = start.tv_sec + start.tv_nsec / 1e9;
+    LinkMetrics prev = *m;
+    double prevS = now_s();
+    double rate = -1;
+    while (1)
+    {
+        sleep_ms(intervalMs);
+        LinkMetrics cur = *m;
+        double t = now_s();
+        double interval = t - prevS;
+        uint64_t bytes = cur.role == 0 ? cur.bytesAcked : cur.bytesReceived;
+        uint64_t before = prev.role == 0 ? prev.bytesAcked : prev.bytesReceived;
+        double sample = (bytes - before) / interval;
+        rate = rate < 0 ? sample : RATE_SMOOTHING * sample + (1 - RATE_SMOOTHING) * rate;
+        print_line(&cur, t - startS, rate, interval, &prev);
+        prev = cur;
+        prevS = t;
+        if (cur.closed || (kill((pid_t)cur.pid, 0) < 0 && errno == ESRCH))
+        {
+            printf("Link closed\n");
+            break;
+        }
+    }
+    munmap((void *)m, sizeof(LinkMetrics));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int intervalMs = DEFAULT_INTERVAL_MS;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:")) != -1)
+    {
+        if (opt == 'i' && atoi(optarg) > 0)
+            intervalMs = atoi(optarg);
+        else
+        {
+            fprintf(stderr, "Usage: %s [-i ms] [port]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    char name[64];
+    if (optind < argc)
+        metrics_name(argv[optind], name, sizeof(name));
+    else
+    {
+        char names[16][64];
+        int n = list_links(names, 16);
+        if (n != 1)
+        {
+            printf(n == 0 ? "No open links\n" : "Open links:\n");
+            for (int i = 0; i < n; i++)
+                printf("  %s\n", names[i] + strlen(METRICS_PREFIX));
+            return n == 0 ? 1 : 0;
+        }
+        snprintf(name, sizeof(name), "%s", names[0]);
+    }
+    return watch(name, intervalMs);
+}
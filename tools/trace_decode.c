@@ -0,0 +1,139 @@
+// Decoder of the binary link layer traces written by a -DLL_TRACE build.
+// Usage: ./bin/trace_decode ll-tx.trace
+//
+// One line per event: milliseconds since the first event, the time since
+// the previous one, the event and its fields.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/frame.h"
+#include "../src/trace.h"
+
+static const char *statuses[] = {"ok", "bad header", "bad data", "overflow"};
+static const char *timers[] = {"retransmit", "ack", "keepalive", "probe"};
+
+static const char *status_name(unsigned status)
+{
+    return status < sizeof(statuses) / sizeof(statuses[0]) ? statuses[status] : "?";
+}
+
+// Name of a supervision control field
+static const char *control_name(unsigned char C, char *buf, int size)
+{
+    if (C == C_Set || C == C_SETX)
+        return C == C_Set ? "SET" : "SETX";
+    if (C == C_UA || C == C_UAX)
+        return C == C_UA ? "UA" : "UAX";
+    if (C == C_DISC)
+        return "DISC";
+    if (C == C_RR(0) || C == C_RR(1))
+        snprintf(buf, size, "RR(%u)", C & 0x01);
+    else if (C == C_RR_PF(0) || C == C_RR_PF(1))
+        snprintf(buf, size, "RR(%u) P/F", C & 0x01);
+    else if (C == C_REJ(0) || C == C_REJ(1))
+        snprintf(buf, size, "REJ(%u)", C & 0x01);
+    else if ((C & 0xF8) == C_RRW(0))
+        snprintf(buf, size, "RR(%u)", C & 0x07);
+    else if ((C & 0xF8) == C_RRW_PF(0))
+        snprintf(buf, size, "RR(%u) P/F", C & 0x07);
+    else if ((C & 0xF8) == C_REJW(0))
+        snprintf(buf, size, "REJ(%u)", C & 0x07);
+    else
+        snprintf(buf, size, "C=0x%02X", C);
+    return buf;
+}
+
+static void print_event(const TraceEvent *e)
+{
+    char name[32];
+    switch (e->type)
+    {
+    case TraceOpen:
+        printf("OPEN      %s window %u%s%s%s\n", e->a ? "rx" : "tx", e->b,
+               (e->c & 0x01) ? " cobs" : " ppp", (e->c & 0x02) ? " length-prefixed" : "",
+               (e->c & 0x04) ? " cumulative-ack" : "");
+        break;
+    case TraceITx:
+        printf("I  tx     Ns=%u try %u, %u bytes\n", e->a, e->b, e->c);
+        break;
+    case TraceIRx:
+        printf("I  rx     Ns=%u %s, %u bytes\n", e->a, status_name(e->b), e->c);
+        break;
+    case TraceSTx:
+        printf("S  tx     %s A=0x%02X\n", control_name(e->a, name, sizeof(name)), e->b);
+        break;
+    case TraceSRx:
+        printf("S  rx     %s %s\n", control_name(e->a, name, sizeof(name)), status_name(e->b));
+        break;
+    case TraceAck:
+        printf("ACK       Nr=%u, %u frame(s)\n", e->a, e->b);
+        break;
+    case TraceRej:
+        printf("REJ       Nr=%u%s\n", e->a, e->b ? " (held, already sent)" : "");
+        break;
+    case TraceGoBack:
+        printf("GO-BACK   Ns=%u, oldest frame sent %u time(s)\n", e->a, e->b);
+        break;
+    case TraceTimer:
+        printf("TIMER     %s\n", e->a < 4 ? timers[e->a] : "?");
+        break;
+    case TraceLinkDown:
+        printf("LINK DOWN\n");
+        break;
+    case TraceLinkUp:
+        printf("LINK UP   after %u ms\n", e->c);
+        break;
+    case TraceFail:
+        printf("FAIL      %u frame(s) dropped\n", e->b);
+        break;
+    case TraceClose:
+        printf("CLOSE\n");
+        break;
+    default:
+        printf("?         type %u a=%u b=%u c=%u\n", e->type, e->a, e->b, e->c);
+        break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION || header.eventSize != sizeof(TraceEvent))
+    {
+        fprintf(stderr, "%s: not a version %d trace\n", argv[1], TRACE_VERSION);
+        fclose(file);
+        return 1;
+    }
+    printf("%u events", header.count);
+    if (header.lost > 0)
+        printf(", %u older ones overwritten", header.lost);
+    printf("\n%12s %10s  event\n", "ms", "delta");
+
+    TraceEvent e;
+    uint64_t first = 0;
+    uint64_t prev = 0;
+    for (uint32_t i = 0; i < header.count && fread(&e, sizeof(e), 1, file) == 1; i++)
+    {
+        if (i == 0)
+            first = prev = e.ns;
+        printf("%12.3f %+10.3f  ", (e.ns - first) / 1e6, (e.ns - prev) / 1e6);
+        print_event(&e);
+        prev = e.ns;
+    }
+    fclose(file);
+    return 0;
+}